@@ -0,0 +1,907 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+/* Micro-benchmarks of the farm model, using in-memory storages. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <gflags/gflags.h>
+#include <unistd.h>
+
+#include "model/model_farm.h"
+#include "model/model_job.h"
+#include "model/model_task.h"
+#include "storage/storage_async.h"
+#include "storage/storage_database_sqlite.h"
+#include "storage/storage_dryrun.h"
+#include "storage/storage_log.h"
+#include "util/util_algorithm.h"
+#include "util/util_foreach.h"
+#include "util/util_function.h"
+#include "util/util_logging.h"
+#include "util/util_map.h"
+#include "util/util_string.h"
+#include "util/util_thread.h"
+#include "util/util_time.h"
+#include "util/util_vector.h"
+
+DEFINE_string(benchmark, "all", "Name of the benchmark to run, or 'all'.");
+DEFINE_int32(seed, 1, "Seed for the random number generator.");
+DEFINE_int32(num_dispatches, 100000, "Number of tasks to dispatch.");
+DEFINE_int32(batch_size, 100, "Number of dispatches per timed batch.");
+DEFINE_int32(edits_per_batch, 10, "Number of job priority changes "
+                                  "done between dispatch batches.");
+DEFINE_int32(num_jobs, 64, "Number of jobs to create in the farm.");
+DEFINE_int32(max_threads, 8, "Maximum number of dispatching threads.");
+DEFINE_string(database, ":memory:", "SQLite database used by benchmarks "
+                                    "which need a real storage.");
+DEFINE_int32(num_restore_tasks, 10000000, "Number of tasks in the storage "
+                                          "restored by the restore "
+                                          "benchmark.");
+DEFINE_double(restore_running_fraction, 0.01, "Fraction of the jobs which "
+                                              "are running in the restore "
+                                              "benchmark, the rest of them "
+                                              "are completed.");
+DEFINE_string(storage_path, "/tmp/farm_benchmark", "Base name of the files "
+                                                  "written by the storage "
+                                                  "updates benchmark.");
+DEFINE_int32(requests_per_idle, 10, "Number of requests served between the "
+                                   "idle handler calls in the storage "
+                                   "latency benchmark.");
+DEFINE_int32(num_scan_jobs, 100000, "Number of jobs in the farm scanned by "
+                                    "the job scans benchmark.");
+
+namespace Farm {
+
+namespace {
+
+/* Timings of a sequence of measured operations. */
+class Timings {
+ public:
+  void add(double t) { samples_.push_back(t); }
+
+  void report(const string& name, int ops_per_sample = 1) {
+    if(samples_.empty()) {
+      return;
+    }
+    vector<double> sorted = samples_;
+    sort(sorted.begin(), sorted.end());
+    double total = 0.0;
+    foreach(double t, sorted) {
+      total += t;
+    }
+    double scale = 1e6 / ops_per_sample;
+    LOG(INFO) << name << ": "
+              << "mean " << total / sorted.size() * scale << " us, "
+              << "p50 " << sorted[sorted.size() / 2] * scale << " us, "
+              << "p99 " << sorted[sorted.size() * 99 / 100] * scale << " us, "
+              << "max " << sorted.back() * scale << " us.";
+  }
+
+ protected:
+  vector<double> samples_;
+};
+
+/* Resident set size of the process in bytes, 0 if it's unknown. */
+size_t resident_set_size() {
+  FILE *file = fopen("/proc/self/statm", "r");
+  if(file == NULL) {
+    return 0;
+  }
+  long num_pages = 0, num_resident_pages = 0;
+  if(fscanf(file, "%ld %ld", &num_pages, &num_resident_pages) != 2) {
+    num_resident_pages = 0;
+  }
+  fclose(file);
+  return (size_t)num_resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+/* Dispatch latency while priorities of random jobs are being changed. */
+void benchmark_dispatch_reprioritize() {
+  DryRunStorage storage(true);
+  storage.connect();
+  Farm farm(&storage);
+  double start_time = util_time_dt();
+  farm.restore();
+  LOG(INFO) << "Farm restored in " << util_time_dt() - start_time
+            << " seconds.";
+  vector<Job*> jobs = farm.jobs();
+  srand(FLAGS_seed);
+  for(int edits = 0; edits <= FLAGS_edits_per_batch;
+      edits += FLAGS_edits_per_batch) {
+    Timings dispatch_timings, edit_timings;
+    int num_batches = FLAGS_num_dispatches / FLAGS_batch_size / 2;
+    for(int batch = 0; batch < num_batches; ++batch) {
+      for(int i = 0; i < edits; ++i) {
+        Job *job = jobs[rand() % jobs.size()];
+        double edit_start = util_time_dt();
+        farm.set_job_priority(job, rand() % 100);
+        edit_timings.add(util_time_dt() - edit_start);
+      }
+      double batch_start = util_time_dt();
+      for(int i = 0; i < FLAGS_batch_size; ++i) {
+        farm.dispatch_task();
+      }
+      dispatch_timings.add(util_time_dt() - batch_start);
+    }
+    string suffix = string_printf(" (%d edits per batch)", edits);
+    dispatch_timings.report("Dispatch" + suffix, FLAGS_batch_size);
+    edit_timings.report("Priority change" + suffix);
+    if(FLAGS_edits_per_batch == 0) {
+      break;
+    }
+  }
+  storage.disconnect();
+}
+
+/* Tasks per second when dispatching tasks one by one and in batches,
+ * using SQLite storage so the cost of storage updates is included.
+ */
+void benchmark_dispatch_batch() {
+  const int batch_sizes[] = {1, 8, 32, 128};
+  foreach(int batch_size, batch_sizes) {
+    SQLiteStorage storage(FLAGS_database);
+    storage.connect();
+    storage.create_schema();
+    Farm farm(&storage);
+    for(int i = 0; i < FLAGS_num_jobs; ++i) {
+      farm.insert_job(50,
+                      Job::STATUS_WAITING,
+                      string_printf("Job %d", i),
+                      string_printf("user%d", i % 4));
+    }
+    vector<Task*> tasks;
+    int num_dispatched = 0;
+    double start_time = util_time_dt();
+    while(num_dispatched < FLAGS_num_dispatches) {
+      tasks.clear();
+      if(batch_size == 1) {
+        if(farm.dispatch_task() == NULL) {
+          break;
+        }
+        ++num_dispatched;
+      } else {
+        int num_tasks = farm.dispatch_tasks(batch_size, &tasks);
+        if(num_tasks == 0) {
+          break;
+        }
+        num_dispatched += num_tasks;
+      }
+    }
+    farm.store();
+    double time_total = util_time_dt() - start_time;
+    LOG(INFO) << "Batch size " << batch_size << ": "
+              << num_dispatched / time_total << " tasks per second.";
+    storage.disconnect();
+  }
+}
+
+void dispatch_thread_run(Farm *farm, int num_tasks, int batch_size) {
+  vector<Task*> tasks;
+  while(num_tasks > 0) {
+    tasks.clear();
+    int num_dispatched = farm->dispatch_tasks(min(batch_size, num_tasks),
+                                              &tasks);
+    if(num_dispatched == 0) {
+      break;
+    }
+    num_tasks -= num_dispatched;
+  }
+}
+
+/* Dispatch throughput with multiple threads dispatching at once,
+ * farm uses one dispatch shard per thread.
+ */
+void benchmark_dispatch_threads() {
+  for(int num_threads = 1;
+      num_threads <= FLAGS_max_threads;
+      num_threads *= 2) {
+    DryRunStorage storage(true);
+    storage.connect();
+    Farm farm(&storage, num_threads);
+    farm.restore();
+    vector<thread*> threads;
+    int tasks_per_thread = FLAGS_num_dispatches / num_threads;
+    double start_time = util_time_dt();
+    for(int i = 0; i < num_threads; ++i) {
+      threads.push_back(new thread(function_bind(dispatch_thread_run,
+                                                 &farm,
+                                                 tasks_per_thread,
+                                                 1)));
+    }
+    foreach(thread *dispatch_thread, threads) {
+      dispatch_thread->join();
+      delete dispatch_thread;
+    }
+    double time_total = util_time_dt() - start_time;
+    LOG(INFO) << num_threads << " thread(s): "
+              << tasks_per_thread * num_threads / time_total
+              << " tasks per second.";
+    farm.store();
+    storage.disconnect();
+  }
+}
+
+/* Share of dispatched tasks per owner with fair share enabled,
+ * owner userN has weight of N + 1. Owners with smaller weights have
+ * higher priority jobs, which must not take them over their share.
+ */
+void benchmark_dispatch_fair_share() {
+  const int num_owners = 4;
+  SQLiteStorage storage(FLAGS_database);
+  storage.connect();
+  storage.create_schema();
+  Farm farm(&storage);
+  farm.set_fair_share(true);
+  for(int i = 0; i < num_owners; ++i) {
+    farm.set_owner_weight(string_printf("user%d", i), i + 1);
+  }
+  for(int i = 0; i < FLAGS_num_jobs; ++i) {
+    int owner = i % num_owners;
+    farm.insert_job(80 - 10 * owner,
+                    Job::STATUS_WAITING,
+                    string_printf("Job %d", i),
+                    string_printf("user%d", owner));
+  }
+  int num_dispatched = 0;
+  double start_time = util_time_dt();
+  while(num_dispatched < FLAGS_num_dispatches) {
+    if(farm.dispatch_task() == NULL) {
+      break;
+    }
+    ++num_dispatched;
+  }
+  double time_total = util_time_dt() - start_time;
+  LOG(INFO) << "Dispatched " << num_dispatched / time_total
+            << " tasks per second.";
+  map<string, int> num_owner_tasks;
+  foreach(Job *job, farm.jobs()) {
+    foreach(const Task& task, job->tasks()) {
+      if(task.status() == Task::STATUS_ACTIVE) {
+        ++num_owner_tasks[job->owner()];
+      }
+    }
+  }
+  for(int i = 0; i < num_owners; ++i) {
+    string owner = string_printf("user%d", i);
+    LOG(INFO) << owner << " (weight " << i + 1 << "): "
+              << 100.0 * num_owner_tasks[owner] / num_dispatched
+              << "% of tasks.";
+  }
+  farm.store();
+  storage.disconnect();
+}
+
+/* Cost of the task leases with many tasks in flight: dispatch, lease
+ * extension and expiration of all the leases at once.
+ */
+void benchmark_task_leases() {
+  DryRunStorage storage(true);
+  storage.connect();
+  Farm farm(&storage);
+  farm.restore();
+  vector<Task*> tasks;
+  double start_time = util_time_dt();
+  while(tasks.size() < FLAGS_num_dispatches) {
+    if(farm.dispatch_tasks(FLAGS_batch_size, &tasks) == 0) {
+      break;
+    }
+  }
+  double time_total = util_time_dt() - start_time;
+  LOG(INFO) << "Dispatched " << tasks.size() / time_total
+            << " tasks per second, " << tasks.size() << " leased.";
+  if(tasks.empty()) {
+    return;
+  }
+  srand(FLAGS_seed);
+  Timings extend_timings;
+  int num_batches = FLAGS_num_dispatches / FLAGS_batch_size;
+  for(int batch = 0; batch < num_batches; ++batch) {
+    double batch_start = util_time_dt();
+    for(int i = 0; i < FLAGS_batch_size; ++i) {
+      farm.extend_task_lease(tasks[rand() % tasks.size()]->id());
+    }
+    extend_timings.add(util_time_dt() - batch_start);
+  }
+  extend_timings.report("Lease extension", FLAGS_batch_size);
+  /* Make all the leases expire right away. */
+  farm.task_lease_time = 0.0;
+  foreach(Task *task, tasks) {
+    farm.extend_task_lease(task->id());
+  }
+  farm.store();
+  util_time_sleep(0.2);
+  start_time = util_time_dt();
+  farm.idle_handler();
+  LOG(INFO) << "Expired " << tasks.size() << " leases in "
+            << util_time_dt() - start_time << " seconds.";
+  tasks.clear();
+  farm.dispatch_tasks(FLAGS_num_dispatches, &tasks);
+  LOG(INFO) << "Dispatched " << tasks.size() << " tasks after expiration.";
+  storage.disconnect();
+}
+
+/* Dispatch and completion throughput of pipeline jobs: first task of
+ * every job is a simulation, all the other tasks except the last one
+ * render its result, and the last task composites all the renders.
+ * Every job depends on the previous one.
+ */
+void benchmark_task_dependencies() {
+  SQLiteStorage storage(FLAGS_database);
+  storage.connect();
+  storage.create_schema();
+  Farm farm(&storage);
+  const int num_tasks = Job::NUM_GENERATED_TASKS;
+  vector<Job::TaskDependency> task_dependencies;
+  for(int task = 1; task < num_tasks - 1; ++task) {
+    Job::TaskDependency render = {task, 0};
+    Job::TaskDependency composite = {num_tasks - 1, task};
+    task_dependencies.push_back(render);
+    task_dependencies.push_back(composite);
+  }
+  vector<Job*> job_dependencies;
+  for(int i = 0; i < FLAGS_num_jobs; ++i) {
+    Job *job = farm.insert_job(50,
+                               Job::STATUS_WAITING,
+                               string_printf("Job %d", i),
+                               string_printf("user%d", i % 4),
+                               task_dependencies,
+                               job_dependencies);
+    job_dependencies.assign(1, job);
+  }
+  vector<Task*> tasks;
+  int num_completed = 0, num_requests = 0;
+  double start_time = util_time_dt();
+  for(;;) {
+    tasks.clear();
+    if(farm.dispatch_tasks(FLAGS_batch_size, &tasks) == 0) {
+      break;
+    }
+    ++num_requests;
+    foreach(Task *task, tasks) {
+      farm.complete_task(task->id());
+    }
+    num_completed += tasks.size();
+  }
+  farm.store();
+  double time_total = util_time_dt() - start_time;
+  LOG(INFO) << "Completed " << num_completed << " tasks of "
+            << FLAGS_num_jobs << " jobs in " << num_requests
+            << " requests, " << num_completed / time_total
+            << " tasks per second.";
+  storage.disconnect();
+}
+
+/* Run jobs to completion, completing tasks one by one or reporting the
+ * whole dispatched batch at once. Returns tasks completed per second.
+ */
+double run_task_reports(bool batched) {
+  SQLiteStorage storage(FLAGS_database);
+  storage.connect();
+  storage.create_schema();
+  Farm farm(&storage);
+  for(int i = 0; i < FLAGS_num_jobs; ++i) {
+    farm.insert_job(50,
+                    Job::STATUS_WAITING,
+                    string_printf("Job %d", i),
+                    string_printf("user%d", i % 4));
+  }
+  vector<Task*> tasks;
+  vector<Farm::TaskReport> reports;
+  int num_completed = 0;
+  double start_time = util_time_dt();
+  farm.dispatch_tasks(FLAGS_batch_size, &tasks);
+  while(!tasks.empty()) {
+    if(batched) {
+      reports.clear();
+      foreach(Task *task, tasks) {
+        Farm::TaskReport report = {task->id(), Task::STATUS_COMPLETED, 1.0};
+        reports.push_back(report);
+      }
+      num_completed += farm.report_tasks(reports);
+    } else {
+      foreach(Task *task, tasks) {
+        num_completed += farm.complete_task(task->id());
+      }
+    }
+    farm.store();
+    tasks.clear();
+    farm.dispatch_tasks(FLAGS_batch_size, &tasks);
+  }
+  double time_total = util_time_dt() - start_time;
+  storage.disconnect();
+  return num_completed / time_total;
+}
+
+/* Completion throughput of single and batched task reports. */
+void benchmark_task_reports() {
+  LOG(INFO) << "Single reports: " << run_task_reports(false)
+            << " tasks per second.";
+  LOG(INFO) << "Batched reports: " << run_task_reports(true)
+            << " tasks per second.";
+}
+
+/* Time and memory needed to restore the farm from the storage. */
+void benchmark_restore() {
+  SQLiteStorage storage(FLAGS_database);
+  storage.connect();
+  storage.create_schema();
+  int num_jobs = FLAGS_num_restore_tasks / Job::NUM_GENERATED_TASKS;
+  int history_task_id = -1;
+  {
+    /* Only jobs are read here, so memory used by tasks is not reused by
+     * the measured restore.
+     */
+    vector<Job*> stored_jobs;
+    storage.retrieve_all_jobs(&stored_jobs);
+    int num_stored_jobs = stored_jobs.size();
+    foreach(Job *job, stored_jobs) {
+      delete job;
+    }
+    Farm farm(&storage);
+    for(int i = num_stored_jobs; i < num_jobs; ++i) {
+      farm.insert_job(50,
+                      Job::STATUS_PAUSED,
+                      string_printf("Job %d", i),
+                      string_printf("user%d", i % 4));
+    }
+    farm.store();
+    /* Last jobs are running, the ones before them are history, so IDs of
+     * the running tasks are far from the first IDs.
+     */
+    storage.retrieve_all_jobs(&stored_jobs);
+    int num_history_jobs =
+        stored_jobs.size() * (1.0 - FLAGS_restore_running_fraction);
+    if(num_history_jobs != 0) {
+      vector<Task> tasks;
+      storage.retrieve_all_tasks(*stored_jobs[0], &tasks);
+      if(!tasks.empty()) {
+        history_task_id = tasks[0].id();
+      }
+    }
+    for(int i = 0; i < stored_jobs.size(); ++i) {
+      Job *job = stored_jobs[i];
+      job->set_status(i < num_history_jobs ? Job::STATUS_COMPLETED
+                                           : Job::STATUS_WAITING);
+      storage.update_job(JobUpdate(*job));
+      delete job;
+    }
+    storage.flush_caches(true);
+  }
+  size_t start_rss = resident_set_size();
+  double start_time = util_time_dt();
+  Farm farm(&storage);
+  farm.restore();
+  double time_total = util_time_dt() - start_time;
+  size_t num_tasks = 0;
+  foreach(Job *job, farm.jobs()) {
+    num_tasks += job->tasks().size();
+  }
+  size_t rss = resident_set_size() - start_rss;
+  LOG(INFO) << "Restored " << farm.jobs().size() << " jobs with "
+            << num_tasks << " tasks in " << time_total << " seconds, "
+            << rss / (1024 * 1024) << " MiB resident, "
+            << (double)rss / max(num_tasks, (size_t)1) << " bytes per task.";
+  /* First task belongs to a completed job unless all jobs are running. */
+  int task_id = history_task_id;
+  start_time = util_time_dt();
+  Task *task = farm.task_by_id(task_id);
+  LOG(INFO) << "Lookup of task " << task_id << " took "
+            << (util_time_dt() - start_time) * 1e3 << " ms, "
+            << (task != NULL ? "found." : "not found.");
+  /* Restart from the image written on shutdown. */
+  string image_filename = FLAGS_storage_path + ".image";
+  start_time = util_time_dt();
+  farm.store_image(image_filename);
+  LOG(INFO) << "Stored farm image in " << util_time_dt() - start_time
+            << " seconds.";
+  {
+    start_time = util_time_dt();
+    Farm image_farm(&storage);
+    bool ok = image_farm.restore_image(image_filename);
+    LOG(INFO) << "Restored " << image_farm.jobs().size() << " jobs from "
+              << "farm image in " << util_time_dt() - start_time
+              << " seconds" << (ok ? "." : ", failed.");
+  }
+  unlink(image_filename.c_str());
+  storage.disconnect();
+}
+
+/* Lookup of random jobs and tasks by their ID. */
+void benchmark_lookup() {
+  DryRunStorage storage(false);
+  storage.connect();
+  Farm farm(&storage);
+  for(int i = 0; i < FLAGS_num_jobs; ++i) {
+    farm.insert_job(50,
+                    Job::STATUS_PAUSED,
+                    string_printf("Job %d", i),
+                    string_printf("user%d", i % 4));
+  }
+  int num_tasks = FLAGS_num_jobs * Job::NUM_GENERATED_TASKS;
+  srand(FLAGS_seed);
+  Timings job_timings, task_timings;
+  int num_found = 0;
+  int num_batches = FLAGS_num_dispatches / FLAGS_batch_size;
+  for(int batch = 0; batch < num_batches; ++batch) {
+    double batch_start = util_time_dt();
+    for(int i = 0; i < FLAGS_batch_size; ++i) {
+      num_found += farm.job_by_id(rand() % FLAGS_num_jobs) != NULL;
+    }
+    job_timings.add(util_time_dt() - batch_start);
+    batch_start = util_time_dt();
+    for(int i = 0; i < FLAGS_batch_size; ++i) {
+      Job *job;
+      num_found += farm.task_by_id(rand() % num_tasks, &job) != NULL;
+    }
+    task_timings.add(util_time_dt() - batch_start);
+  }
+  LOG(INFO) << "Found " << num_found << " of "
+            << num_batches * FLAGS_batch_size * 2 << " lookups, "
+            << num_tasks << " tasks in the farm.";
+  job_timings.report("Job lookup", FLAGS_batch_size);
+  task_timings.report("Task lookup", FLAGS_batch_size);
+  storage.disconnect();
+}
+
+/* Throughput of the task status updates written to the storage in
+ * batches, every batch is made durable before the next one.
+ */
+double run_storage_updates(Storage *storage) {
+  vector<int> task_ids;
+  for(int i = 0; i < FLAGS_num_jobs; ++i) {
+    Job job(-1,
+            50,
+            Job::STATUS_WAITING,
+            string_printf("Job %d", i),
+            string_printf("user%d", i % 4));
+    job.generate_tasks(storage->reserve_ids(Storage::ID_TYPE_TASK,
+                                            Job::NUM_GENERATED_TASKS));
+    storage->insert_job(&job);
+    task_ids.push_back(job.tasks()[0].id());
+  }
+  srand(FLAGS_seed);
+  vector<TaskUpdate> batch;
+  double start_time = util_time_dt();
+  int num_batches = FLAGS_num_dispatches / FLAGS_batch_size;
+  for(int i = 0; i < num_batches; ++i) {
+    batch.clear();
+    for(int j = 0; j < FLAGS_batch_size; ++j) {
+      TaskUpdate task;
+      task.id = task_ids[rand() % task_ids.size()];
+      task.status = Task::STATUS_ACTIVE;
+      task.lease_expire_time = start_time + 60.0;
+      batch.push_back(task);
+    }
+    storage->update_tasks(batch);
+    storage->flush_caches(true);
+  }
+  return num_batches * FLAGS_batch_size / (util_time_dt() - start_time);
+}
+
+/* Task updates written by SQLite and by the log storages. */
+void benchmark_storage_updates() {
+  string sqlite_path = FLAGS_storage_path + ".sqlite";
+  unlink(sqlite_path.c_str());
+  SQLiteStorage sqlite_storage(sqlite_path);
+  sqlite_storage.connect();
+  sqlite_storage.create_schema();
+  LOG(INFO) << "SQLite storage: " << run_storage_updates(&sqlite_storage)
+            << " task updates per second.";
+  sqlite_storage.disconnect();
+  unlink(sqlite_path.c_str());
+
+  /* Log is kept below the snapshot size, so there's a single file. */
+  string log_path = FLAGS_storage_path + ".log.0";
+  unlink(log_path.c_str());
+  LogStorage log_storage(FLAGS_storage_path);
+  log_storage.connect();
+  LOG(INFO) << "Log storage: " << run_storage_updates(&log_storage)
+            << " task updates per second.";
+  log_storage.disconnect();
+  unlink(log_path.c_str());
+}
+
+/* Latency of the requests served from the same thread which runs the idle
+ * handler, as the HTTP server does. Every request dispatches a task and
+ * completes it, time of the idle handler is added to the request which
+ * waited for it.
+ */
+void run_storage_latency(Storage *storage, const string& name) {
+  Farm farm(storage);
+  for(int i = 0; i < FLAGS_num_jobs; ++i) {
+    farm.insert_job(50,
+                    Job::STATUS_WAITING,
+                    string_printf("Job %d", i),
+                    string_printf("user%d", i % 4));
+  }
+  Timings timings;
+  vector<Task*> tasks;
+  double idle_time = 0.0;
+  for(int i = 0; i < FLAGS_num_dispatches; ++i) {
+    if(i % FLAGS_requests_per_idle == 0) {
+      double start_time = util_time_dt();
+      farm.idle_handler();
+      idle_time = util_time_dt() - start_time;
+    }
+    double start_time = util_time_dt();
+    tasks.clear();
+    farm.dispatch_tasks(1, &tasks);
+    foreach(Task *task, tasks) {
+      farm.complete_task(task->id());
+    }
+    timings.add(idle_time + util_time_dt() - start_time);
+    idle_time = 0.0;
+  }
+  double start_time = util_time_dt();
+  farm.store();
+  timings.report(name);
+  LOG(INFO) << "Final store took " << util_time_dt() - start_time
+            << " seconds.";
+}
+
+/* Request latency with storage written from the idle handler and from the
+ * storage writer thread.
+ */
+void benchmark_storage_latency() {
+  string sqlite_path = FLAGS_storage_path + ".sqlite";
+  for(int async = 0; async < 2; ++async) {
+    unlink(sqlite_path.c_str());
+    SQLiteStorage *sqlite_storage = new SQLiteStorage(sqlite_path);
+    sqlite_storage->connect();
+    sqlite_storage->create_schema();
+    /* Same as the server does, but committing often enough for the
+     * commits to happen during the benchmark.
+     */
+    sqlite_storage->use_bulked_transactions = true;
+    sqlite_storage->transaction_commit_interval = 0.1;
+    Storage *storage = sqlite_storage;
+    if(async) {
+      storage = new AsyncStorage(sqlite_storage);
+      storage->connect();
+    }
+    run_storage_latency(storage, async ? "Asynchronous writes"
+                                       : "Synchronous writes");
+    storage->disconnect();
+    delete storage;
+  }
+  unlink(sqlite_path.c_str());
+}
+
+/* Submissions per second of jobs with the given number of tasks. */
+double run_job_inserts(int num_tasks, int num_jobs) {
+  string sqlite_path = FLAGS_storage_path + ".sqlite";
+  unlink(sqlite_path.c_str());
+  SQLiteStorage storage(sqlite_path);
+  storage.connect();
+  storage.create_schema();
+  /* Same as the server does. */
+  storage.use_bulked_transactions = true;
+  storage.transaction_commit_interval = 2.0;
+  vector<Task> tasks(num_tasks, Task(-1, Task::STATUS_WAITING));
+  double start_time = util_time_dt();
+  for(int i = 0; i < num_jobs; ++i) {
+    Job job(-1,
+            50,
+            Job::STATUS_WAITING,
+            string_printf("Job %d", i),
+            string_printf("user%d", i % 4));
+    job.assign_tasks(&tasks[0], num_tasks, vector<Job::TaskDependency>());
+    storage.insert_job(&job);
+    storage.flush_caches();
+  }
+  storage.flush_caches(true);
+  double time_total = util_time_dt() - start_time;
+  storage.disconnect();
+  unlink(sqlite_path.c_str());
+  return num_jobs / time_total;
+}
+
+/* Insertion of small and big jobs into SQLite storage. */
+void benchmark_job_inserts() {
+  const int num_tasks[] = {1024, 102400};
+  const int num_jobs[] = {1000, 10};
+  for(int i = 0; i < 2; ++i) {
+    double jobs_per_second = run_job_inserts(num_tasks[i], num_jobs[i]);
+    LOG(INFO) << "Jobs with " << num_tasks[i] << " tasks: "
+              << jobs_per_second << " jobs per second, "
+              << jobs_per_second * num_tasks[i] << " tasks per second.";
+  }
+}
+
+/* Virtual time of the store coalescing benchmark. */
+double coalescing_time = 0.0;
+
+double get_coalescing_time() {
+  return coalescing_time;
+}
+
+/* Requests of workers which report progress of the task twice before
+ * completing it. Every request takes a millisecond of virtual time, the
+ * reports of the task are a hundred requests apart.
+ */
+void run_store_coalescing(double store_interval) {
+  SQLiteStorage storage(FLAGS_database);
+  storage.connect();
+  storage.create_schema();
+  coalescing_time = 0.0;
+  Farm farm(&storage);
+  farm.time_cb = get_coalescing_time;
+  farm.store_interval = store_interval;
+  for(int i = 0; i < FLAGS_num_jobs; ++i) {
+    farm.insert_job(50,
+                    Job::STATUS_WAITING,
+                    string_printf("Job %d", i),
+                    string_printf("user%d", i % 4));
+  }
+  size_t num_recorded_updates = farm.num_recorded_updates(),
+         num_stored_updates = farm.num_stored_updates();
+  const int report_distance = 100;
+  vector<int> task_ids(FLAGS_num_dispatches, -1);
+  vector<Task*> tasks;
+  double store_time = 0.0;
+  for(int i = 0; i < FLAGS_num_dispatches; ++i) {
+    tasks.clear();
+    farm.dispatch_tasks(1, &tasks);
+    if(!tasks.empty()) {
+      task_ids[i] = tasks[0]->id();
+    }
+    for(int j = 1; j <= 2; ++j) {
+      if(i >= j * report_distance && task_ids[i - j * report_distance] != -1) {
+        farm.extend_task_lease(task_ids[i - j * report_distance]);
+      }
+    }
+    if(i >= 3 * report_distance && task_ids[i - 3 * report_distance] != -1) {
+      farm.complete_task(task_ids[i - 3 * report_distance]);
+    }
+    coalescing_time += 0.001;
+    if(i % FLAGS_requests_per_idle == 0) {
+      double start_time = util_time_dt();
+      farm.idle_handler();
+      store_time += util_time_dt() - start_time;
+    }
+  }
+  double start_time = util_time_dt();
+  farm.store();
+  store_time += util_time_dt() - start_time;
+  num_recorded_updates = farm.num_recorded_updates() - num_recorded_updates;
+  num_stored_updates = farm.num_stored_updates() - num_stored_updates;
+  LOG(INFO) << "Store interval " << store_interval << " s: "
+            << num_recorded_updates << " changes written as "
+            << num_stored_updates << " updates, write amplification "
+            << (double)num_stored_updates / max(num_recorded_updates,
+                                                (size_t)1)
+            << ", " << store_time << " seconds in idle handler.";
+  storage.disconnect();
+}
+
+/* Storage writes of repeatedly modified tasks with different intervals
+ * between the stores.
+ */
+void benchmark_store_coalescing() {
+  run_store_coalescing(0.0);
+  run_store_coalescing(0.1);
+  run_store_coalescing(1.0);
+}
+
+/* Storage with many jobs, only the first ones are running. */
+class ScanStorage : public DryRunStorage {
+ public:
+  ScanStorage() : DryRunStorage(false) {}
+
+  bool retrieve_all_jobs(vector<Job*> *all_jobs) {
+    all_jobs->clear();
+    int num_running_jobs = FLAGS_num_scan_jobs *
+                           FLAGS_restore_running_fraction;
+    for(int i = 0; i < FLAGS_num_scan_jobs; ++i) {
+      all_jobs->push_back(new Job(i,
+                                  50,
+                                  i < num_running_jobs ? Job::STATUS_WAITING
+                                                       : Job::STATUS_COMPLETED,
+                                  string_printf("Job %d", i),
+                                  string_printf("user%d", i % 4)));
+    }
+    return true;
+  }
+};
+
+/* Full scans over all the jobs of the farm, looking at their status. */
+void benchmark_job_scans() {
+  ScanStorage storage;
+  storage.connect();
+  Farm farm(&storage);
+  farm.restore();
+  const int num_scans = 100;
+  Timings table_timings, objects_timings;
+  vector<Job*> jobs;
+  size_t num_found = 0;
+  for(int i = 0; i < num_scans; ++i) {
+    double start_time = util_time_dt();
+    farm.jobs_with_status(Job::STATUS_WAITING, &jobs);
+    table_timings.add(util_time_dt() - start_time);
+    num_found += jobs.size();
+    /* Same filter going through the job objects. */
+    start_time = util_time_dt();
+    jobs.clear();
+    foreach(Job *job, farm.jobs()) {
+      if(job->status() == Job::STATUS_WAITING) {
+        jobs.push_back(job);
+      }
+    }
+    objects_timings.add(util_time_dt() - start_time);
+    num_found += jobs.size();
+  }
+  LOG(INFO) << "Found " << num_found << " jobs in " << num_scans * 2
+            << " scans of " << farm.jobs().size() << " jobs.";
+  table_timings.report("Scan of job states table");
+  objects_timings.report("Scan of job objects");
+  storage.disconnect();
+}
+
+struct Benchmark {
+  const char *name;
+  void (*function)();
+};
+
+const Benchmark benchmarks[] = {
+  {"dispatch_reprioritize", benchmark_dispatch_reprioritize},
+  {"dispatch_batch", benchmark_dispatch_batch},
+  {"dispatch_threads", benchmark_dispatch_threads},
+  {"dispatch_fair_share", benchmark_dispatch_fair_share},
+  {"task_leases", benchmark_task_leases},
+  {"task_dependencies", benchmark_task_dependencies},
+  {"task_reports", benchmark_task_reports},
+  {"lookup", benchmark_lookup},
+  {"job_scans", benchmark_job_scans},
+  {"storage_updates", benchmark_storage_updates},
+  {"storage_latency", benchmark_storage_latency},
+  {"store_coalescing", benchmark_store_coalescing},
+  {"job_inserts", benchmark_job_inserts},
+  {"restore", benchmark_restore},
+};
+
+}  /* namespace */
+
+int main(int argc, char **argv) {
+  FARM_GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  util_logging_init(argv[0]);
+  util_logging_start();
+  util_logging_verbosity_set(0);
+
+  bool found = false;
+  foreach(const Benchmark& benchmark, benchmarks) {
+    if(FLAGS_benchmark == "all" || FLAGS_benchmark == benchmark.name) {
+      LOG(INFO) << "Running benchmark " << benchmark.name << ".";
+      benchmark.function();
+      found = true;
+    }
+  }
+  if(!found) {
+    LOG(ERROR) << "Unknown benchmark " << FLAGS_benchmark << ".";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+}  /* namespace Farm */
+
+int main(int argc, char **argv) {
+  return Farm::main(argc, argv);
+}
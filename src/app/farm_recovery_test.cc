@@ -0,0 +1,531 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+/* Checks of restore of the farm from the files left by a crash or
+ * damaged on the disk, aborting on the first unexpected result.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <gflags/gflags.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "model/model_farm.h"
+#include "model/model_farm_image.h"
+#include "model/model_job.h"
+#include "model/model_task.h"
+#include "storage/storage_dryrun.h"
+#include "storage/storage_log.h"
+#include "util/util_foreach.h"
+#include "util/util_logging.h"
+#include "util/util_map.h"
+#include "util/util_string.h"
+#include "util/util_vector.h"
+
+DEFINE_string(test, "all", "Name of the test to run, or 'all'.");
+DEFINE_string(storage_path, "/tmp/farm_recovery_test", "Base name of the "
+                                                       "files written by "
+                                                       "the tests.");
+DEFINE_int32(num_jobs, 64, "Number of jobs to create in the farm.");
+DEFINE_int32(batch_size, 100, "Number of tasks dispatched at once.");
+
+namespace Farm {
+
+namespace {
+
+/* Contents of the file, empty if it can't be read. */
+string read_file(const string& path) {
+  string data;
+  FILE *file = fopen(path.c_str(), "rb");
+  if(file == NULL) {
+    return data;
+  }
+  char buffer[65536];
+  size_t size;
+  while((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data.append(buffer, size);
+  }
+  fclose(file);
+  return data;
+}
+
+void write_file(const string& path, const string& data) {
+  FILE *file = fopen(path.c_str(), "wb");
+  if(file == NULL ||
+     fwrite(data.data(), 1, data.size(), file) != data.size()) {
+    LOG(FATAL) << "Cannot write " << path << ".";
+  }
+  fclose(file);
+}
+
+bool file_exists(const string& path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+/* Path of the log storage file with the given suffix. */
+string log_storage_path(const string& suffix) {
+  return FLAGS_storage_path + suffix;
+}
+
+string log_storage_log_path(int sequence) {
+  return log_storage_path(string_printf(".log.%d", sequence));
+}
+
+/* Sequence numbers of the first and the last log of the log storage,
+ * false if there are no logs.
+ */
+bool find_log_storage_logs(int *r_first, int *r_last) {
+  /* Logs which are covered by a snapshot are removed, in these runs the
+   * remaining ones are not far from the beginning.
+   */
+  int sequence = 0;
+  while(!file_exists(log_storage_log_path(sequence))) {
+    if(++sequence > 10000) {
+      return false;
+    }
+  }
+  *r_first = sequence;
+  while(file_exists(log_storage_log_path(sequence + 1))) {
+    ++sequence;
+  }
+  *r_last = sequence;
+  return true;
+}
+
+void remove_log_storage_files() {
+  unlink(log_storage_path(".snapshot").c_str());
+  unlink(log_storage_path(".snapshot.tmp").c_str());
+  int first, last;
+  while(find_log_storage_logs(&first, &last)) {
+    for(int sequence = first; sequence <= last; ++sequence) {
+      unlink(log_storage_log_path(sequence).c_str());
+    }
+  }
+}
+
+/* Everything the farm is restored from, as text. */
+string describe_storage(Storage *storage) {
+  vector<Job*> jobs;
+  unordered_map<int, double> lease_expire_times;
+  if(!storage->retrieve_all_jobs(&jobs) ||
+     !storage->retrieve_task_leases(&lease_expire_times)) {
+    LOG(FATAL) << "Cannot retrieve state of the storage.";
+  }
+  string state;
+  vector<Task> tasks;
+  foreach(Job *job, jobs) {
+    state += string_printf("Job %d %d %d %s %s:",
+                           job->id(),
+                           job->priority(),
+                           job->status(),
+                           job->name().c_str(),
+                           job->owner().c_str());
+    storage->retrieve_all_tasks(*job, &tasks);
+    foreach(const Task& task, tasks) {
+      state += string_printf(" %d=%d", task.id(), (int)task.status());
+      unordered_map<int, double>::const_iterator it =
+          lease_expire_times.find(task.id());
+      if(it != lease_expire_times.end()) {
+        state += string_printf("@%.6f", it->second);
+      }
+    }
+    state += "\n";
+    delete job;
+  }
+  return state;
+}
+
+/* Run the farm on the log storage, every round submits a job, dispatches
+ * some tasks and completes half of them, so part of the tasks keep their
+ * leases. Returns state of the storage at the end.
+ *
+ * Unless snapshots are to be taken a directory is put in place of the
+ * snapshot, so it can't be renamed over and every log is kept, as if the
+ * server stopped each time after starting the new log and before the
+ * snapshot was in place.
+ */
+string run_log_storage_rounds(int num_rounds, bool take_snapshots) {
+  LogStorage storage(FLAGS_storage_path);
+  if(!storage.connect()) {
+    LOG(FATAL) << "Cannot connect to log storage " << FLAGS_storage_path
+               << ".";
+  }
+  string snapshot_path = log_storage_path(".snapshot");
+  if(!take_snapshots && mkdir(snapshot_path.c_str(), 0755) != 0) {
+    LOG(FATAL) << "Cannot create directory " << snapshot_path << ".";
+  }
+  /* Log is started over every few rounds. */
+  storage.snapshot_log_size = 4096;
+  Farm farm(&storage);
+  farm.restore();
+  vector<Task*> tasks;
+  for(int i = 0; i < num_rounds; ++i) {
+    Job *job = farm.insert_job(50,
+                               Job::STATUS_WAITING,
+                               string_printf("Job %d", i),
+                               string_printf("user%d", i % 4));
+    farm.set_job_priority(job, i % 100);
+    tasks.clear();
+    farm.dispatch_tasks(FLAGS_batch_size, &tasks);
+    for(int j = 0; j < tasks.size(); j += 2) {
+      farm.complete_task(tasks[j]->id());
+    }
+    farm.store();
+  }
+  /* Last store might have started a new log, records are put to it so
+   * there's something to tear.
+   */
+  storage.snapshot_log_size = (size_t)-1;
+  farm.set_job_priority(farm.jobs().back(), 100);
+  farm.store();
+  string state = describe_storage(&storage);
+  storage.disconnect();
+  if(!take_snapshots) {
+    rmdir(snapshot_path.c_str());
+  }
+  return state;
+}
+
+/* Connect to the log storage, LOG(FATAL) unless connect() gives the
+ * expected result. Returns state of the connected storage.
+ */
+string reconnect_log_storage(const string& name, bool expect_connected) {
+  LogStorage storage(FLAGS_storage_path);
+  bool connected = storage.connect();
+  if(connected != expect_connected) {
+    LOG(FATAL) << name << ": log storage is "
+               << (connected ? "restored" : "not restored") << ".";
+  }
+  string state = connected ? describe_storage(&storage) : "";
+  storage.disconnect();
+  LOG(INFO) << name << ": " << (connected ? "restored." : "rejected.");
+  return state;
+}
+
+void check_restored_state(const string& name,
+                          const string& state,
+                          const string& expected_state) {
+  if(state != expected_state) {
+    LOG(FATAL) << name << ": restored state differs, " << state.size()
+               << " bytes instead of " << expected_state.size() << ".";
+  }
+}
+
+/* Recovery of the log storage from the files left by a crash at any
+ * point of appending to the log and of taking the snapshot, LOG(FATAL)
+ * if anything is not restored as expected.
+ */
+void test_log_recovery() {
+  remove_log_storage_files();
+  string expected_state = run_log_storage_rounds(FLAGS_num_jobs, false);
+  int first, last;
+  if(!find_log_storage_logs(&first, &last) || first != 0 || last == 0) {
+    LOG(FATAL) << "Logs of the unfinished snapshots are not kept.";
+  }
+  check_restored_state("Logs of unfinished snapshots",
+                       reconnect_log_storage("Logs of unfinished snapshots",
+                                             true),
+                       expected_state);
+
+  /* Only the last log might be torn. */
+  string first_log = read_file(log_storage_log_path(0));
+  string damaged_log = first_log;
+  damaged_log[damaged_log.size() / 2] ^= 0x55;
+  write_file(log_storage_log_path(0), damaged_log);
+  reconnect_log_storage("Damaged log followed by another one", false);
+  write_file(log_storage_log_path(0), first_log);
+
+  /* Torn record is dropped from the end of the last log. */
+  string last_log_path = log_storage_log_path(last);
+  string last_log = read_file(last_log_path);
+  if(last_log.empty()) {
+    LOG(FATAL) << "Last log " << last_log_path << " is empty.";
+  }
+  write_file(last_log_path, last_log + string("\x20\0\0\0torn", 8));
+  check_restored_state("Torn record after the last one",
+                       reconnect_log_storage("Torn record after the last "
+                                             "one", true),
+                       expected_state);
+  if(read_file(last_log_path) != last_log) {
+    LOG(FATAL) << "Torn record is not truncated from " << last_log_path
+               << ".";
+  }
+  write_file(last_log_path, last_log.substr(0, last_log.size() - 3));
+  reconnect_log_storage("Torn last record", true);
+  if(read_file(last_log_path).size() >= last_log.size() - 3) {
+    LOG(FATAL) << "Torn last record is not truncated from "
+               << last_log_path << ".";
+  }
+  write_file(last_log_path, last_log);
+
+  /* Snapshots are taken from now on, the logs they cover are removed. */
+  expected_state = run_log_storage_rounds(FLAGS_num_jobs, true);
+  string snapshot_path = log_storage_path(".snapshot");
+  if(!file_exists(snapshot_path) ||
+     !find_log_storage_logs(&first, &last) ||
+     first == 0) {
+    LOG(FATAL) << "Snapshot is not written or logs are not removed.";
+  }
+  check_restored_state("Snapshot",
+                       reconnect_log_storage("Snapshot", true),
+                       expected_state);
+
+  /* Server stopped after the snapshot was renamed and before the logs it
+   * covers were removed.
+   */
+  write_file(log_storage_log_path(first - 1), first_log);
+  check_restored_state("Log covered by the snapshot",
+                       reconnect_log_storage("Log covered by the snapshot",
+                                             true),
+                       expected_state);
+  if(file_exists(log_storage_log_path(first - 1))) {
+    LOG(FATAL) << "Log covered by the snapshot is not removed.";
+  }
+
+  /* Server stopped while writing the snapshot. */
+  write_file(snapshot_path + ".tmp", first_log.substr(0, 100));
+  check_restored_state("Partial snapshot",
+                       reconnect_log_storage("Partial snapshot", true),
+                       expected_state);
+  unlink((snapshot_path + ".tmp").c_str());
+
+  /* Snapshot which is in place is complete, so any damage is fatal. */
+  string snapshot = read_file(snapshot_path);
+  string damaged_snapshot = snapshot;
+  damaged_snapshot[damaged_snapshot.size() / 2] ^= 0x55;
+  write_file(snapshot_path, damaged_snapshot);
+  reconnect_log_storage("Damaged snapshot", false);
+  write_file(snapshot_path, snapshot);
+  check_restored_state("Restored snapshot",
+                       reconnect_log_storage("Restored snapshot", true),
+                       expected_state);
+  remove_log_storage_files();
+}
+
+/* Jobs and tasks of the farm, as text. */
+string describe_farm(Farm *farm) {
+  string state;
+  foreach(Job *job, farm->jobs()) {
+    state += string_printf("Job %d %d %d %s %s:",
+                           job->id(),
+                           job->priority(),
+                           job->status(),
+                           job->name().c_str(),
+                           job->owner().c_str());
+    for(int status = 0; status < Task::NUM_STATUSES; ++status) {
+      state += string_printf(" %d",
+                             job->num_tasks_with_status((Task::Status)status));
+    }
+    /* Other jobs keep their tasks only until they're evicted. */
+    if(job->need_always_fetch_tasks()) {
+      foreach(const Task& task, job->tasks()) {
+        state += string_printf(" %d=%d", task.id(), (int)task.status());
+      }
+    }
+    state += "\n";
+  }
+  return state;
+}
+
+/* Restore the farm from the image, LOG(FATAL) unless restore_image()
+ * gives the expected result. Returns state of the restored farm.
+ */
+string restore_farm_image(const string& name,
+                          const string& image,
+                          bool expect_restored) {
+  string image_filename = FLAGS_storage_path + ".image";
+  write_file(image_filename, image);
+  DryRunStorage storage(false);
+  storage.connect();
+  Farm farm(&storage);
+  bool restored = farm.restore_image(image_filename);
+  if(restored != expect_restored || (!restored && !farm.jobs().empty())) {
+    LOG(FATAL) << name << ": farm image is "
+               << (restored ? "restored" : "not restored") << " with "
+               << farm.jobs().size() << " jobs.";
+  }
+  string state = restored ? describe_farm(&farm) : "";
+  storage.disconnect();
+  unlink(image_filename.c_str());
+  LOG(INFO) << name << ": " << (restored ? "restored." : "rejected.");
+  return state;
+}
+
+/* Header of the image, which is to be written back with
+ * put_image_header() once it's changed.
+ */
+FarmImageHeader get_image_header(const string& image) {
+  FarmImageHeader header;
+  memcpy(&header, image.data(), sizeof(header));
+  return header;
+}
+
+void put_image_header(const FarmImageHeader& header, string *image) {
+  memcpy(&(*image)[0], &header, sizeof(header));
+}
+
+/* Change the job in the image and update the checksum, so the change is
+ * only caught by the checks of the job data.
+ */
+void put_image_job(int index, const FarmImageJob& job, string *image) {
+  FarmImageHeader header = get_image_header(*image);
+  memcpy(&(*image)[header.jobs_offset + index * sizeof(job)],
+         &job,
+         sizeof(job));
+  header.checksum = farm_image_checksum(0,
+                                        image->data() + header.jobs_offset,
+                                        image->size() - header.jobs_offset);
+  put_image_header(header, image);
+}
+
+/* Restore of the farm image which is damaged, truncated or describes
+ * data out of its bounds, LOG(FATAL) if anything is not rejected or the
+ * intact image is not restored as stored.
+ */
+void test_image_recovery() {
+  DryRunStorage storage(false);
+  storage.connect();
+  Farm farm(&storage);
+  for(int i = 0; i < FLAGS_num_jobs; ++i) {
+    Job *job = farm.insert_job(50,
+                               Job::STATUS_WAITING,
+                               string_printf("Job %d", i),
+                               string_printf("user%d", i % 4));
+    /* Tasks of completed jobs are not stored, only their counts. */
+    if(i % 2 == 0) {
+      farm.set_job_status(job, Job::STATUS_COMPLETED);
+    }
+  }
+  vector<Task*> tasks;
+  farm.dispatch_tasks(FLAGS_batch_size, &tasks);
+  for(int i = 0; i < tasks.size(); i += 2) {
+    farm.complete_task(tasks[i]->id());
+  }
+  string image_filename = FLAGS_storage_path + ".image";
+  if(!farm.store_image(image_filename)) {
+    LOG(FATAL) << "Cannot store farm image " << image_filename << ".";
+  }
+  string image = read_file(image_filename);
+  string expected_state = describe_farm(&farm);
+  storage.disconnect();
+  check_restored_state("Intact image",
+                       restore_farm_image("Intact image", image, true),
+                       expected_state);
+
+  string damaged_image = image;
+  damaged_image[damaged_image.size() / 2] ^= 0x55;
+  restore_farm_image("Damaged image", damaged_image, false);
+  restore_farm_image("Truncated image",
+                     image.substr(0, image.size() - 16),
+                     false);
+  restore_farm_image("Truncated header",
+                     image.substr(0, sizeof(FarmImageHeader) - 8),
+                     false);
+
+  FarmImageHeader header = get_image_header(image);
+  damaged_image = image;
+  header.version = FARM_IMAGE_VERSION + 1;
+  put_image_header(header, &damaged_image);
+  restore_farm_image("Image of another version", damaged_image, false);
+  damaged_image = image;
+  header = get_image_header(image);
+  header.data_offset = image.size() + 16;
+  put_image_header(header, &damaged_image);
+  restore_farm_image("Data section out of the image", damaged_image, false);
+  damaged_image = image;
+  header = get_image_header(image);
+  header.num_jobs = (header.tasks_offset - header.jobs_offset) /
+                    sizeof(FarmImageJob) + 1;
+  put_image_header(header, &damaged_image);
+  restore_farm_image("Jobs out of the jobs section", damaged_image, false);
+
+  header = get_image_header(image);
+  FarmImageJob job;
+  memcpy(&job, image.data() + header.jobs_offset, sizeof(job));
+  damaged_image = image;
+  FarmImageJob damaged_job = job;
+  damaged_job.num_tasks = 0x7fffffff;
+  put_image_job(0, damaged_job, &damaged_image);
+  restore_farm_image("Tasks out of the tasks section", damaged_image, false);
+  damaged_image = image;
+  damaged_job = job;
+  damaged_job.num_task_dependencies = 1;
+  damaged_job.first_task_dependency =
+      (header.data_offset - header.task_dependencies_offset) /
+      sizeof(FarmImageTaskDependency);
+  put_image_job(0, damaged_job, &damaged_image);
+  restore_farm_image("Task dependencies out of the dependencies section",
+                     damaged_image,
+                     false);
+  damaged_image = image;
+  damaged_job = job;
+  damaged_job.name_size = image.size();
+  put_image_job(0, damaged_job, &damaged_image);
+  restore_farm_image("Name out of the data section", damaged_image, false);
+  /* Checksum is updated correctly, so the unchanged job is restored. */
+  damaged_image = image;
+  put_image_job(0, job, &damaged_image);
+  check_restored_state("Rewritten image",
+                       restore_farm_image("Rewritten image",
+                                          damaged_image,
+                                          true),
+                       expected_state);
+}
+
+struct Test {
+  const char *name;
+  void (*function)();
+};
+
+const Test tests[] = {
+  {"log_recovery", test_log_recovery},
+  {"image_recovery", test_image_recovery},
+};
+
+}  /* namespace */
+
+int main(int argc, char **argv) {
+  FARM_GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  util_logging_init(argv[0]);
+  util_logging_start();
+  util_logging_verbosity_set(0);
+
+  bool found = false;
+  foreach(const Test& test, tests) {
+    if(FLAGS_test == "all" || FLAGS_test == test.name) {
+      LOG(INFO) << "Running test " << test.name << ".";
+      test.function();
+      found = true;
+    }
+  }
+  if(!found) {
+    LOG(ERROR) << "Unknown test " << FLAGS_test << ".";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+}  /* namespace Farm */
+
+int main(int argc, char **argv) {
+  return Farm::main(argc, argv);
+}
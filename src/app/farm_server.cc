@@ -20,11 +20,14 @@
 
 #include <cstdlib>
 #include <csignal>
+#include <unistd.h>
 
 #include "http/http_server_soup.h"
 #include "model/model_farm.h"
+#include "storage/storage_async.h"
 #include "storage/storage_dryrun.h"
 #include "storage/storage_database_sqlite.h"
+#include "storage/storage_log.h"
 #include "util/util_function.h"
 #include "util/util_string.h"
 #include "util/util_logging.h"
@@ -32,10 +35,22 @@
 
 /* Use dry-run (emory-only, no serialization) storage. */
 // #define DRY_RUN_STORAGE
+/* Use append-only log storage instead of SQLite. */
+// #define LOG_STORAGE
+/* Write updates to the storage from a separate thread, so serving requests
+ * doesn't wait for the disk.
+ */
+#define ASYNC_STORAGE_WRITES
 /* Create full bunch of new jobs, for development purposes only. */
 // #define CREATE_NEW_JOBS
 /* Count of new tasks to be created. */
 #define NEW_TASKS_COUNT 1024
+/* Image of the farm written on clean shutdown for a fast restart. */
+#define FARM_IMAGE_FILENAME "/tmp/farm.image"
+/* Number of threads dispatching tasks for get_task requests, the farm
+ * gets a dispatch shard for every thread.
+ */
+#define NUM_DISPATCH_THREADS 4
 
 namespace Farm {
 
@@ -60,7 +75,17 @@ int main(int argc, char **argv) {
   util_logging_start();
   util_logging_verbosity_set(1);
 
-#ifndef DRY_RUN_STORAGE
+#if defined(DRY_RUN_STORAGE)
+  storage = new DryRunStorage(true);
+  storage->connect();
+#elif defined(LOG_STORAGE)
+  LogStorage *log_storage = new LogStorage("/tmp/farm");
+  log_storage->connect();
+
+  log_storage->sync_interval = 0.1;
+
+  storage = log_storage;
+#else
   // SQLiteStorage *sqlite_storage = new SQLiteStorage(":memory:");
   SQLiteStorage *sqlite_storage = new SQLiteStorage("/tmp/farm.sqlite");
   sqlite_storage->connect();
@@ -70,30 +95,46 @@ int main(int argc, char **argv) {
   sqlite_storage->transaction_commit_interval = 2.0;
 
   storage = sqlite_storage;
-#else
-  storage = new DryRunStorage(true);
+#endif
+#if defined(ASYNC_STORAGE_WRITES) && !defined(DRY_RUN_STORAGE)
+  storage = new AsyncStorage(storage);
   storage->connect();
 #endif
 
   double start_time = util_time_dt();
-  farm = new Farm(storage);
-  farm->restore();
+  farm = new Farm(storage, NUM_DISPATCH_THREADS);
+  /* Changes of a task within a second are written to the storage once. */
+  farm->store_interval = 1.0;
+  /* Image only matches the storage until the farm is changed, so it's
+   * removed once it's used and is written again on clean shutdown.
+   */
+  if(farm->restore_image(FARM_IMAGE_FILENAME)) {
+    unlink(FARM_IMAGE_FILENAME);
+  } else {
+    farm->restore();
+  }
 #ifdef CREATE_NEW_JOBS
   for(int i = 0; i < NEW_TASKS_COUNT; ++i) {
     farm->insert_job(50,
                      Job::STATUS_WAITING,
-                     string_printf("Test Job %d", i));
+                     string_printf("Test Job %d", i),
+                     "Marty McFly");
   }
 #endif
   VLOG(1) << "Restored in " << util_time_dt() - start_time << " seconds.";
 
-  http_server = new  SOUPHTTPServer(farm,
-                                    9999,
-                                    "/home/sergey/src/farm-proto/web");
+  SOUPHTTPServer *soup_http_server =
+      new SOUPHTTPServer(farm, 9999, "/home/sergey/src/farm-proto/web");
+  soup_http_server->num_dispatch_threads = NUM_DISPATCH_THREADS;
+  http_server = soup_http_server;
   http_server->idle_function_cb = function_bind(&Farm::idle_handler, farm);
+  farm->tasks_available_cb = function_bind(&HTTPServer::tasks_available,
+                                           http_server);
   http_server->start_serve();
 
-  farm->store();
+  if(farm->store()) {
+    farm->store_image(FARM_IMAGE_FILENAME);
+  }
   storage->disconnect();
   delete http_server;
   delete storage;
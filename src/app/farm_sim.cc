@@ -0,0 +1,501 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+/* Scheduler simulator.
+ *
+ * Replays submissions of jobs and arrivals of workers from a trace against
+ * the farm model in virtual time. Task durations are generated from the
+ * trace using a seeded random generator, so runs are deterministic.
+ *
+ * Trace is a text file with one event per line, sorted by time:
+ *
+ *   <time> job <owner> <priority> <mean task time>
+ *   <time> workers <number of workers>
+ *
+ * Times are given in seconds, lines starting with # are ignored. When no
+ * trace is given a synthetic one is generated.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <gflags/gflags.h>
+
+#include "model/model_farm.h"
+#include "model/model_job.h"
+#include "model/model_task.h"
+#include "storage/storage_dryrun.h"
+#include "util/util_algorithm.h"
+#include "util/util_deque.h"
+#include "util/util_foreach.h"
+#include "util/util_function.h"
+#include "util/util_logging.h"
+#include "util/util_map.h"
+#include "util/util_priority_queue.h"
+#include "util/util_string.h"
+#include "util/util_time.h"
+#include "util/util_vector.h"
+
+DEFINE_string(trace, "", "Trace of events to replay, synthetic trace is "
+                         "generated if empty.");
+DEFINE_int32(seed, 1, "Seed for the random number generator.");
+DEFINE_int32(num_jobs, 200, "Number of jobs in the synthetic trace.");
+DEFINE_int32(num_workers, 100, "Number of workers in the synthetic trace.");
+DEFINE_double(job_interval, 3000.0, "Mean time in seconds between job "
+                                    "submissions in the synthetic trace.");
+DEFINE_double(task_time, 300.0, "Mean task time in seconds in the "
+                                "synthetic trace.");
+DEFINE_double(task_time_sigma, 0.5, "Standard deviation of the logarithm "
+                                    "of task times within a job.");
+DEFINE_double(slow_task_probability, 0.005, "Probability of a task to land "
+                                            "on a slow node.");
+DEFINE_double(slow_task_factor, 10.0, "How many times slower tasks are on "
+                                      "a slow node.");
+DEFINE_double(idle_interval, 10.0, "Virtual time in seconds between runs "
+                                   "of the farm's idle handler.");
+DEFINE_double(lease_time, 86400.0, "Task lease time in seconds, simulated "
+                                   "workers don't send heartbeats.");
+DEFINE_bool(fair_share, false, "Enable fair share between job owners.");
+DEFINE_bool(speculative_dispatch, true, "Enable speculative dispatch of "
+                                        "straggler tasks.");
+
+namespace Farm {
+
+namespace {
+
+/* Small deterministic random generator, so traces and task durations
+ * are the same on all platforms.
+ */
+class Random {
+ public:
+  explicit Random(unsigned int seed)
+      : state_(seed * 2654435761ULL + 1) {
+  }
+
+  /* Uniformly distributed number in (0, 1). */
+  double uniform() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return ((state_ >> 11) + 0.5) / 9007199254740992.0;
+  }
+
+  double exponential(double mean) {
+    return -mean * log(uniform());
+  }
+
+  /* Log-normally distributed number with the given mean. */
+  double lognormal(double mean, double sigma) {
+    double normal = sqrt(-2.0 * log(uniform())) *
+                    cos(2.0 * M_PI * uniform());
+    return mean * exp(sigma * normal - sigma * sigma / 2.0);
+  }
+
+ protected:
+  unsigned long long state_;
+};
+
+struct TraceEvent {
+  enum Type {
+    JOB,
+    WORKERS,
+  };
+  double time;
+  Type type;
+  /* Job submission. */
+  string owner;
+  int priority;
+  double mean_task_time;
+  /* Workers arrival. */
+  int num_workers;
+};
+
+bool trace_read(const string& filename, vector<TraceEvent> *trace) {
+  FILE *file = fopen(filename.c_str(), "r");
+  if(file == NULL) {
+    LOG(ERROR) << "Unable to open trace " << filename << ".";
+    return false;
+  }
+  char line[1024];
+  int line_number = 0;
+  while(fgets(line, sizeof(line), file) != NULL) {
+    ++line_number;
+    if(line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    TraceEvent event;
+    char type[64], owner[256];
+    double time, mean_task_time;
+    int priority, num_workers;
+    if(sscanf(line, "%lf %63s", &time, type) != 2) {
+      LOG(ERROR) << "Malformed line " << line_number << " of the trace.";
+      fclose(file);
+      return false;
+    }
+    event.time = time;
+    if(string(type) == "job" &&
+       sscanf(line, "%*f %*s %255s %d %lf",
+              owner, &priority, &mean_task_time) == 3) {
+      event.type = TraceEvent::JOB;
+      event.owner = owner;
+      event.priority = priority;
+      event.mean_task_time = mean_task_time;
+    } else if(string(type) == "workers" &&
+              sscanf(line, "%*f %*s %d", &num_workers) == 1) {
+      event.type = TraceEvent::WORKERS;
+      event.num_workers = num_workers;
+    } else {
+      LOG(ERROR) << "Malformed line " << line_number << " of the trace.";
+      fclose(file);
+      return false;
+    }
+    trace->push_back(event);
+  }
+  fclose(file);
+  return true;
+}
+
+/* Jobs arrive as a Poisson process, jobs differ in their mean task time. */
+void trace_generate(vector<TraceEvent> *trace) {
+  Random random(FLAGS_seed);
+  TraceEvent workers;
+  workers.time = 0.0;
+  workers.type = TraceEvent::WORKERS;
+  workers.num_workers = FLAGS_num_workers;
+  trace->push_back(workers);
+  double time = 0.0;
+  const int priorities[] = {30, 50, 50, 70};
+  for(int i = 0; i < FLAGS_num_jobs; ++i) {
+    TraceEvent job;
+    job.time = time;
+    job.type = TraceEvent::JOB;
+    job.owner = string_printf("user%d", i % 4);
+    job.priority = priorities[(int)(random.uniform() * 4)];
+    job.mean_task_time = random.lognormal(FLAGS_task_time, 1.0);
+    trace->push_back(job);
+    time += random.exponential(FLAGS_job_interval);
+  }
+}
+
+/* Summary of a sequence of values. */
+string summary(vector<double> values) {
+  if(values.empty()) {
+    return "n/a";
+  }
+  sort(values.begin(), values.end());
+  double total = 0.0;
+  foreach(double value, values) {
+    total += value;
+  }
+  return string_printf("mean %.1f, p50 %.1f, p99 %.1f, max %.1f",
+                       total / values.size(),
+                       values[values.size() / 2],
+                       values[values.size() * 99 / 100],
+                       values.back());
+}
+
+class Simulator {
+ public:
+  explicit Simulator(const vector<TraceEvent>& trace)
+      : trace_(trace),
+        random_(FLAGS_seed + 1),
+        storage_(false),
+        farm_(&storage_),
+        time_(0.0),
+        num_events_(0),
+        tasks_available_(false),
+        num_completed_jobs_(0),
+        num_dispatch_calls_(0),
+        dispatch_time_(0.0) {
+  }
+
+  void run() {
+    storage_.connect();
+    farm_.time_cb = function_bind(&Simulator::time, this);
+    farm_.tasks_available_cb = function_bind(&Simulator::tasks_available,
+                                             this);
+    farm_.task_lease_time = FLAGS_lease_time;
+    farm_.speculative_dispatch = FLAGS_speculative_dispatch;
+    farm_.straggler_check_interval = FLAGS_idle_interval;
+    farm_.restore();
+    farm_.set_fair_share(FLAGS_fair_share);
+
+    for(int i = 0; i < trace_.size(); ++i) {
+      schedule(trace_[i].time, Event::TRACE, i, 0);
+    }
+    schedule(0.0, Event::IDLE, 0, 0);
+
+    double start_time = util_time_dt();
+    while(!events_.empty()) {
+      Event event = events_.top();
+      events_.pop();
+      time_ = event.time;
+      handle_event(event);
+      if(tasks_available_) {
+        dispatch_tasks();
+      }
+    }
+    double time_total = util_time_dt() - start_time;
+    storage_.disconnect();
+    report(time_total);
+  }
+
+ protected:
+  struct Event {
+    enum Type {
+      TRACE,
+      TASK_DONE,
+      IDLE,
+    };
+    double time;
+    /* Order of scheduling, makes events at the same time deterministic. */
+    long long sequence;
+    Type type;
+    int argument;
+    int generation;
+  };
+
+  class EventCompare {
+   public:
+    bool operator() (const Event& left, const Event& right) {
+      if(left.time != right.time) {
+        return left.time > right.time;
+      }
+      return left.sequence > right.sequence;
+    }
+  };
+
+  struct Worker {
+    /* Task the worker is running, -1 if idle. */
+    int task_id;
+    /* Incremented when the worker's task is cancelled, so its completion
+     * event is ignored.
+     */
+    int generation;
+  };
+
+  struct SimulatedJob {
+    Job *job;
+    int first_task_id;
+    double mean_task_time;
+    double submit_time;
+    double first_dispatch_time;
+    double complete_time;
+  };
+
+  double time() { return time_; }
+
+  void tasks_available() { tasks_available_ = true; }
+
+  void schedule(double time, Event::Type type, int argument, int generation) {
+    Event event = {time, num_events_++, type, argument, generation};
+    events_.push(event);
+  }
+
+  void handle_event(const Event& event) {
+    switch(event.type) {
+      case Event::TRACE:
+        handle_trace_event(trace_[event.argument]);
+        break;
+      case Event::TASK_DONE:
+        handle_task_done(event.argument, event.generation);
+        break;
+      case Event::IDLE:
+        farm_.idle_handler();
+        /* Duplicates of stragglers might have become available. */
+        tasks_available_ = true;
+        if(events_.size() != 0) {
+          schedule(time_ + FLAGS_idle_interval, Event::IDLE, 0, 0);
+        }
+        break;
+    }
+  }
+
+  void handle_trace_event(const TraceEvent& trace_event) {
+    if(trace_event.type == TraceEvent::WORKERS) {
+      for(int i = 0; i < trace_event.num_workers; ++i) {
+        Worker worker = {-1, 0};
+        workers_.push_back(worker);
+        idle_workers_.push_back(workers_.size() - 1);
+      }
+      tasks_available_ = true;
+      return;
+    }
+    Job *job = farm_.insert_job(trace_event.priority,
+                                Job::STATUS_WAITING,
+                                string_printf("Job %d", (int)jobs_.size()),
+                                trace_event.owner);
+    SimulatedJob simulated_job = {job,
+                                  job->tasks().front().id(),
+                                  trace_event.mean_task_time,
+                                  time_,
+                                  -1.0,
+                                  -1.0};
+    jobs_.push_back(simulated_job);
+  }
+
+  /* Find job of the task, tasks of every job have consecutive IDs. */
+  SimulatedJob& task_job(int task_id) {
+    int first = 0, last = jobs_.size() - 1;
+    while(first < last) {
+      int middle = (first + last + 1) / 2;
+      if(jobs_[middle].first_task_id <= task_id) {
+        first = middle;
+      } else {
+        last = middle - 1;
+      }
+    }
+    return jobs_[first];
+  }
+
+  void dispatch_tasks() {
+    while(!idle_workers_.empty()) {
+      double dispatch_start = util_time_dt();
+      Task *task = farm_.dispatch_task();
+      dispatch_time_ += util_time_dt() - dispatch_start;
+      ++num_dispatch_calls_;
+      if(task == NULL) {
+        tasks_available_ = false;
+        return;
+      }
+      int worker_index = idle_workers_.front();
+      idle_workers_.pop_front();
+      Worker& worker = workers_[worker_index];
+      worker.task_id = task->id();
+      task_workers_[task->id()].push_back(worker_index);
+      SimulatedJob& job = task_job(task->id());
+      if(job.first_dispatch_time < 0.0) {
+        job.first_dispatch_time = time_;
+      }
+      double duration = random_.lognormal(job.mean_task_time,
+                                          FLAGS_task_time_sigma);
+      if(random_.uniform() < FLAGS_slow_task_probability) {
+        duration *= FLAGS_slow_task_factor;
+      }
+      schedule(time_ + duration,
+               Event::TASK_DONE,
+               worker_index,
+               worker.generation);
+    }
+  }
+
+  void handle_task_done(int worker_index, int generation) {
+    Worker& worker = workers_[worker_index];
+    if(worker.generation != generation) {
+      return;
+    }
+    int task_id = worker.task_id;
+    if(farm_.complete_task(task_id)) {
+      SimulatedJob& job = task_job(task_id);
+      if(job.job->status() == Job::STATUS_COMPLETED) {
+        job.complete_time = time_;
+        ++num_completed_jobs_;
+      }
+    }
+    /* Cancel other copies of the task, and free the worker. */
+    foreach(int other_index, task_workers_[task_id]) {
+      Worker& other = workers_[other_index];
+      other.task_id = -1;
+      ++other.generation;
+      idle_workers_.push_back(other_index);
+    }
+    task_workers_.erase(task_id);
+    tasks_available_ = true;
+  }
+
+  void report(double time_total) {
+    vector<double> wait_times, turnaround_times;
+    double first_submit_time = -1.0, last_complete_time = 0.0;
+    foreach(const SimulatedJob& job, jobs_) {
+      if(first_submit_time < 0.0) {
+        first_submit_time = job.submit_time;
+      }
+      if(job.first_dispatch_time >= 0.0) {
+        wait_times.push_back(job.first_dispatch_time - job.submit_time);
+      }
+      if(job.complete_time >= 0.0) {
+        turnaround_times.push_back(job.complete_time - job.submit_time);
+        last_complete_time = max(last_complete_time, job.complete_time);
+      }
+    }
+    LOG(INFO) << "Simulated " << time_ / 3600.0 << " hours in "
+              << time_total << " seconds, " << num_events_ << " events.";
+    LOG(INFO) << "Completed " << num_completed_jobs_ << " of "
+              << jobs_.size() << " jobs on " << workers_.size()
+              << " workers.";
+    LOG(INFO) << "Makespan: "
+              << (last_complete_time - max(first_submit_time, 0.0)) / 3600.0
+              << " hours.";
+    LOG(INFO) << "Job wait time (s): " << summary(wait_times) << ".";
+    LOG(INFO) << "Job turnaround time (s): "
+              << summary(turnaround_times) << ".";
+    LOG(INFO) << "Dispatch CPU: " << dispatch_time_ << " seconds, "
+              << dispatch_time_ / max(num_dispatch_calls_, 1LL) * 1e6
+              << " us per call, " << num_dispatch_calls_ << " calls.";
+    LOG(INFO) << "Speculative dispatches: "
+              << farm_.num_speculative_dispatches() << ", won: "
+              << farm_.num_speculative_wins() << ".";
+  }
+
+  const vector<TraceEvent>& trace_;
+  Random random_;
+  DryRunStorage storage_;
+  Farm farm_;
+  /* Current virtual time. */
+  double time_;
+  priority_queue<Event, vector<Event>, EventCompare> events_;
+  long long num_events_;
+  /* Farm might have tasks for idle workers. */
+  bool tasks_available_;
+  vector<Worker> workers_;
+  deque<int> idle_workers_;
+  /* Workers running every task, more than one for duplicated tasks. */
+  unordered_map<int, vector<int> > task_workers_;
+  vector<SimulatedJob> jobs_;
+  int num_completed_jobs_;
+  long long num_dispatch_calls_;
+  /* Wall time spent in dispatch. */
+  double dispatch_time_;
+};
+
+}  /* namespace */
+
+int main(int argc, char **argv) {
+  FARM_GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  util_logging_init(argv[0]);
+  util_logging_start();
+  util_logging_verbosity_set(0);
+
+  vector<TraceEvent> trace;
+  if(FLAGS_trace.empty()) {
+    trace_generate(&trace);
+  } else if(!trace_read(FLAGS_trace, &trace)) {
+    return EXIT_FAILURE;
+  }
+  Simulator simulator(trace);
+  simulator.run();
+  return EXIT_SUCCESS;
+}
+
+}  /* namespace Farm */
+
+int main(int argc, char **argv) {
+  return Farm::main(argc, argv);
+}
@@ -19,17 +19,124 @@
 // IN THE SOFTWARE.
 
 #include <cstdlib>
+#include <gflags/gflags.h>
 #include <libsoup/soup.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "util/util_algorithm.h"
+#include "util/util_foreach.h"
 #include "util/util_logging.h"
+#include "util/util_string.h"
 #include "util/util_time.h"
+#include "util/util_vector.h"
+
+DEFINE_int32(tasks_per_request, 0, "Number of tasks to request from the "
+                                   "server at once, 0 means a single task "
+                                   "per request using legacy protocol.");
+DEFINE_int32(wait, 0, "Number of seconds server is allowed to hold the "
+                      "request when there're no tasks to dispatch, 0 means "
+                      "the worker quits once all tasks are dispatched.");
+DEFINE_bool(report, false, "Report completion of the handled tasks in the "
+                           "same request which asks for the next ones, "
+                           "tasks_per_request is used as the batch size.");
 
 namespace Farm {
 
+namespace {
+
+/* Get number of task IDs in the server response. */
+int response_num_tasks(SoupMessage *msg) {
+  if(FLAGS_tasks_per_request <= 0) {
+    return 1;
+  }
+  /* Response is a JSON array of IDs, so count the separators. */
+  int num_tasks = 0;
+  bool in_number = false;
+  for(int i = 0; i < msg->response_body->length; ++i) {
+    char ch = msg->response_body->data[i];
+    bool is_digit = (ch >= '0' && ch <= '9');
+    if(is_digit && !in_number) {
+      ++num_tasks;
+    }
+    in_number = is_digit;
+  }
+  return num_tasks;
+}
+
+/* Get IDs of the dispatched tasks from the report_tasks response. */
+void response_task_ids(SoupMessage *msg, vector<int> *task_ids) {
+  string response(msg->response_body->data, msg->response_body->length);
+  size_t start = response.find("\"tasks\"");
+  if(start == string::npos) {
+    return;
+  }
+  start = response.find('[', start);
+  size_t end = response.find(']', start);
+  if(start == string::npos || end == string::npos) {
+    return;
+  }
+  const char *ptr = response.c_str() + start + 1;
+  const char *ptr_end = response.c_str() + end;
+  while(ptr < ptr_end) {
+    char *next;
+    long task_id = strtol(ptr, &next, 10);
+    if(next == ptr) {
+      ++ptr;
+      continue;
+    }
+    task_ids->push_back(task_id);
+    ptr = next;
+  }
+}
+
+/* Handle tasks reporting completion of the previous batch together with
+ * request for the next one, so there's single round trip per batch.
+ */
+int report_main(SoupSession *session) {
+  string uri = string_printf("http://127.0.0.1:9999/report_tasks?count=%d",
+                             max(FLAGS_tasks_per_request, 1));
+  vector<int> task_ids;
+  int num_tasks_handled = 0;
+  double start_time = util_time_dt();
+  for(;;) {
+    string body;
+    foreach(int task_id, task_ids) {
+      body += string_printf("%d completed\n", task_id);
+    }
+    SoupMessage *msg = soup_message_new("POST", uri.c_str());
+    soup_message_set_request(msg,
+                             "text/plain",
+                             SOUP_MEMORY_COPY,
+                             body.c_str(),
+                             body.size());
+    guint status = soup_session_send_message(session, msg);
+    if(status != 200) {
+      g_object_unref(msg);
+      VLOG(1) << "Wait for server to come back.";
+      sleep(2);
+      continue;
+    }
+    num_tasks_handled += task_ids.size();
+    task_ids.clear();
+    response_task_ids(msg, &task_ids);
+    g_object_unref(msg);
+    if(task_ids.empty()) {
+      break;
+    }
+  }
+  VLOG(1) << "Number of handled tasks: " << num_tasks_handled << ".";
+  VLOG(1) << "Tasks per second: "
+          << (double)num_tasks_handled / (util_time_dt() - start_time)
+          << ".";
+  return EXIT_SUCCESS;
+}
+
+}  /* namespace */
+
 int main(int argc, char **argv) {
+  FARM_GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
   util_logging_init(argv[0]);
   /* TODO(sergey): Make it a ocmmand line argument. */
   util_logging_start();
@@ -39,7 +146,16 @@ int main(int argc, char **argv) {
       SOUP_SESSION_ADD_FEATURE_BY_TYPE, SOUP_TYPE_CONTENT_SNIFFER,
       NULL);
 
-  SoupMessage *msg = soup_message_new("GET", "http://127.0.0.1:9999/get_task");
+  if(FLAGS_report) {
+    return report_main(session);
+  }
+
+  string uri = string_printf("http://127.0.0.1:9999/get_task?count=%d",
+                             max(FLAGS_tasks_per_request, 0));
+  if(FLAGS_wait > 0) {
+    uri += string_printf("&wait=%d", FLAGS_wait);
+  }
+  SoupMessage *msg = soup_message_new("GET", uri.c_str());
 
   int num_tasks_handled = 0;
   double start_time;
@@ -49,9 +165,9 @@ int main(int argc, char **argv) {
       if(num_tasks_handled == 0) {
         start_time = util_time_dt();
       }
-      ++num_tasks_handled;
+      num_tasks_handled += response_num_tasks(msg);
       continue;
-    } else if (status == 404) {
+    } else if (status == 404 && FLAGS_wait <= 0) {
       VLOG(1) << "All done!.";
       break;
     }
@@ -62,6 +178,11 @@ int main(int argc, char **argv) {
               << ".";
       num_tasks_handled = 0;
     }
+    if(status == 404) {
+      /* Server held the request for the whole wait time, ask again. */
+      VLOG(1) << "No tasks to handle, polling again.";
+      continue;
+    }
     VLOG(1) << "Wait for server to come back.";
     sleep(2);
   }
@@ -48,6 +48,12 @@ class HTTPServer {
   /* Stop serving HTTP. */
   virtual void stop_serve() = 0;
 
+  /* Notify server that new tasks might have become available for dispatch.
+   *
+   * Could be called from any thread.
+   */
+  virtual void tasks_available() {}
+
   /* Get path to the document root, */
   const string& get_document_root() { return document_root_; }
 
@@ -27,10 +27,14 @@
 #include <sys/stat.h>
 
 #include "model/model_farm.h"
+#include "model/model_snapshot.h"
 #include "model/model_task.h"
+#include "util/util_algorithm.h"
 #include "util/util_foreach.h"
+#include "util/util_function.h"
 #include "util/util_json.h"
 #include "util/util_logging.h"
+#include "util/util_memory.h"
 #include "util/util_path.h"
 #include "util/util_string.h"
 #include "util/util_time.h"
@@ -72,6 +76,32 @@ void serve_set_response_json(SoupMessage *msg,
                             serialized.size());
 }
 
+void serve_set_response_json(SoupMessage *msg,
+                             json_array& response) {
+  string serialized = response.serialize();
+  soup_message_set_response(msg,
+                            "text/plain",
+                            SOUP_MEMORY_COPY,
+                            serialized.c_str(),
+                            serialized.size());
+}
+
+/* Get integer argument from the request query, default_value is returned
+ * if there's no such argument.
+ */
+int serve_query_int(GHashTable *query,
+                    const char *name,
+                    int default_value) {
+  if(query == NULL) {
+    return default_value;
+  }
+  const char *value = (const char*)g_hash_table_lookup(query, name);
+  if(value == NULL) {
+    return default_value;
+  }
+  return atoi(value);
+}
+
 void perform_file_serve(SoupServer *server,
                         SoupMessage *msg,
                         const string& path) {
@@ -155,10 +185,15 @@ void serve_welcome_callback(SoupServer *server,
 
 void serve_jobs_list(SOUPHTTPServer *http_server,
                      SoupMessage *msg) {
-  vector<Job*> jobs = http_server->farm()->jobs();
+  /* Served from the snapshot, so dashboard polling never contends with
+   * dispatch for the farm lock.
+   */
+  Farm *farm = http_server->farm();
+  shared_ptr<const FarmSnapshot> snapshot = farm->snapshot();
+  double current_time = farm->current_time();
   json jobs_serialized;
-  foreach(Job* job, jobs) {
-    jobs_serialized[job->id()] = job->serialize_json();
+  foreach(const shared_ptr<const JobSnapshot>& job, snapshot->jobs) {
+    jobs_serialized[job->id] = job->serialize_json(current_time);
   }
   serve_set_response_json(msg, jobs_serialized);
   soup_message_set_status(msg, SOUP_STATUS_OK);
@@ -169,12 +204,14 @@ void serve_job_details(SOUPHTTPServer *http_server,
                        const char *path) {
   int id = atoi(path + 6);
   VLOG(1) << "Getting details of job " << id << ".";
-  Job *job = http_server->farm()->job_by_id(id);
+  Farm *farm = http_server->farm();
+  shared_ptr<const FarmSnapshot> snapshot = farm->snapshot();
+  const JobSnapshot *job = snapshot->job_by_id(id);
   if(job == NULL) {
     soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
     return;
   }
-  json job_serialized = job->serialize_json(true);
+  json job_serialized = job->serialize_json(farm->current_time(), true);
   serve_set_response_json(msg, job_serialized);
   soup_message_set_status(msg, SOUP_STATUS_OK);
 }
@@ -185,15 +222,32 @@ void serve_job_command(SOUPHTTPServer *http_server,
   /* TODO(sergey): Sanity check on ID. */
   const int id = atoi(query["id"].c_str());
   const string& command = query["command"];
+  Farm *farm = http_server->farm();
+  Job *job = farm->job_by_id(id);
+  if(job == NULL) {
+    VLOG(1) << "Unknown job ID " << id << ".";
+    soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+    return;
+  }
   bool ok = false;
   if(command == "start") {
     VLOG(1) << "Starting job ID " << id << ".";
-    /* TODO(sergey): Needs implementation. */
-    ok = true;
+    if(job->status() == Job::STATUS_PAUSED) {
+      ok = farm->set_job_status(job, Job::STATUS_WAITING);
+    } else {
+      ok = true;
+    }
   } else if(command == "stop") {
     VLOG(1) << "Stopping job ID " << id << ".";
-    /* TODO(sergey): Needs implementation. */
-    ok = true;
+    /* Only running jobs are paused, others are answered with 403. */
+    ok = farm->pause_job(job);
+  } else if(command == "priority") {
+    const int priority = atoi(query["priority"].c_str());
+    VLOG(1) << "Setting priority of job ID " << id << " to "
+            << priority << ".";
+    if(priority >= 0 && priority <= 255) {
+      ok = farm->set_job_priority(job, (Job::Priority)priority);
+    }
   } else if(command == "rese6") {
     VLOG(1) << "Resetting job ID " << id << ".";
     /* TODO(sergey): Needs implementation. */
@@ -247,6 +301,77 @@ void serve_jobs_delete_callback(SoupServer *server,
   serve_callback_end_log(msg);
 }
 
+/* Put dispatched tasks to the response.
+ *
+ * When num_tasks is 0 the plain ID of a single task is given, otherwise
+ * tasks are given as a JSON array of IDs.
+ */
+void serve_set_tasks_response(SoupMessage *msg,
+                              int num_tasks,
+                              const vector<int>& task_ids) {
+  if(num_tasks == 0) {
+    VLOG(1) << "Found new task for dispatch: " << task_ids[0] << ".";
+    string task_id = string_printf("%d", task_ids[0]);
+    soup_message_set_response(msg,
+                              "text/plain",
+                              SOUP_MEMORY_COPY,
+                              task_id.c_str(),
+                              task_id.size());
+  } else {
+    VLOG(1) << "Found " << task_ids.size() << " new task(s) for dispatch.";
+    json_array task_ids_json;
+    foreach(int task_id, task_ids) {
+      task_ids_json.push_back(task_id);
+    }
+    serve_set_response_json(msg, task_ids_json);
+  }
+  soup_message_set_status(msg, SOUP_STATUS_OK);
+}
+
+/* Dispatch tasks and put them to the response.
+ *
+ * Returns false if there're no tasks to dispatch, response is not
+ * modified in this case.
+ */
+bool serve_dispatch_tasks(SOUPHTTPServer *http_server,
+                          SoupMessage *msg,
+                          int num_tasks) {
+  vector<Task*> tasks;
+  http_server->farm()->dispatch_tasks(max(num_tasks, 1), &tasks);
+  if(tasks.empty()) {
+    return false;
+  }
+  vector<int> task_ids;
+  foreach(Task *task, tasks) {
+    task_ids.push_back(task->id());
+  }
+  serve_set_tasks_response(msg, num_tasks, task_ids);
+  return true;
+}
+
+/* Park request for which no tasks were found if it's allowed to wait,
+ * otherwise respond that there're no tasks.
+ *
+ * Returns true if the request is parked.
+ */
+bool serve_wait_for_tasks(SOUPHTTPServer *http_server,
+                          SoupMessage *msg,
+                          int num_tasks,
+                          int wait_time) {
+  if(wait_time <= 0) {
+    VLOG(1) << "No tasks found for dispatch,";
+    soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+    return false;
+  }
+  if(http_server->long_poll_add(msg, num_tasks, wait_time)) {
+    VLOG(1) << "No tasks found for dispatch, request is parked.";
+    return true;
+  }
+  VLOG(1) << "Too many parked requests.";
+  soup_message_set_status(msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+  return false;
+}
+
 void serve_get_task_callback(SoupServer *server,
                              SoupMessage *msg,
                              const char *path,
@@ -256,18 +381,50 @@ void serve_get_task_callback(SoupServer *server,
   serve_callback_begin_log(msg, path, __func__);
   if(msg->method == SOUP_METHOD_GET) {
     SOUPHTTPServer *http_server = (SOUPHTTPServer*)data;
-    Task *task = http_server->farm()->dispatch_task();
-    if(task != NULL) {
-      VLOG(1) << "Found new task for dispatch: " << task->id() << ".";
-      string task_id = string_printf("%d", task->id());
-      soup_message_set_response(msg,
-                                "text/plain",
-                                SOUP_MEMORY_COPY,
-                                task_id.c_str(),
-                                task_id.size());
+    /* When count is specified tasks are returned as a JSON array of IDs,
+     * otherwise the plain ID of a single task is returned.
+     */
+    int num_tasks = serve_query_int(query, "count", 0);
+    num_tasks = max(0, min(num_tasks, http_server->max_tasks_per_request));
+    /* When wait is specified the request is parked for up to given number
+     * of seconds if there're no tasks to dispatch.
+     */
+    int wait_time = serve_query_int(query, "wait", 0);
+    if(http_server->num_dispatch_threads != 0) {
+      soup_server_pause_message(server, msg);
+      http_server->dispatch_request_add(msg, num_tasks, wait_time);
+      return;
+    }
+    if(!serve_dispatch_tasks(http_server, msg, num_tasks) &&
+       serve_wait_for_tasks(http_server, msg, num_tasks, wait_time)) {
+      soup_server_pause_message(server, msg);
+      return;
+    }
+  } else {
+    soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+  }
+  serve_callback_end_log(msg);
+}
+
+/* Extend lease of the task which is being processed by the worker.
+ *
+ * Responds with 404 if the task is not leased anymore, worker is to
+ * abandon the task in this case since it was given to another worker.
+ */
+void serve_task_heartbeat_callback(SoupServer *server,
+                                   SoupMessage *msg,
+                                   const char *path,
+                                   GHashTable *query,
+                                   SoupClientContext *context,
+                                   gpointer data) {
+  serve_callback_begin_log(msg, path, __func__);
+  if(msg->method == SOUP_METHOD_GET) {
+    SOUPHTTPServer *http_server = (SOUPHTTPServer*)data;
+    int task_id = serve_query_int(query, "id", -1);
+    if(http_server->farm()->extend_task_lease(task_id)) {
       soup_message_set_status(msg, SOUP_STATUS_OK);
     } else {
-      VLOG(1) << "No tasks found for dispatch,";
+      VLOG(1) << "Heartbeat for task " << task_id << " which is not leased.";
       soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
     }
   } else {
@@ -276,25 +433,211 @@ void serve_get_task_callback(SoupServer *server,
   serve_callback_end_log(msg);
 }
 
+/* Mark task which was processed by the worker as completed.
+ *
+ * Responds with 404 if the task is not leased by anyone.
+ */
+void serve_complete_task_callback(SoupServer *server,
+                                  SoupMessage *msg,
+                                  const char *path,
+                                  GHashTable *query,
+                                  SoupClientContext *context,
+                                  gpointer data) {
+  serve_callback_begin_log(msg, path, __func__);
+  if(msg->method == SOUP_METHOD_GET) {
+    SOUPHTTPServer *http_server = (SOUPHTTPServer*)data;
+    int task_id = serve_query_int(query, "id", -1);
+    if(http_server->farm()->complete_task(task_id)) {
+      soup_message_set_status(msg, SOUP_STATUS_OK);
+    } else {
+      VLOG(1) << "Completion of task " << task_id << " which is not leased.";
+      soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+    }
+  } else {
+    soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+  }
+  serve_callback_end_log(msg);
+}
+
+/* Parse task reports from the request body.
+ *
+ * Every line of the body reports one task as "<id> <status> [<runtime>]",
+ * where status is either "completed" or "failed" and optional runtime is
+ * measured by the worker in seconds.
+ */
+bool serve_parse_task_reports(const string& body,
+                              vector<Farm::TaskReport> *reports) {
+  size_t line_start = 0;
+  while(line_start < body.size()) {
+    size_t line_end = body.find('\n', line_start);
+    if(line_end == string::npos) {
+      line_end = body.size();
+    }
+    string line = body.substr(line_start, line_end - line_start);
+    line_start = line_end + 1;
+    if(line.find_first_not_of(" \t\r") == string::npos) {
+      continue;
+    }
+    Farm::TaskReport report;
+    char status[16];
+    report.runtime = -1.0;
+    if(sscanf(line.c_str(),
+              "%d %15s %lf",
+              &report.task_id,
+              status,
+              &report.runtime) < 2) {
+      return false;
+    }
+    if(strcmp(status, "completed") == 0) {
+      report.status = Task::STATUS_COMPLETED;
+    } else if(strcmp(status, "failed") == 0) {
+      report.status = Task::STATUS_FAILED;
+    } else {
+      return false;
+    }
+    reports->push_back(report);
+  }
+  return true;
+}
+
+/* Apply reports of many finished tasks and dispatch next ones.
+ *
+ * Body is parsed by serve_parse_task_reports(), up to count new tasks
+ * are dispatched in the same request unless there're parked get_task
+ * requests waiting for them. Responds with JSON object with
+ * "tasks" array of the dispatched task IDs and "rejected" array of the
+ * reported tasks which were not leased.
+ */
+void serve_report_tasks_callback(SoupServer *server,
+                                 SoupMessage *msg,
+                                 const char *path,
+                                 GHashTable *query,
+                                 SoupClientContext *context,
+                                 gpointer data) {
+  serve_callback_begin_log(msg, path, __func__);
+  if(msg->method == SOUP_METHOD_POST) {
+    SOUPHTTPServer *http_server = (SOUPHTTPServer*)data;
+    Farm *farm = http_server->farm();
+    string body;
+    if(msg->request_body->length != 0) {
+      body.assign(msg->request_body->data, msg->request_body->length);
+    }
+    vector<Farm::TaskReport> reports;
+    if(serve_parse_task_reports(body, &reports)) {
+      vector<int> rejected_task_ids;
+      farm->report_tasks(reports, &rejected_task_ids);
+      int num_tasks = serve_query_int(query, "count", 0);
+      num_tasks = max(0, min(num_tasks, http_server->max_tasks_per_request));
+      vector<Task*> tasks;
+      if(num_tasks != 0) {
+        /* Parked get_task requests came first, so they're given tasks
+         * before this one and the report only gets tasks when none of
+         * them is left waiting.
+         */
+        http_server->long_poll_serve();
+        if(!http_server->long_poll_waiting()) {
+          farm->dispatch_tasks(num_tasks, &tasks);
+        }
+      }
+      VLOG(1) << "Applied " << reports.size() << " task report(s), "
+              << rejected_task_ids.size() << " rejected, "
+              << tasks.size() << " new task(s) dispatched.";
+      json_array task_ids, rejected;
+      foreach(Task *task, tasks) {
+        task_ids.push_back(task->id());
+      }
+      foreach(int task_id, rejected_task_ids) {
+        rejected.push_back(task_id);
+      }
+      json response;
+      response["tasks"] = task_ids;
+      response["rejected"] = rejected;
+      serve_set_response_json(msg, response);
+      soup_message_set_status(msg, SOUP_STATUS_OK);
+    } else {
+      VLOG(1) << "Malformed task reports.";
+      soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
+    }
+  } else {
+    soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+  }
+  serve_callback_end_log(msg);
+}
+
+/* Statistics of the farm. */
+void serve_stats_callback(SoupServer *server,
+                          SoupMessage *msg,
+                          const char *path,
+                          GHashTable *query,
+                          SoupClientContext *context,
+                          gpointer data) {
+  serve_callback_begin_log(msg, path, __func__);
+  if(msg->method == SOUP_METHOD_GET) {
+    SOUPHTTPServer *http_server = (SOUPHTTPServer*)data;
+    Farm *farm = http_server->farm();
+    json stats;
+    stats["speculative_dispatches"] = farm->num_speculative_dispatches();
+    stats["speculative_wins"] = farm->num_speculative_wins();
+    serve_set_response_json(msg, stats);
+    soup_message_set_status(msg, SOUP_STATUS_OK);
+  } else {
+    soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+  }
+  serve_callback_end_log(msg);
+}
+
+void long_poll_finished_callback(SoupMessage *msg,
+                                 gpointer data) {
+  SOUPHTTPServer *http_server = (SOUPHTTPServer*)data;
+  http_server->long_poll_remove(msg);
+}
+
 gboolean idle_function(gpointer user_data) {
   SOUPHTTPServer *http_server = (SOUPHTTPServer*)user_data;
   if(http_server->idle_function_cb) {
     http_server->idle_function_cb();
   }
-  /* TODO(sergey): Might need to tweak this delay.
-   * or maybe use timer callback instead.
-   */
-  util_time_sleep(0.01);
+  /* Times out parked requests. */
+  http_server->long_poll_serve();
   return true;
 }
 
+/* One-shot source scheduled by tasks_available(). */
+gboolean long_poll_serve_function(gpointer user_data) {
+  SOUPHTTPServer *http_server = (SOUPHTTPServer*)user_data;
+  http_server->long_poll_serve();
+  return false;
+}
+
+void dispatch_request_finished_callback(SoupMessage *msg,
+                                        gpointer data) {
+  SOUPHTTPServer::DispatchRequest *request =
+      (SOUPHTTPServer::DispatchRequest*)data;
+  request->cancelled = true;
+}
+
+/* One-shot source scheduled by the dispatch thread. */
+gboolean dispatch_request_complete_function(gpointer user_data) {
+  SOUPHTTPServer::DispatchRequest *request =
+      (SOUPHTTPServer::DispatchRequest*)user_data;
+  request->http_server->dispatch_request_complete(request);
+  return false;
+}
+
 }  /* namespace */
 
 SOUPHTTPServer::SOUPHTTPServer(Farm *farm,
                                int port,
                                string document_root)
     : HTTPServer(farm, port, document_root),
-      main_loop_(NULL) {
+      max_tasks_per_request(256),
+      max_long_poll_requests(1024),
+      max_long_poll_time(60),
+      idle_interval(10),
+      num_dispatch_threads(0),
+      main_loop_(NULL),
+      tasks_available_(false),
+      dispatch_stop_requested_(false) {
   VLOG(1) << "Create new SOUP HTTP server ar port " << port << ".";
   server_ = soup_server_new(SOUP_SERVER_SERVER_HEADER, "farm-httpd", NULL);
 }
@@ -320,6 +663,10 @@ void SOUPHTTPServer::start_serve() {
   DECLARE_ROUTE("/jobs/thumbnails", serve_static_callback);
   DECLARE_ROUTE("/jobs/delete", serve_jobs_delete_callback);
   DECLARE_ROUTE("/get_task", serve_get_task_callback);
+  DECLARE_ROUTE("/task_heartbeat", serve_task_heartbeat_callback);
+  DECLARE_ROUTE("/complete_task", serve_complete_task_callback);
+  DECLARE_ROUTE("/report_tasks", serve_report_tasks_callback);
+  DECLARE_ROUTE("/stats", serve_stats_callback);
 #undef DECLARE_ROUTE
 
   GSList *uris, *u;
@@ -337,9 +684,11 @@ void SOUPHTTPServer::start_serve() {
    */
   main_loop_ = g_main_loop_new(NULL, FALSE);
 
-  g_idle_add(idle_function, this);
+  g_timeout_add(idle_interval, idle_function, this);
 
+  start_dispatch_threads();
   g_main_loop_run(main_loop_);
+  stop_dispatch_threads();
 }
 
 void SOUPHTTPServer::stop_serve() {
@@ -348,4 +697,193 @@ void SOUPHTTPServer::stop_serve() {
   soup_server_disconnect(server_);
 }
 
+void SOUPHTTPServer::tasks_available() {
+  /* Parked requests are served as soon as the main loop gets to it,
+   * without waiting for the idle function. Only one serve is scheduled
+   * until it clears the flag.
+   */
+  if(!tasks_available_.exchange(true)) {
+    g_idle_add(long_poll_serve_function, this);
+  }
+}
+
+/* Park get_task request until there're tasks to dispatch. */
+bool SOUPHTTPServer::long_poll_add(SoupMessage *msg,
+                                   int num_tasks,
+                                   int wait_time) {
+  if(long_poll_requests_.size() >= max_long_poll_requests) {
+    return false;
+  }
+  LongPollRequest request;
+  request.msg = msg;
+  request.num_tasks = num_tasks;
+  request.deadline = util_time_dt() + min(wait_time, max_long_poll_time);
+  request.finished_handler =
+      g_signal_connect(msg,
+                       "finished",
+                       G_CALLBACK(long_poll_finished_callback),
+                       this);
+  long_poll_requests_.push_back(request);
+  return true;
+}
+
+/* Complete parked requests. */
+void SOUPHTTPServer::long_poll_serve() {
+  if(long_poll_requests_.empty()) {
+    tasks_available_ = false;
+    return;
+  }
+  /* Requests are served in the order they came in. */
+  if(tasks_available_.exchange(false)) {
+    while(!long_poll_requests_.empty()) {
+      LongPollRequest request = long_poll_requests_.front();
+      if(!serve_dispatch_tasks(this, request.msg, request.num_tasks)) {
+        break;
+      }
+      long_poll_requests_.pop_front();
+      long_poll_complete(request);
+    }
+  }
+  double now = util_time_dt();
+  deque<LongPollRequest>::iterator it = long_poll_requests_.begin();
+  while(it != long_poll_requests_.end()) {
+    if(it->deadline <= now) {
+      LongPollRequest request = *it;
+      it = long_poll_requests_.erase(it);
+      VLOG(1) << "No tasks found for parked request,";
+      soup_message_set_status(request.msg, SOUP_STATUS_NOT_FOUND);
+      long_poll_complete(request);
+    } else {
+      ++it;
+    }
+  }
+}
+
+/* Forget about parked request. */
+void SOUPHTTPServer::long_poll_remove(SoupMessage *msg) {
+  deque<LongPollRequest>::iterator it;
+  for(it = long_poll_requests_.begin();
+      it != long_poll_requests_.end();
+      ++it) {
+    if(it->msg == msg) {
+      VLOG(1) << "Parked request is cancelled.";
+      g_signal_handler_disconnect(msg, it->finished_handler);
+      long_poll_requests_.erase(it);
+      return;
+    }
+  }
+}
+
+/* Resume parked request after its response was set. */
+void SOUPHTTPServer::long_poll_complete(const LongPollRequest& request) {
+  g_signal_handler_disconnect(request.msg, request.finished_handler);
+  serve_callback_end_log(request.msg);
+  soup_server_unpause_message(server_, request.msg);
+}
+
+/* Hand paused get_task request over to the dispatch threads. */
+void SOUPHTTPServer::dispatch_request_add(SoupMessage *msg,
+                                          int num_tasks,
+                                          int wait_time) {
+  DispatchRequest *request = new DispatchRequest();
+  request->http_server = this;
+  request->msg = msg;
+  request->num_tasks = num_tasks;
+  request->wait_time = wait_time;
+  request->cancelled = false;
+  /* Message is kept alive until the request is completed, even if the
+   * client disconnects meanwhile.
+   */
+  g_object_ref(msg);
+  request->finished_handler =
+      g_signal_connect(msg,
+                       "finished",
+                       G_CALLBACK(dispatch_request_finished_callback),
+                       request);
+  {
+    thread_scoped_lock requests_lock(dispatch_requests_lock_);
+    dispatch_requests_.push_back(request);
+  }
+  dispatch_requests_condition_.notify_one();
+}
+
+/* Respond to the request whose tasks were dispatched by the thread. */
+void SOUPHTTPServer::dispatch_request_complete(DispatchRequest *request) {
+  SoupMessage *msg = request->msg;
+  g_signal_handler_disconnect(msg, request->finished_handler);
+  if(request->cancelled) {
+    /* Tasks are given to other workers once their leases expire. */
+    VLOG(1) << "Request is cancelled while its tasks were dispatched.";
+  } else {
+    bool parked = false;
+    if(!request->task_ids.empty()) {
+      serve_set_tasks_response(msg, request->num_tasks, request->task_ids);
+    } else if(!serve_dispatch_tasks(this, msg, request->num_tasks)) {
+      /* Tasks which became available after the thread looked for them
+       * are dispatched above, request which is parked now would miss
+       * the notification about them.
+       */
+      parked = serve_wait_for_tasks(this,
+                                    msg,
+                                    request->num_tasks,
+                                    request->wait_time);
+    }
+    if(!parked) {
+      serve_callback_end_log(msg);
+      soup_server_unpause_message(server_, msg);
+    }
+  }
+  g_object_unref(msg);
+  delete request;
+}
+
+void SOUPHTTPServer::start_dispatch_threads() {
+  thread_scoped_lock requests_lock(dispatch_requests_lock_);
+  dispatch_stop_requested_ = false;
+  for(int i = 0; i < num_dispatch_threads; ++i) {
+    dispatch_threads_.push_back(
+        new thread(function_bind(&SOUPHTTPServer::dispatch_thread_run,
+                                 this)));
+  }
+}
+
+void SOUPHTTPServer::stop_dispatch_threads() {
+  {
+    thread_scoped_lock requests_lock(dispatch_requests_lock_);
+    dispatch_stop_requested_ = true;
+  }
+  dispatch_requests_condition_.notify_all();
+  foreach(thread *dispatch_thread, dispatch_threads_) {
+    dispatch_thread->join();
+    delete dispatch_thread;
+  }
+  dispatch_threads_.clear();
+}
+
+/* Dispatch tasks for the queued requests. */
+void SOUPHTTPServer::dispatch_thread_run() {
+  thread_scoped_lock requests_lock(dispatch_requests_lock_);
+  while(true) {
+    while(dispatch_requests_.empty() && !dispatch_stop_requested_) {
+      dispatch_requests_condition_.wait(requests_lock);
+    }
+    if(dispatch_requests_.empty()) {
+      break;
+    }
+    DispatchRequest *request = dispatch_requests_.front();
+    dispatch_requests_.pop_front();
+    requests_lock.unlock();
+    /* Farm allows dispatch from multiple threads, while messages are
+     * only touched from the main loop.
+     */
+    vector<Task*> tasks;
+    farm_->dispatch_tasks(max(request->num_tasks, 1), &tasks);
+    foreach(Task *task, tasks) {
+      request->task_ids.push_back(task->id());
+    }
+    g_idle_add(dispatch_request_complete_function, request);
+    requests_lock.lock();
+  }
+}
+
 }  /* namespace Farm */
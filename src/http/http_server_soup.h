@@ -22,7 +22,12 @@
 #define HTTP_SERVER_SOUP_
 
 #include "http/http_server.h"
+#include "util/util_atomic.h"
+#include "util/util_deque.h"
+#include "util/util_thread.h"
+#include "util/util_vector.h"
 
+struct _SoupMessage;
 struct _SoupServer;
 struct _GMainLoop;
 
@@ -44,9 +49,110 @@ class SOUPHTTPServer : public HTTPServer {
   /* Stop serving HTTP. */
   void stop_serve();
 
+  /* Notify server that new tasks might have become available for dispatch. */
+  void tasks_available();
+
+  /* Park get_task request until there're tasks to dispatch.
+   *
+   * Returns false if there're too many parked requests already.
+   */
+  bool long_poll_add(_SoupMessage *msg, int num_tasks, int wait_time);
+
+  /* Complete parked requests for which tasks are available or which
+   * are timed out.
+   */
+  void long_poll_serve();
+
+  /* Forget about parked request, used when client is disconnected. */
+  void long_poll_remove(_SoupMessage *msg);
+
+  /* Hand paused get_task request over to the dispatch threads. */
+  void dispatch_request_add(_SoupMessage *msg, int num_tasks, int wait_time);
+
+  /* Check whether there're parked requests waiting for tasks. */
+  bool long_poll_waiting() const {
+    return !long_poll_requests_.empty();
+  }
+
+  /* Maximum number of tasks which could be dispatched by a single
+   * get_task request.
+   */
+  int max_tasks_per_request;
+
+  /* Maximum number of get_task requests which are waiting for tasks. */
+  int max_long_poll_requests;
+
+  /* Maximum time in seconds get_task request is allowed to wait. */
+  int max_long_poll_time;
+
+  /* Interval in milliseconds between calls of the idle function. */
+  int idle_interval;
+
+  /* Number of threads which dispatch tasks for get_task requests, 0 means
+   * tasks are dispatched from the main loop. Farm is to have as many
+   * dispatch shards for the threads not to block each other.
+   */
+  int num_dispatch_threads;
+
+  /* get_task request which is handed over to the dispatch threads. */
+  struct DispatchRequest {
+    SOUPHTTPServer *http_server;
+    _SoupMessage *msg;
+    int num_tasks;
+    int wait_time;
+    /* IDs of the tasks dispatched by the thread, taken right away since
+     * the job of the duplicated straggler task might be finished and
+     * compacted by the time the request is completed.
+     */
+    vector<int> task_ids;
+    /* Handler of the message's finished signal. */
+    unsigned long finished_handler;
+    /* Client is disconnected while tasks were being dispatched. */
+    bool cancelled;
+  };
+
+  /* Respond to the request whose tasks were dispatched by the thread,
+   * called from the main loop.
+   */
+  void dispatch_request_complete(DispatchRequest *request);
+
  protected:
+  /* Request which is waiting for tasks to become available. */
+  struct LongPollRequest {
+    _SoupMessage *msg;
+    /* Number of tasks requested, 0 for a single task without batching. */
+    int num_tasks;
+    /* Time at which request is completed with no tasks. */
+    double deadline;
+    /* Handler of the message's finished signal. */
+    unsigned long finished_handler;
+  };
+
+  /* Resume parked request after its response was set. */
+  void long_poll_complete(const LongPollRequest& request);
+
+  /* Start and stop the dispatch threads. */
+  void start_dispatch_threads();
+  void stop_dispatch_threads();
+
+  /* Dispatch tasks for the queued requests, runs in the dispatch threads. */
+  void dispatch_thread_run();
+
   _SoupServer *server_;
   _GMainLoop *main_loop_;
+  /* Parked requests, in the order of their arrival. */
+  deque<LongPollRequest> long_poll_requests_;
+  /* Set when farm got new tasks since last long_poll_serve(), serve of
+   * parked requests is scheduled at the same time.
+   */
+  atomic<bool> tasks_available_;
+  /* Requests waiting for the dispatch threads, in the order of arrival. */
+  deque<DispatchRequest*> dispatch_requests_;
+  thread_mutex dispatch_requests_lock_;
+  thread_condition_variable dispatch_requests_condition_;
+  /* Threads are asked to stop once the queue is empty. */
+  bool dispatch_stop_requested_;
+  vector<thread*> dispatch_threads_;
 };
 
 }  /* namespace Farm */
@@ -0,0 +1,434 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "model/model_dispatch_queue.h"
+
+#include <cassert>
+
+#include "model/model_task.h"
+#include "util/util_algorithm.h"
+#include "util/util_foreach.h"
+
+namespace Farm {
+
+DispatchQueue::DispatchQueue(int num_shards)
+    : next_shard_(0),
+      fair_share_(false) {
+  for(int i = 0; i < num_shards; ++i) {
+    Shard *shard = new Shard();
+    shard->pass = 0.0;
+    shard->num_jobs = 0;
+    shard->top_priority = -1;
+    shards_.push_back(shard);
+  }
+}
+
+DispatchQueue::~DispatchQueue() {
+  foreach(Shard *shard, shards_) {
+    for(GroupsMap::iterator it = shard->groups.begin();
+        it != shard->groups.end();
+        ++it) {
+      delete it->second;
+    }
+    delete shard;
+  }
+}
+
+/* Add job to the queue. */
+bool DispatchQueue::add_job(Job *job) {
+  Shard& shard = job_shard(job);
+  thread_scoped_lock shard_lock(shard.mutex);
+  return add_job_locked(shard, job);
+}
+
+/* Add multiple jobs to the queue at once. */
+int DispatchQueue::add_jobs(const vector<Job*>& jobs) {
+  vector<vector<Job*> > shard_jobs(shards_.size());
+  foreach(Job *job, jobs) {
+    shard_jobs[(unsigned int)job->id() % shards_.size()].push_back(job);
+  }
+  int num_added = 0;
+  for(int i = 0; i < shards_.size(); ++i) {
+    Shard& shard = *shards_[i];
+    thread_scoped_lock shard_lock(shard.mutex);
+    map<Group*, vector<Job*> > group_jobs;
+    foreach(Job *job, shard_jobs[i]) {
+      if(job->queue_handle() == -1 && job->next_waiting_task() != NULL) {
+        group_jobs[job_group(shard, job)].push_back(job);
+      }
+    }
+    for(map<Group*, vector<Job*> >::iterator it = group_jobs.begin();
+        it != group_jobs.end();
+        ++it) {
+      Group *group = it->first;
+      const vector<Job*>& new_jobs = it->second;
+      if(group->jobs_queue.empty()) {
+        /* Group which was idle starts from the current virtual time. */
+        group->pass = max(group->pass, shard.pass);
+        group->jobs_queue.assign(new_jobs);
+        for(int j = 0; j < new_jobs.size(); ++j) {
+          new_jobs[j]->set_queue_handle(j);
+        }
+      } else {
+        foreach(Job *job, new_jobs) {
+          job->set_queue_handle(group->jobs_queue.push(job));
+        }
+      }
+      shard.num_jobs += new_jobs.size();
+      num_added += new_jobs.size();
+      update_group_locked(shard, group);
+    }
+  }
+  return num_added;
+}
+
+/* Remove job from the queue. */
+void DispatchQueue::remove_job(Job *job) {
+  Shard& shard = job_shard(job);
+  thread_scoped_lock shard_lock(shard.mutex);
+  remove_job_locked(shard, job);
+}
+
+/* Change priority of the job, restoring queue order. */
+void DispatchQueue::set_job_priority(Job *job, Job::Priority priority) {
+  Shard& shard = job_shard(job);
+  thread_scoped_lock shard_lock(shard.mutex);
+  job->set_priority(priority);
+  if(job->queue_handle() != -1) {
+    Group *group = job_group(shard, job);
+    group->jobs_queue.update(job->queue_handle());
+    update_group_locked(shard, group);
+  }
+}
+
+/* Change status of the job, adding it to or removing from the queue. */
+bool DispatchQueue::set_job_status(Job *job, Job::Status status) {
+  Shard& shard = job_shard(job);
+  thread_scoped_lock shard_lock(shard.mutex);
+  job->set_status(status);
+  if(job->is_running()) {
+    return add_job_locked(shard, job);
+  }
+  remove_job_locked(shard, job);
+  return false;
+}
+
+/* Take next task for dispatch. */
+Task *DispatchQueue::pop_task(Job **r_job, bool *r_job_activated) {
+  unsigned int start = next_shard_++;
+  for(;;) {
+    /* Find shard with the highest priority job without locking. */
+    Shard *best_shard = NULL;
+    int best_priority = -1;
+    for(int i = 0; i < shards_.size(); ++i) {
+      Shard *shard = shards_[(start + i) % shards_.size()];
+      int priority = shard->top_priority;
+      if(priority > best_priority) {
+        best_shard = shard;
+        best_priority = priority;
+      }
+    }
+    if(best_shard == NULL) {
+      return NULL;
+    }
+    thread_scoped_lock shard_lock(best_shard->mutex);
+    GroupsQueue& groups_queue = best_shard->groups_queue;
+    while(!groups_queue.empty()) {
+      Group *group = groups_queue.top();
+      Job *job = group->jobs_queue.top();
+      Task *task = job->next_waiting_task();
+      if(task == NULL) {
+        remove_job_locked(*best_shard, job);
+        continue;
+      }
+      job->advance_waiting_task();
+      job->set_task_status(task, Task::STATUS_ACTIVE);
+      *r_job_activated = false;
+      if(job->status() != Job::STATUS_ACTIVE) {
+        job->set_status(Job::STATUS_ACTIVE);
+        *r_job_activated = true;
+      }
+      best_shard->pass = group->pass;
+      group->pass += 1.0 / group->weight;
+      /* Keep the job in the queue for as long as it has waiting tasks. */
+      if(job->next_waiting_task() == NULL) {
+        remove_job_locked(*best_shard, job);
+      } else {
+        update_group_locked(*best_shard, group);
+      }
+      *r_job = job;
+      return task;
+    }
+    /* Shard became empty since we've looked at it, try again. */
+  }
+}
+
+/* Make active task of the job waiting for dispatch again. */
+bool DispatchQueue::requeue_task(Job *job, Task *task) {
+  Shard& shard = job_shard(job);
+  thread_scoped_lock shard_lock(shard.mutex);
+  job->set_task_status(task, Task::STATUS_WAITING);
+  job->requeue_waiting_task(task);
+  if(!job->is_running()) {
+    return false;
+  }
+  return add_job_locked(shard, job);
+}
+
+/* Mark active task of the job as completed. */
+bool DispatchQueue::complete_task(Job *job,
+                                  Task *task,
+                                  bool *r_job_finished) {
+  Shard& shard = job_shard(job);
+  thread_scoped_lock shard_lock(shard.mutex);
+  bool has_ready_tasks = job->complete_task(task);
+  return finish_task_locked(shard, job, has_ready_tasks, r_job_finished);
+}
+
+/* Note failure of the active task of the job. */
+bool DispatchQueue::fail_task(Job *job,
+                              Task *task,
+                              int max_retries,
+                              bool *r_job_finished) {
+  Shard& shard = job_shard(job);
+  thread_scoped_lock shard_lock(shard.mutex);
+  task->add_failure();
+  if(task->num_failures() <= max_retries) {
+    *r_job_finished = false;
+    job->set_task_status(task, Task::STATUS_WAITING);
+    job->requeue_waiting_task(task);
+    if(!job->is_running()) {
+      return false;
+    }
+    return add_job_locked(shard, job);
+  }
+  bool has_ready_tasks = job->fail_task(task);
+  return finish_task_locked(shard, job, has_ready_tasks, r_job_finished);
+}
+
+/* Note that one of the jobs the given job depends on is completed. */
+bool DispatchQueue::complete_job_dependency(Job *job) {
+  Shard& shard = job_shard(job);
+  thread_scoped_lock shard_lock(shard.mutex);
+  job->set_num_unmet_job_dependencies(job->num_unmet_job_dependencies() - 1);
+  if(!job->is_running()) {
+    return false;
+  }
+  return add_job_locked(shard, job);
+}
+
+/* Remove all jobs from the queue. */
+void DispatchQueue::clear() {
+  foreach(Shard *shard, shards_) {
+    thread_scoped_lock shard_lock(shard->mutex);
+    while(!shard->groups_queue.empty()) {
+      Group *group = shard->groups_queue.top();
+      remove_job_locked(*shard, group->jobs_queue.top());
+    }
+  }
+}
+
+/* Number of jobs in the queue. */
+size_t DispatchQueue::size() {
+  size_t size = 0;
+  foreach(Shard *shard, shards_) {
+    thread_scoped_lock shard_lock(shard->mutex);
+    size += shard->num_jobs;
+  }
+  return size;
+}
+
+/* Enable or disable fair share between job owners. */
+void DispatchQueue::set_fair_share(bool fair_share) {
+  /* Groups of the jobs change, so all the shards are locked for the time
+   * jobs are moved, pops and adds never see a half-regrouped queue.
+   */
+  foreach(Shard *shard, shards_) {
+    shard->mutex.lock();
+  }
+  vector<vector<Job*> > shard_jobs(shards_.size());
+  for(int i = 0; i < shards_.size(); ++i) {
+    Shard& shard = *shards_[i];
+    while(!shard.groups_queue.empty()) {
+      Job *job = shard.groups_queue.top()->jobs_queue.top();
+      shard_jobs[i].push_back(job);
+      remove_job_locked(shard, job);
+    }
+  }
+  fair_share_ = fair_share;
+  for(int i = 0; i < shards_.size(); ++i) {
+    foreach(Job *job, shard_jobs[i]) {
+      add_job_locked(*shards_[i], job);
+    }
+  }
+  foreach(Shard *shard, shards_) {
+    shard->mutex.unlock();
+  }
+}
+
+/* Set share weight of the owner. */
+void DispatchQueue::set_owner_weight(const string& owner, double weight) {
+  assert(weight > 0.0);
+  {
+    thread_scoped_lock weights_lock(weights_mutex_);
+    owner_weights_[owner] = weight;
+  }
+  foreach(Shard *shard, shards_) {
+    thread_scoped_lock shard_lock(shard->mutex);
+    GroupsMap::iterator it = shard->groups.find(owner);
+    if(it != shard->groups.end()) {
+      it->second->weight = weight;
+    }
+  }
+}
+
+DispatchQueue::Shard& DispatchQueue::job_shard(const Job *job) {
+  return *shards_[(unsigned int)job->id() % shards_.size()];
+}
+
+DispatchQueue::Group *DispatchQueue::job_group(Shard& shard,
+                                               const Job *job) {
+  static const string default_owner = "";
+  const string& owner = fair_share_ ? job->owner() : default_owner;
+  GroupsMap::iterator it = shard.groups.find(owner);
+  if(it != shard.groups.end()) {
+    return it->second;
+  }
+  Group *group = new Group();
+  group->pass = shard.pass;
+  group->weight = 1.0;
+  group->queue_handle = -1;
+  {
+    thread_scoped_lock weights_lock(weights_mutex_);
+    map<string, double>::iterator weight = owner_weights_.find(owner);
+    if(weight != owner_weights_.end()) {
+      group->weight = weight->second;
+    }
+  }
+  shard.groups[owner] = group;
+  return group;
+}
+
+bool DispatchQueue::add_job_locked(Shard& shard, Job *job) {
+  if(job->queue_handle() != -1) {
+    return false;
+  }
+  if(job->next_waiting_task() == NULL) {
+    return false;
+  }
+  Group *group = job_group(shard, job);
+  if(group->queue_handle == -1) {
+    /* Group which was idle starts from the current virtual time. */
+    group->pass = max(group->pass, shard.pass);
+  }
+  job->set_queue_handle(group->jobs_queue.push(job));
+  ++shard.num_jobs;
+  update_group_locked(shard, group);
+  return true;
+}
+
+bool DispatchQueue::finish_task_locked(Shard& shard,
+                                       Job *job,
+                                       bool has_ready_tasks,
+                                       bool *r_job_finished) {
+  *r_job_finished = false;
+  if(job->all_tasks_finished()) {
+    job->set_status(job->num_tasks_with_status(Task::STATUS_FAILED) == 0
+                        ? Job::STATUS_COMPLETED
+                        : Job::STATUS_FAILED);
+    remove_job_locked(shard, job);
+    *r_job_finished = true;
+    return false;
+  }
+  if(!has_ready_tasks || !job->is_running()) {
+    return false;
+  }
+  add_job_locked(shard, job);
+  return true;
+}
+
+void DispatchQueue::remove_job_locked(Shard& shard, Job *job) {
+  if(job->queue_handle() == -1) {
+    return;
+  }
+  Group *group = job_group(shard, job);
+  group->jobs_queue.erase(job->queue_handle());
+  job->set_queue_handle(-1);
+  --shard.num_jobs;
+  update_group_locked(shard, group);
+}
+
+/* Restore order of the group after its top job has changed. */
+void DispatchQueue::update_group_locked(Shard& shard, Group *group) {
+  if(group->jobs_queue.empty()) {
+    if(group->queue_handle != -1) {
+      shard.groups_queue.erase(group->queue_handle);
+      group->queue_handle = -1;
+    }
+  } else if(group->queue_handle == -1) {
+    group->queue_handle = shard.groups_queue.push(group);
+  } else {
+    shard.groups_queue.update(group->queue_handle);
+  }
+  publish_top_priority(shard);
+}
+
+/* Update published top priority of the shard. */
+void DispatchQueue::publish_top_priority(Shard& shard) {
+  if(shard.groups_queue.empty()) {
+    shard.top_priority = -1;
+  } else {
+    Group *group = shard.groups_queue.top();
+    shard.top_priority = group->jobs_queue.top()->priority();
+  }
+}
+
+/* Returns true if left job is to be dispatched after the right one:
+ * higher priority jobs goes first, then older jobs.
+ */
+bool DispatchQueue::JobPriorityCompare::operator() (const Job *left,
+                                                    const Job *right) {
+  if(left->priority() != right->priority()) {
+    return left->priority() < right->priority();
+  }
+  return left->id() > right->id();
+}
+
+/* Returns true if left group is to be served after the right one:
+ * group which got less than its share so far goes first, then the group
+ * with higher priority top job, then the one with older top job.
+ *
+ * Priority doesn't let an owner take more than its share, it only orders
+ * jobs within the owner's group.
+ */
+bool DispatchQueue::GroupPriorityCompare::operator() (const Group *left,
+                                                      const Group *right) {
+  if(left->pass != right->pass) {
+    return left->pass > right->pass;
+  }
+  const Job *left_job = left->jobs_queue.top();
+  const Job *right_job = right->jobs_queue.top();
+  if(left_job->priority() != right_job->priority()) {
+    return left_job->priority() < right_job->priority();
+  }
+  return left_job->id() > right_job->id();
+}
+
+}  /* namespace Farm */
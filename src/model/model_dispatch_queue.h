@@ -0,0 +1,232 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef MODEL_DISPATCH_QUEUE_
+#define MODEL_DISPATCH_QUEUE_
+
+#include "model/model_job.h"
+
+#include "util/util_atomic.h"
+#include "util/util_map.h"
+#include "util/util_priority_queue.h"
+#include "util/util_string.h"
+#include "util/util_thread.h"
+#include "util/util_vector.h"
+
+namespace Farm {
+
+class Task;
+
+/* Two-level queue of tasks which are ready for dispatch.
+ *
+ * Only jobs which have waiting tasks are kept in the heap, tasks themselves
+ * are taken from the job using its waiting tasks cursor. This way memory
+ * used by the queue is O(jobs) rather than O(tasks).
+ *
+ * Jobs are distributed over shards by their ID, every shard has its own
+ * lock and publishes priority of its top job, so tasks could be popped
+ * from multiple threads at once. Tasks are always taken from the shard
+ * with the highest priority job; the order between jobs of the same
+ * priority living in different shards is not defined.
+ *
+ * With fair share enabled jobs of every owner are grouped together and
+ * groups are served proportionally to their weights (stride scheduling):
+ * every dispatched task advances the group's pass by 1/weight and the
+ * group with the smallest pass goes first. Priority only orders jobs
+ * within the group, so owner with high priority jobs doesn't starve the
+ * others. Fairness is maintained per shard.
+ *
+ * Scheduling fields of queued jobs (priority, status, tasks cursor) are
+ * only to be modified through the queue, which does it under the lock
+ * of the job's shard.
+ */
+class DispatchQueue {
+ public:
+  explicit DispatchQueue(int num_shards = 1);
+
+  ~DispatchQueue();
+
+  /* Add job to the queue, does nothing if the job has no waiting tasks.
+   *
+   * Returns true if the job was added.
+   */
+  bool add_job(Job *job);
+
+  /* Add multiple jobs to the queue at once, jobs queues of the groups
+   * which were empty are built in linear time instead of pushing jobs one
+   * by one.
+   *
+   * Returns number of added jobs.
+   */
+  int add_jobs(const vector<Job*>& jobs);
+
+  /* Remove job from the queue. */
+  void remove_job(Job *job);
+
+  /* Change priority of the job, restoring queue order. */
+  void set_job_priority(Job *job, Job::Priority priority);
+
+  /* Change status of the job, adding it to or removing from the queue.
+   *
+   * Returns true if the job was added to the queue.
+   */
+  bool set_job_status(Job *job, Job::Status status);
+
+  /* Take next task for dispatch, NULL if there're no more waiting tasks.
+   *
+   * Task is marked as active, and so is the job. job_activated is set to
+   * true if the status of the job was changed.
+   */
+  Task *pop_task(Job **r_job, bool *r_job_activated);
+
+  /* Make active task of the job waiting for dispatch again.
+   *
+   * Returns true if the job was added to the queue.
+   */
+  bool requeue_task(Job *job, Task *task);
+
+  /* Mark active task of the job as completed, queueing tasks which
+   * depended on it. Job is marked as completed (or failed, if some of
+   * its tasks failed) and removed from the queue once all its tasks are
+   * finished.
+   *
+   * Returns true if new tasks became available for dispatch.
+   */
+  bool complete_task(Job *job, Task *task, bool *r_job_finished);
+
+  /* Note failure of the active task of the job.
+   *
+   * Task is returned to the waiting tasks until it failed more than
+   * max_retries times. After that it's finished as failed and its
+   * dependents are released. Job is marked as failed once all its tasks
+   * are finished and some of them failed.
+   *
+   * Returns true if new tasks became available for dispatch.
+   */
+  bool fail_task(Job *job,
+                 Task *task,
+                 int max_retries,
+                 bool *r_job_finished);
+
+  /* Note that one of the jobs the given job depends on is completed.
+   *
+   * Returns true if the job was added to the queue.
+   */
+  bool complete_job_dependency(Job *job);
+
+  /* Remove all jobs from the queue. */
+  void clear();
+
+  /* Number of jobs in the queue. */
+  size_t size();
+
+  /* Lock which guards scheduling fields of the given job. */
+  thread_mutex& job_mutex(const Job *job) { return job_shard(job).mutex; }
+
+  /* Enable or disable fair share between job owners.
+   *
+   * Queued jobs are regrouped under the locks of all shards, so it could
+   * be called while tasks are being dispatched.
+   */
+  void set_fair_share(bool fair_share);
+
+  /* Set share weight of the owner, default weight is 1. */
+  void set_owner_weight(const string& owner, double weight);
+
+ protected:
+  class JobPriorityCompare {
+   public:
+    bool operator() (const Job *left, const Job *right);
+  };
+  typedef indexed_priority_queue<Job*, JobPriorityCompare> JobsQueue;
+
+  /* Jobs of the same owner. */
+  struct Group {
+    /* Jobs of the group which have tasks waiting for dispatch. */
+    JobsQueue jobs_queue;
+    /* Virtual time of the group, advanced by 1/weight per dispatch. */
+    double pass;
+    double weight;
+    /* Handle in the shard's groups queue, -1 if the group is empty. */
+    int queue_handle;
+  };
+
+  class GroupPriorityCompare {
+   public:
+    bool operator() (const Group *left, const Group *right);
+  };
+  typedef indexed_priority_queue<Group*, GroupPriorityCompare> GroupsQueue;
+  typedef map<string, Group*> GroupsMap;
+
+  struct Shard {
+    /* Lock which guards the shard and all jobs in it. */
+    thread_mutex mutex;
+    /* Groups which have jobs with tasks waiting for dispatch. */
+    GroupsQueue groups_queue;
+    /* All groups ever used in this shard, indexed by owner. */
+    GroupsMap groups;
+    /* Pass of the most recently served group, used for groups which
+     * are becoming non-empty so they don't get credit for being idle.
+     */
+    double pass;
+    /* Number of jobs in the shard. */
+    int num_jobs;
+    /* Priority of the top job, -1 if shard is empty.
+     *
+     * Could be read without locking to choose shard to pop from.
+     */
+    atomic<int> top_priority;
+  };
+
+  Shard& job_shard(const Job *job);
+  Group *job_group(Shard& shard, const Job *job);
+
+  bool add_job_locked(Shard& shard, Job *job);
+  void remove_job_locked(Shard& shard, Job *job);
+
+  /* Update the job after one of its tasks is finished, has_ready_tasks
+   * tells whether dependents of the task became ready.
+   */
+  bool finish_task_locked(Shard& shard,
+                          Job *job,
+                          bool has_ready_tasks,
+                          bool *r_job_finished);
+
+  /* Restore order of the group after its top job has changed. */
+  void update_group_locked(Shard& shard, Group *group);
+
+  /* Update published top priority of the shard. */
+  void publish_top_priority(Shard& shard);
+
+  vector<Shard*> shards_;
+  /* Shard to start looking for tasks from, spreads concurrent pops
+   * across shards with the same top priority.
+   */
+  atomic<unsigned int> next_shard_;
+  /* Group jobs by their owner, only changed with all shards locked. */
+  bool fair_share_;
+  /* Weights of owners, missing owners have weight of 1. */
+  map<string, double> owner_weights_;
+  thread_mutex weights_mutex_;
+};
+
+}  /* namespace Farm */
+
+#endif  /* MODEL_DISPATCH_QUEUE_ */
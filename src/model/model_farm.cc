@@ -22,141 +22,1092 @@
 
 #include "model/model_job.h"
 #include "storage/storage.h"
+#include "util/util_algorithm.h"
 #include "util/util_foreach.h"
 #include "util/util_logging.h"
+#include "util/util_time.h"
 
 namespace Farm {
 
-Farm::Farm(Storage *storage)
-    : storage_(storage),
-      max_job_id_(-1) {
+namespace {
+
+/* Number of IDs reserved in the storage at once. Tasks of a job take
+ * consecutive IDs, jobs with more tasks reserve a block of their own.
+ */
+const int job_ids_block_size = 64;
+const int task_ids_block_size = 64 * Job::NUM_GENERATED_TASKS;
+
+/* Resolution of the task leases expiration, in seconds. */
+const double lease_tick_duration = 0.1;
+
+/* Tick of the leases wheel which contains the given time. */
+timing_wheel<int>::tick_type lease_tick(double time) {
+  return (timing_wheel<int>::tick_type)(time / lease_tick_duration);
+}
+
+/* Number of consecutive task IDs which have their leases in the same
+ * shard. Tasks of a job have consecutive IDs, so a batch of dispatched
+ * tasks usually only takes one shard lock.
+ */
+const int lease_shard_span = 64;
+
+/* Thread of the restore, hands the retrieved tasks over to the jobs. */
+void restore_jobs_tasks_run(
+    const vector<Job*> *jobs,
+    vector<vector<Task> > *all_tasks,
+    const vector<vector<Job::TaskDependency> > *all_dependencies,
+    atomic<int> *next_job_index) {
+  int i;
+  while((i = (*next_job_index)++) < jobs->size()) {
+    (*jobs)[i]->take_tasks(&(*all_tasks)[i], (*all_dependencies)[i]);
+  }
+}
+
+}  /* namespace */
+
+Farm::Farm(Storage *storage, int num_dispatch_shards)
+    : task_lease_time(60.0),
+      max_task_retries(3),
+      speculative_dispatch(true),
+      straggler_runtime_factor(3.0),
+      straggler_min_samples(10),
+      straggler_check_interval(1.0),
+      task_cache_size(256 * 1024 * 1024),
+      snapshot_interval(1.0),
+      store_interval(0.0),
+      num_restore_threads(0),
+      storage_(storage),
+      next_job_id_(0),
+      job_ids_end_(0),
+      next_task_id_(0),
+      task_ids_end_(0),
+      dispatch_queue_(num_dispatch_shards),
+      last_store_time_(0.0),
+      num_stored_updates_(0),
+      num_straggler_tasks_(0),
+      last_straggler_check_time_(0.0),
+      num_speculative_dispatches_(0),
+      num_speculative_wins_(0),
+      task_cache_memory_(0),
+      snapshot_(make_shared<FarmSnapshot>()),
+      last_snapshot_time_(0.0) {
+  for(int i = 0; i < num_dispatch_shards; ++i) {
+    LeaseShard *shard = new LeaseShard();
+    shard->num_recorded_updates = 0;
+    shard->task_leases_wheel.reset(lease_tick(util_time_dt()));
+    lease_shards_.push_back(shard);
+  }
 }
 
 Farm::~Farm() {
   foreach(Job *job, jobs_) {
     delete job;
   }
+  foreach(LeaseShard *shard, lease_shards_) {
+    delete shard;
+  }
 }
 
 /* Real all farm data from the storage. */
 bool Farm::restore() {
   VLOG(1) << "Restoring farm from the storage.";
-  jobs_.clear();
   /* TODO(sergey): Proper error handling. */
-  storage_->retrieve_all_jobs(&jobs_);
-  VLOG(1) << "Restored " << jobs_.size() << " job(s).";
-  foreach(Job *job, jobs_) {
+  vector<Job*> jobs;
+  storage_->retrieve_all_jobs(&jobs);
+  VLOG(1) << "Restored " << jobs.size() << " job(s).";
+  vector<Job*> fetch_jobs;
+  foreach(Job *job, jobs) {
     if(job->need_always_fetch_tasks()) {
+      fetch_jobs.push_back(job);
+    }
+  }
+  /* Read tasks of all the jobs in a single pass when storage supports it
+   * and build the jobs from them on multiple threads.
+   */
+  vector<vector<Task> > all_tasks;
+  vector<vector<Job::TaskDependency> > all_dependencies;
+  if(storage_->retrieve_jobs_tasks(fetch_jobs,
+                                   &all_tasks,
+                                   &all_dependencies)) {
+    int num_threads = num_restore_threads;
+    if(num_threads <= 0) {
+      num_threads = max((int)thread::hardware_concurrency(), 1);
+    }
+    num_threads = min(num_threads, (int)fetch_jobs.size());
+    VLOG(1) << "Building " << fetch_jobs.size() << " job(s) using "
+            << num_threads << " thread(s).";
+    atomic<int> next_job_index(0);
+    if(num_threads <= 1) {
+      /* No need in an extra thread and its memory arena. */
+      restore_jobs_tasks_run(&fetch_jobs,
+                             &all_tasks,
+                             &all_dependencies,
+                             &next_job_index);
+    } else {
+      vector<thread*> threads;
+      for(int i = 0; i < num_threads; ++i) {
+        threads.push_back(new thread(function_bind(restore_jobs_tasks_run,
+                                                   &fetch_jobs,
+                                                   &all_tasks,
+                                                   &all_dependencies,
+                                                   &next_job_index)));
+      }
+      foreach(thread *restore_thread, threads) {
+        restore_thread->join();
+        delete restore_thread;
+      }
+    }
+  } else {
+    foreach(Job *job, fetch_jobs) {
       job->restore_tasks(storage_);
     }
   }
-  rebuild_priority_queue();
+  restore_jobs(jobs);
   return true;
 }
 
+/* Make restored jobs the jobs of the farm. */
+void Farm::restore_jobs(const vector<Job*>& jobs) {
+  jobs_.clear();
+  job_states_.clear();
+  jobs_by_id_.clear();
+  task_ranges_.clear();
+  task_cache_.clear();
+  task_cache_positions_.clear();
+  task_cache_memory_ = 0;
+  jobs_.reserve(jobs.size());
+  foreach(Job *job, jobs) {
+    add_job(job);
+    index_job(job);
+  }
+  foreach(Job *job, jobs_) {
+    if(job->tasks_resident() && !job->is_running()) {
+      cache_job_tasks(job);
+    }
+  }
+  restore_job_dependencies();
+  restore_task_leases();
+  rebuild_priority_queue();
+  publish_snapshot(false);
+}
+
 /* Store all the pending data to the storage. */
 bool Farm::store() {
+  thread_scoped_lock scoped_lock(lock);
   VLOG(1) << "Flushing farm data to the storage.";
-  return true;
+  store_pending_updates();
+  return storage_->flush_caches(true);
+}
+
+/* Current time in seconds. */
+double Farm::current_time() {
+  if(time_cb) {
+    return time_cb();
+  }
+  return util_time_dt();
 }
+
 /* Rebuild priority queue of tasks. */
 void Farm::rebuild_priority_queue() {
-  thread_scoped_lock(lock);
+  thread_scoped_lock scoped_lock(lock);
   VLOG(1) << "Rebuilding priority queue of tasks.";
-  foreach(Job *job, jobs_) {
-    if(job->is_running()) {
-      foreach(Task *task, job->tasks()) {
-        if(task->status() == Task::STATUS_WAITING) {
-          QueueTask queue_task(job, task);
-          tasks_queue_.push(queue_task);
+  dispatch_queue_.clear();
+  vector<Job*> running_jobs;
+  find_running_jobs(&running_jobs);
+  foreach(Job *job, running_jobs) {
+    job->reset_waiting_task();
+  }
+  queue_jobs(running_jobs);
+  VLOG(1) << "Added " << dispatch_queue_.size() << " jobs to the queue.";
+}
+
+/* Add job to the dispatch queue, notifying about new tasks. */
+void Farm::queue_job(Job *job) {
+  if(dispatch_queue_.add_job(job) && tasks_available_cb) {
+    tasks_available_cb();
+  }
+}
+
+/* Add jobs to the dispatch queue at once, notifying about new tasks. */
+void Farm::queue_jobs(const vector<Job*>& jobs) {
+  if(dispatch_queue_.add_jobs(jobs) != 0 && tasks_available_cb) {
+    tasks_available_cb();
+  }
+}
+
+/* Add job to the jobs list. */
+void Farm::add_job(Job *job) {
+  jobs_.push_back(job);
+  job_states_.push_back(job->state());
+  job->attach_state(&job_states_.back());
+}
+
+/* Get all running jobs. */
+void Farm::find_running_jobs(vector<Job*> *jobs) {
+  jobs->clear();
+  int slot = 0;
+  foreach(const Job::State& state, job_states_) {
+    if(Job::is_running_status(state.status.load(memory_order_relaxed))) {
+      jobs->push_back(jobs_[slot]);
+    }
+    ++slot;
+  }
+}
+
+/* Add job and its tasks to the ID indices. */
+void Farm::index_job(Job *job) {
+  if(job->id() < 0) {
+    return;
+  }
+  if(job->id() >= jobs_by_id_.size()) {
+    jobs_by_id_.resize(job->id() + 1, NULL);
+  }
+  jobs_by_id_[job->id()] = job;
+  const vector<Task>& tasks = job->tasks();
+  int num_tasks = tasks.size();
+  for(int i = 0; i < num_tasks;) {
+    int first_task_id = tasks[i].id();
+    int first_index = i++;
+    while(i < num_tasks && tasks[i].id() == first_task_id + i - first_index) {
+      ++i;
+    }
+    if(first_task_id < 0) {
+      continue;
+    }
+    TaskRange range = {job->id(), first_index, i - first_index};
+    task_ranges_[first_task_id] = range;
+  }
+}
+
+/* Find job and index of the task in the ranges index. */
+bool Farm::find_task_range(int id, Job **r_job, int *r_index) {
+  map<int, TaskRange>::const_iterator it = task_ranges_.upper_bound(id);
+  if(it == task_ranges_.begin()) {
+    return false;
+  }
+  --it;
+  const TaskRange& range = it->second;
+  if(id - it->first >= range.num_tasks) {
+    return false;
+  }
+  *r_job = jobs_by_id_[range.job_id];
+  *r_index = range.first_index + id - it->first;
+  return true;
+}
+
+/* Take ID for the new job from the reserved block. */
+int Farm::allocate_job_id() {
+  if(next_job_id_ == job_ids_end_) {
+    int first_id = storage_->reserve_ids(Storage::ID_TYPE_JOB,
+                                         job_ids_block_size);
+    if(first_id == -1) {
+      return -1;
+    }
+    next_job_id_ = first_id;
+    job_ids_end_ = first_id + job_ids_block_size;
+  }
+  return next_job_id_++;
+}
+
+/* Take consecutive IDs for tasks of the new job. */
+int Farm::allocate_task_ids(int num_tasks) {
+  if(task_ids_end_ - next_task_id_ < num_tasks) {
+    /* Rest of the current block is left unused. */
+    int block_size = max(task_ids_block_size, num_tasks);
+    int first_id = storage_->reserve_ids(Storage::ID_TYPE_TASK, block_size);
+    if(first_id == -1) {
+      return -1;
+    }
+    next_task_id_ = first_id;
+    task_ids_end_ = first_id + block_size;
+  }
+  int first_id = next_task_id_;
+  next_task_id_ += num_tasks;
+  return first_id;
+}
+
+/* Lookup job in the ID index. */
+Job *Farm::lookup_job(int id) {
+  if(id < 0 || id >= jobs_by_id_.size()) {
+    return NULL;
+  }
+  return jobs_by_id_[id];
+}
+
+/* Lookup task in the ID index. */
+Task *Farm::lookup_task(int id, Job **r_job) {
+  if(id < 0) {
+    return NULL;
+  }
+  Job *job;
+  int index;
+  if(!find_task_range(id, &job, &index)) {
+    /* Task might belong to a job which tasks were never loaded. */
+    job = lookup_job(storage_->retrieve_task_job_id(id));
+    if(job == NULL || job->tasks_resident()) {
+      return NULL;
+    }
+    load_job_tasks(job);
+    if(!find_task_range(id, &job, &index)) {
+      return NULL;
+    }
+  }
+  load_job_tasks(job);
+  if(r_job != NULL) {
+    *r_job = job;
+  }
+  return &job->tasks()[index];
+}
+
+/* Mark job as modified. */
+void Farm::add_pending_job(Job *job) {
+  /* Updates of the job could go to any shard. */
+  LeaseShard& shard = *lease_shards_[job->id() % lease_shards_.size()];
+  thread_scoped_lock shard_lock(shard.mutex);
+  add_pending_job_locked(shard, job);
+}
+
+/* Mark job as modified, shard lock is to be held. */
+void Farm::add_pending_job_locked(LeaseShard& shard, Job *job) {
+  /* Tasks of the same job are usually changed one after another. */
+  if(!shard.pending_jobs.empty() && shard.pending_jobs.back() == job) {
+    return;
+  }
+  shard.pending_jobs.push_back(job);
+  ++shard.num_recorded_updates;
+}
+
+/* Record the task state to be written by the next store. */
+void Farm::add_pending_task_locked(LeaseShard& shard,
+                                   const Task& task,
+                                   double lease_expire_time) {
+  ++shard.num_recorded_updates;
+  TaskUpdate update;
+  update.id = task.id();
+  update.status = task.status();
+  update.lease_expire_time = lease_expire_time;
+  unordered_map<int, int>::iterator it =
+      shard.pending_task_indices.find(task.id());
+  if(it != shard.pending_task_indices.end()) {
+    shard.pending_tasks[it->second] = update;
+    return;
+  }
+  shard.pending_task_indices[task.id()] = shard.pending_tasks.size();
+  shard.pending_tasks.push_back(update);
+}
+
+/* Number of changes of jobs and tasks which are to be written. */
+size_t Farm::num_recorded_updates() {
+  size_t num_updates = 0;
+  foreach(LeaseShard *shard, lease_shards_) {
+    thread_scoped_lock shard_lock(shard->mutex);
+    num_updates += shard->num_recorded_updates;
+  }
+  return num_updates;
+}
+
+/* Make sure tasks of the job are in memory. */
+void Farm::load_job_tasks(Job *job) {
+  if(job->tasks_resident()) {
+    if(!job->is_running()) {
+      cache_job_tasks(job);
+    }
+    return;
+  }
+  if(job->tasks_compacted()) {
+    /* Statuses kept in memory are at least as new as the storage. */
+    VLOG(1) << "Expanding tasks of job " << job->id() << ".";
+    job->expand_tasks();
+  } else {
+    VLOG(1) << "Loading tasks of job " << job->id() << ".";
+    /* Updates of the tasks might not be in the storage yet. */
+    store_pending_updates();
+    job->restore_tasks(storage_);
+  }
+  index_job(job);
+  if(!job->is_running()) {
+    cache_job_tasks(job);
+  }
+}
+
+/* Put tasks of the job to the cache. */
+void Farm::cache_job_tasks(Job *job) {
+  unordered_map<int, list<Job*>::iterator>::iterator it =
+      task_cache_positions_.find(job->id());
+  if(it != task_cache_positions_.end()) {
+    task_cache_.splice(task_cache_.begin(), task_cache_, it->second);
+    return;
+  }
+  task_cache_.push_front(job);
+  task_cache_positions_[job->id()] = task_cache_.begin();
+  task_cache_memory_ += job->tasks_memory_size();
+  evict_job_tasks();
+}
+
+/* Remove tasks of the job from the cache. */
+void Farm::uncache_job_tasks(Job *job) {
+  unordered_map<int, list<Job*>::iterator>::iterator it =
+      task_cache_positions_.find(job->id());
+  if(it == task_cache_positions_.end()) {
+    return;
+  }
+  task_cache_memory_ -= job->tasks_memory_size();
+  task_cache_.erase(it->second);
+  task_cache_positions_.erase(job->id());
+}
+
+/* Unload least recently used tasks until the cache fits its size. */
+void Farm::evict_job_tasks() {
+  if(task_cache_.empty()) {
+    return;
+  }
+  /* Most recently used job is always kept, it's about to be used. */
+  list<Job*>::iterator it = task_cache_.end();
+  while(task_cache_memory_ > task_cache_size &&
+        --it != task_cache_.begin()) {
+    Job *job = *it;
+    bool has_active_tasks = false;
+    {
+      thread_scoped_lock job_lock(dispatch_queue_.job_mutex(job));
+      foreach(const Task& task, job->tasks()) {
+        if(task.status() == Task::STATUS_ACTIVE) {
+          has_active_tasks = true;
+          break;
         }
       }
     }
+    if(has_active_tasks) {
+      continue;
+    }
+    VLOG(1) << "Unloading tasks of job " << job->id() << ".";
+    task_cache_memory_ -= job->tasks_memory_size();
+    task_cache_positions_.erase(job->id());
+    it = task_cache_.erase(it);
+    job->unload_tasks();
+  }
+}
+
+/* Write latest state of the modified jobs and tasks to the storage. */
+void Farm::store_pending_updates() {
+  vector<TaskUpdate> tasks;
+  vector<Job*> jobs;
+  size_t num_recorded_updates = 0;
+  foreach(LeaseShard *shard, lease_shards_) {
+    thread_scoped_lock shard_lock(shard->mutex);
+    /* Every task has its updates in one shard only, so there's nothing
+     * to coalesce between the shards.
+     */
+    if(tasks.empty()) {
+      tasks.swap(shard->pending_tasks);
+    } else {
+      tasks.insert(tasks.end(),
+                   shard->pending_tasks.begin(),
+                   shard->pending_tasks.end());
+      shard->pending_tasks.clear();
+    }
+    jobs.insert(jobs.end(),
+                shard->pending_jobs.begin(),
+                shard->pending_jobs.end());
+    shard->pending_jobs.clear();
+    shard->pending_task_indices.clear();
+    num_recorded_updates += shard->num_recorded_updates;
+  }
+  last_store_time_ = current_time();
+  sort(jobs.begin(), jobs.end());
+  jobs.erase(unique(jobs.begin(), jobs.end()), jobs.end());
+  if(!jobs.empty()) {
+    /* Status of the job could be modified by the dispatch, so take a copy
+     * of it with the job's lock held.
+     */
+    vector<JobUpdate> job_updates;
+    job_updates.reserve(jobs.size());
+    foreach(Job *job, jobs) {
+      thread_scoped_lock job_lock(dispatch_queue_.job_mutex(job));
+      job_updates.push_back(JobUpdate(*job));
+    }
+    storage_->update_jobs(job_updates);
+  }
+  if(tasks.size() == 1) {
+    storage_->update_task(tasks[0]);
+  } else if(!tasks.empty()) {
+    storage_->update_tasks(tasks);
+  }
+  num_stored_updates_ += jobs.size() + tasks.size();
+  if(!jobs.empty() || !tasks.empty()) {
+    VLOG(1) << "Stored " << jobs.size() << " job(s) and " << tasks.size()
+            << " task(s), " << num_stored_updates_ << " of "
+            << num_recorded_updates << " recorded changes are written.";
   }
-  VLOG(1) << "Added " << tasks_queue_.size() << " elements to the queue.";
 }
 
 /* Insert new job into the farm. */
 Job *Farm::insert_job(Job::Priority priority,
                       Job::Status status,
-                      string name) {
-  thread_scoped_lock(lock);
-  ++max_job_id_;
-  Job *new_job = new Job(-1,
+                      string name,
+                      string owner,
+                      const vector<Job::TaskDependency>& task_dependencies,
+                      const vector<Job*>& job_dependencies) {
+  if(!Job::valid_task_dependencies(Job::NUM_GENERATED_TASKS,
+                                   task_dependencies)) {
+    LOG(ERROR) << "Invalid task dependencies of the new job " << name
+               << ", dependencies are out of range or have a cycle.";
+    return NULL;
+  }
+  thread_scoped_lock scoped_lock(lock);
+  int job_id = allocate_job_id();
+  int first_task_id = allocate_task_ids(Job::NUM_GENERATED_TASKS);
+  if(job_id == -1 || first_task_id == -1) {
+    LOG(ERROR) << "Failed to reserve IDs for the new job " << name << ".";
+    return NULL;
+  }
+  Job *new_job = new Job(job_id,
                          priority,
                          status,
-                         name);
-  jobs_.push_back(new_job);
-  new_job->generate_tasks(1);
-  storage_->insert_job(new_job);
-  /* TODO(sergey): Find more proper place for this. */
-  {
-    vector<Task*> tasks = new_job->tasks();
-    foreach(Task *task, tasks) {
-      QueueTask queue_task(new_job, task);
-      tasks_queue_.push(queue_task);
+                         name,
+                         owner);
+  add_job(new_job);
+  new_job->generate_tasks(first_task_id);
+  new_job->set_task_dependencies(task_dependencies);
+  int num_unmet_dependencies = 0;
+  foreach(Job *job, job_dependencies) {
+    new_job->add_job_dependency(job->id());
+    if(!Job::is_finished_status(job->status())) {
+      job->add_dependent_job(new_job);
+      ++num_unmet_dependencies;
     }
   }
+  new_job->set_num_unmet_job_dependencies(num_unmet_dependencies);
+  storage_->insert_job(new_job);
+  index_job(new_job);
+  if(new_job->is_running()) {
+    queue_job(new_job);
+  } else {
+    cache_job_tasks(new_job);
+  }
   return new_job;
 }
 
 Task* Farm::dispatch_task() {
-  thread_scoped_lock(lock);
-  if(tasks_queue_.empty()) {
+  vector<Task*> tasks;
+  if(dispatch_tasks(1, &tasks) == 0) {
     return NULL;
   }
-  QueueTask queue_task = tasks_queue_.top();
-  VLOG(1) << "Pop queue task, job id " << queue_task.job()->id()
-          << ", task id " << queue_task.task()->id() << ".";
-  tasks_queue_.pop();
-  Job *job = queue_task.job();
-  Task *task = queue_task.task();
-  task->set_status(Task::STATUS_ACTIVE);
-  storage_->update_task(*task);
-  if(job->status() != Job::STATUS_ACTIVE) {
-    job->set_status(Job::STATUS_ACTIVE);
-    storage_->update_job(*job);
+  return tasks[0];
+}
+
+/* Link restored jobs with the jobs they depend on. */
+void Farm::restore_job_dependencies() {
+  foreach(Job *job, jobs_) {
+    int num_unmet_dependencies = 0;
+    foreach(int depends_on, job->job_dependencies()) {
+      Job *dependency = lookup_job(depends_on);
+      if(dependency == NULL ||
+         Job::is_finished_status(dependency->status())) {
+        continue;
+      }
+      dependency->add_dependent_job(job);
+      ++num_unmet_dependencies;
+    }
+    job->set_num_unmet_job_dependencies(num_unmet_dependencies);
   }
-  return task;
 }
 
-void Farm::idle_handler() {
-  thread_scoped_lock(lock);
-  storage_->flush_caches();
+/* Lease active tasks of restored jobs. */
+void Farm::restore_task_leases() {
+  /* Actual dispatch time is not stored, so runtime of restored tasks
+   * is counted from now.
+   */
+  double restore_time = current_time();
+  double default_expire_time = restore_time + task_lease_time;
+  unordered_map<int, double> lease_expire_times;
+  storage_->retrieve_task_leases(&lease_expire_times);
+  foreach(LeaseShard *shard, lease_shards_) {
+    thread_scoped_lock shard_lock(shard->mutex);
+    shard->task_leases.clear();
+    shard->task_leases_wheel.reset(lease_tick(restore_time));
+    shard->straggler_tasks.clear();
+  }
+  num_straggler_tasks_ = 0;
+  int num_leases = 0;
+  foreach(Job *job, jobs_) {
+    foreach(Task& task, job->tasks()) {
+      if(task.status() != Task::STATUS_ACTIVE) {
+        continue;
+      }
+      /* Tasks dispatched before leases were introduced get a new one. */
+      unordered_map<int, double>::const_iterator it =
+          lease_expire_times.find(task.id());
+      thread_scoped_lock shard_lock(task_lease_shard(task.id()).mutex);
+      lease_task(job,
+                 &task,
+                 restore_time,
+                 it != lease_expire_times.end() ? it->second
+                                                : default_expire_time);
+      ++num_leases;
+    }
+  }
+  VLOG(1) << "Restored " << num_leases << " task lease(s).";
 }
 
-Job* Farm::job_by_id(int id) {
-  /* TODO(sergey): Use binary search. */
-  foreach(Job* job, jobs_) {
-    if(job->id() == id) {
-      return job;
+/* Shard which keeps lease of the given task. */
+Farm::LeaseShard& Farm::task_lease_shard(int task_id) {
+  /* IDs coming from the requests might be negative. */
+  unsigned int run = (unsigned int)task_id / lease_shard_span;
+  return *lease_shards_[run % lease_shards_.size()];
+}
+
+/* Lease task to the worker. */
+void Farm::lease_task(Job *job,
+                      Task *task,
+                      double dispatch_time,
+                      double expire_time) {
+  LeaseShard& shard = task_lease_shard(task->id());
+  unordered_map<int, TaskLease>::iterator it =
+      shard.task_leases.find(task->id());
+  if(it != shard.task_leases.end()) {
+    shard.task_leases_wheel.cancel(it->second.handle);
+  }
+  TaskLease lease;
+  lease.job = job;
+  lease.task = task;
+  lease.handle = shard.task_leases_wheel.schedule(task->id(),
+                                                  lease_tick(expire_time) + 1);
+  lease.expire_time = expire_time;
+  lease.dispatch_time = dispatch_time;
+  lease.duplicate_time = 0.0;
+  lease.is_straggler = false;
+  shard.task_leases[task->id()] = lease;
+}
+
+/* Collect straggler tasks for speculative dispatch. */
+void Farm::find_straggler_tasks() {
+  double now = current_time();
+  if(!speculative_dispatch ||
+     now - last_straggler_check_time_ < straggler_check_interval) {
+    return;
+  }
+  last_straggler_check_time_ = now;
+  foreach(LeaseShard *shard, lease_shards_) {
+    thread_scoped_lock shard_lock(shard->mutex);
+    for(unordered_map<int, TaskLease>::iterator it =
+            shard->task_leases.begin();
+        it != shard->task_leases.end();
+        ++it) {
+      TaskLease& lease = it->second;
+      if(lease.is_straggler || lease.duplicate_time != 0.0) {
+        continue;
+      }
+      const running_median<double>& runtimes = lease.job->task_runtimes();
+      if(runtimes.size() < straggler_min_samples ||
+         now - lease.dispatch_time <
+             straggler_runtime_factor * runtimes.median()) {
+        continue;
+      }
+      /* Only duplicate tasks of jobs which have nothing else to dispatch. */
+      thread_scoped_lock job_lock(dispatch_queue_.job_mutex(lease.job));
+      if(lease.job->queue_handle() != -1) {
+        continue;
+      }
+      job_lock.unlock();
+      VLOG(1) << "Task " << it->first << " of job " << lease.job->id()
+              << " is a straggler.";
+      lease.is_straggler = true;
+      shard->straggler_tasks.push_back(it->first);
+      ++num_straggler_tasks_;
     }
   }
-  return NULL;
 }
 
-/* Priority queue helpers. */
+/* Dispatch duplicates of straggler tasks. */
+int Farm::dispatch_straggler_tasks(int num_tasks, vector<Task*> *tasks) {
+  int num_dispatched = 0;
+  double now = current_time();
+  foreach(LeaseShard *shard, lease_shards_) {
+    if(num_dispatched == num_tasks) {
+      break;
+    }
+    thread_scoped_lock shard_lock(shard->mutex);
+    while(num_dispatched < num_tasks && !shard->straggler_tasks.empty()) {
+      int task_id = shard->straggler_tasks.front();
+      shard->straggler_tasks.pop_front();
+      --num_straggler_tasks_;
+      unordered_map<int, TaskLease>::iterator it =
+          shard->task_leases.find(task_id);
+      /* Task might have been completed or expired since it was queued. */
+      if(it == shard->task_leases.end() || !it->second.is_straggler) {
+        continue;
+      }
+      TaskLease& lease = it->second;
+      VLOG(1) << "Dispatching duplicate of task " << task_id << " of job "
+              << lease.job->id() << ".";
+      lease.is_straggler = false;
+      lease.duplicate_time = now;
+      /* Both copies share the lease, it's extended for the new copy. */
+      double expire_time = now + task_lease_time;
+      lease.expire_time = expire_time;
+      shard->task_leases_wheel.reschedule(lease.handle,
+                                          lease_tick(expire_time) + 1);
+      add_pending_task_locked(*shard, *lease.task, expire_time);
+      tasks->push_back(lease.task);
+      ++num_speculative_dispatches_;
+      ++num_dispatched;
+    }
+  }
+  return num_dispatched;
+}
 
-Farm::QueueTask::QueueTask(Job *job, Task *task)
-    : job_(job),
-      task_(task) {
+/* Return tasks with expired leases to the dispatch queue. */
+void Farm::expire_task_leases() {
+  timing_wheel<int>::tick_type tick = lease_tick(current_time());
+  int num_requeued = 0;
+  foreach(LeaseShard *shard, lease_shards_) {
+    /* Shard lock is held while tasks are requeued, so their storage
+     * update is queued before the one done by their next dispatch.
+     */
+    thread_scoped_lock shard_lock(shard->mutex);
+    vector<int> expired_task_ids;
+    shard->task_leases_wheel.advance(tick, &expired_task_ids);
+    foreach(int task_id, expired_task_ids) {
+      unordered_map<int, TaskLease>::iterator it =
+          shard->task_leases.find(task_id);
+      TaskLease lease = it->second;
+      /* Erase by key, erasing by iterator looks for the next element
+       * which is slow for sparse tables.
+       */
+      shard->task_leases.erase(task_id);
+      if(lease.task->status() != Task::STATUS_ACTIVE) {
+        continue;
+      }
+      VLOG(1) << "Lease of task " << task_id << " of job "
+              << lease.job->id() << " expired, returning it to the queue.";
+      dispatch_queue_.requeue_task(lease.job, lease.task);
+      add_pending_task_locked(*shard,
+                              Task(task_id, Task::STATUS_WAITING),
+                              0.0);
+      add_pending_job_locked(*shard, lease.job);
+      ++num_requeued;
+    }
+  }
+  if(num_requeued == 0) {
+    return;
+  }
+  LOG(WARNING) << "Leases of " << num_requeued << " task(s) expired, "
+               << "returned them to the dispatch queue.";
+  if(tasks_available_cb) {
+    tasks_available_cb();
+  }
 }
 
-bool Farm::QueueTaskPriorityCompare::operator() (
-    const Farm::QueueTask& left,
-    const Farm::QueueTask& right) {
-  if(left.job()->priority() < right.job()->priority()) {
+/* Extend lease of the active task. */
+bool Farm::extend_task_lease(int task_id) {
+  LeaseShard& shard = task_lease_shard(task_id);
+  thread_scoped_lock shard_lock(shard.mutex);
+  unordered_map<int, TaskLease>::iterator it = shard.task_leases.find(task_id);
+  if(it == shard.task_leases.end()) {
     return false;
   }
-  if(left.job()->id() < right.job()->id()) {
-    return false;
+  TaskLease& lease = it->second;
+  double expire_time = current_time() + task_lease_time;
+  lease.expire_time = expire_time;
+  shard.task_leases_wheel.reschedule(lease.handle,
+                                     lease_tick(expire_time) + 1);
+  add_pending_task_locked(shard, *lease.task, expire_time);
+  return true;
+}
+
+/* Mark active task as completed. */
+bool Farm::complete_task(int task_id) {
+  TaskReport report;
+  report.task_id = task_id;
+  report.status = Task::STATUS_COMPLETED;
+  report.runtime = -1.0;
+  return report_tasks(vector<TaskReport>(1, report)) == 1;
+}
+
+/* Apply results of many tasks at once. */
+int Farm::report_tasks(const vector<TaskReport>& reports,
+                       vector<int> *rejected_task_ids) {
+  thread_scoped_lock scoped_lock(lock);
+  double now = current_time();
+  vector<Job*> finished_jobs;
+  bool tasks_available = false;
+  int num_reported = 0;
+  foreach(const TaskReport& report, reports) {
+    int task_id = report.task_id;
+    LeaseShard& shard = task_lease_shard(task_id);
+    /* Shard lock is held until the storage update of the task is queued,
+     * so failed task which is dispatched again gets its update after it.
+     */
+    thread_scoped_lock shard_lock(shard.mutex);
+    unordered_map<int, TaskLease>::iterator it =
+        shard.task_leases.find(task_id);
+    if(it == shard.task_leases.end()) {
+      if(rejected_task_ids != NULL) {
+        rejected_task_ids->push_back(task_id);
+      }
+      continue;
+    }
+    TaskLease lease = it->second;
+    shard.task_leases_wheel.cancel(lease.handle);
+    shard.task_leases.erase(task_id);
+    bool job_finished;
+    if(report.status != Task::STATUS_COMPLETED) {
+      if(dispatch_queue_.fail_task(lease.job,
+                                   lease.task,
+                                   max_task_retries,
+                                   &job_finished)) {
+        tasks_available = true;
+      }
+      LOG(WARNING) << "Task " << task_id << " of job "
+                   << lease.job->id() << " failed "
+                   << lease.task->num_failures() << " time(s)"
+                   << (lease.task->status() == Task::STATUS_FAILED
+                           ? ", giving up."
+                           : ", retrying.");
+    } else {
+      VLOG(1) << "Completed task " << task_id << " of job "
+              << lease.job->id() << ".";
+      /* Version of the job is bumped by dispatch under its lock. */
+      thread_scoped_lock job_lock(dispatch_queue_.job_mutex(lease.job));
+      if(lease.duplicate_time == 0.0) {
+        lease.job->add_task_runtime(report.runtime >= 0.0
+                                        ? report.runtime
+                                        : now - lease.dispatch_time);
+      } else if(report.runtime >= 0.0) {
+        lease.job->add_task_runtime(report.runtime);
+        if(now - report.runtime >=
+           0.5 * (lease.dispatch_time + lease.duplicate_time)) {
+          ++num_speculative_wins_;
+        }
+      } else if(now - lease.duplicate_time >=
+                lease.job->task_runtimes().median()) {
+        ++num_speculative_wins_;
+      }
+      job_lock.unlock();
+      if(dispatch_queue_.complete_task(lease.job,
+                                       lease.task,
+                                       &job_finished)) {
+        tasks_available = true;
+      }
+    }
+    add_pending_task_locked(shard, *lease.task, 0.0);
+    /* Task counts are stored with the job, finished job gets its status
+     * stored this way as well.
+     */
+    add_pending_job_locked(shard, lease.job);
+    if(job_finished) {
+      finished_jobs.push_back(lease.job);
+    }
+    ++num_reported;
   }
-  if(left.job()->priority() == right.job()->priority() &&
-     left.job()->id() == right.job()->id() &&
-     left.task()->id() < right.task()->id()) {
+  foreach(Job *finished_job, finished_jobs) {
+    VLOG(1) << "Finished job " << finished_job->id() << " with status "
+            << finished_job->status() << ".";
+    finished_job->set_finish_time(now);
+    /* Statuses of the tasks don't change anymore, so usually they're all
+     * in one or two runs.
+     */
+    if(!finished_job->compact_tasks()) {
+      cache_job_tasks(finished_job);
+    }
+    foreach(Job *job, finished_job->dependent_jobs()) {
+      if(dispatch_queue_.complete_job_dependency(job)) {
+        tasks_available = true;
+      }
+    }
+  }
+  if(tasks_available && tasks_available_cb) {
+    tasks_available_cb();
+  }
+  return num_reported;
+}
+
+/* Dispatch up to num_tasks tasks at once. */
+int Farm::dispatch_tasks(int num_tasks, vector<Task*> *tasks) {
+  size_t first_task = tasks->size();
+  vector<Job*> task_jobs;
+  for(int i = 0; i < num_tasks; ++i) {
+    Job *job;
+    bool job_activated;
+    Task *task = dispatch_queue_.pop_task(&job, &job_activated);
+    if(task == NULL) {
+      break;
+    }
+    VLOG(1) << "Pop queue task, job id " << job->id()
+            << ", task id " << task->id() << ".";
+    tasks->push_back(task);
+    task_jobs.push_back(job);
+  }
+  int num_dispatched = tasks->size() - first_task;
+  if(num_dispatched != 0) {
+    double dispatch_time = current_time();
+    double expire_time = dispatch_time + task_lease_time;
+    int i = 0;
+    while(i < num_dispatched) {
+      /* Runs of tasks from the same lease shard are leased under a
+       * single lock.
+       */
+      LeaseShard& shard = task_lease_shard((*tasks)[first_task + i]->id());
+      thread_scoped_lock shard_lock(shard.mutex);
+      do {
+        Task *task = (*tasks)[first_task + i];
+        lease_task(task_jobs[i], task, dispatch_time, expire_time);
+        add_pending_task_locked(shard, *task, expire_time);
+        /* Status of the job and its task counts are stored with it. */
+        add_pending_job_locked(shard, task_jobs[i]);
+        ++i;
+      } while(i < num_dispatched &&
+              &task_lease_shard((*tasks)[first_task + i]->id()) == &shard);
+    }
+    for(int i = 0; i < num_dispatched; ++i) {
+      Job *job = task_jobs[i];
+      if(i != 0 && job == task_jobs[i - 1]) {
+        continue;
+      }
+      /* Start time is read by the snapshot under the job's lock. */
+      thread_scoped_lock job_lock(dispatch_queue_.job_mutex(job));
+      if(job->start_time() == 0.0) {
+        job->set_start_time(dispatch_time);
+      }
+    }
+  }
+  if(num_dispatched < num_tasks &&
+     speculative_dispatch &&
+     num_straggler_tasks_ != 0) {
+    /* Nothing else to dispatch, give duplicates of the stragglers. */
+    num_dispatched += dispatch_straggler_tasks(num_tasks - num_dispatched,
+                                               tasks);
+  }
+  return num_dispatched;
+}
+
+/* Change priority of the job. */
+bool Farm::set_job_priority(Job *job, Job::Priority priority) {
+  thread_scoped_lock scoped_lock(lock);
+  if(job->priority() == priority) {
+    return true;
+  }
+  VLOG(1) << "Changing priority of job " << job->id()
+          << " from " << job->priority() << " to " << (int)priority << ".";
+  dispatch_queue_.set_job_priority(job, priority);
+  add_pending_job(job);
+  return true;
+}
+
+/* Change status of the job. */
+bool Farm::set_job_status(Job *job, Job::Status status) {
+  thread_scoped_lock scoped_lock(lock);
+  set_job_status_locked(job, status);
+  return true;
+}
+
+/* Change status of the job, farm lock is to be held. */
+void Farm::set_job_status_locked(Job *job, Job::Status status) {
+  VLOG(1) << "Changing status of job " << job->id()
+          << " to " << status << ".";
+  if(status == Job::STATUS_WAITING || status == Job::STATUS_ACTIVE) {
+    load_job_tasks(job);
+    uncache_job_tasks(job);
+  }
+  if(dispatch_queue_.set_job_status(job, status) && tasks_available_cb) {
+    tasks_available_cb();
+  }
+  if(job->tasks_resident() && !job->is_running()) {
+    cache_job_tasks(job);
+  }
+  add_pending_job(job);
+}
+
+/* Pause the job if it's still running. */
+bool Farm::pause_job(Job *job) {
+  thread_scoped_lock scoped_lock(lock);
+  /* Running jobs only become completed under the farm lock. */
+  if(!job->is_running()) {
     return false;
   }
+  set_job_status_locked(job, Job::STATUS_PAUSED);
   return true;
 }
 
+/* Enable or disable fair share between job owners. */
+void Farm::set_fair_share(bool fair_share) {
+  dispatch_queue_.set_fair_share(fair_share);
+}
+
+/* Set share weight of the owner. */
+void Farm::set_owner_weight(const string& owner, double weight) {
+  dispatch_queue_.set_owner_weight(owner, weight);
+}
+
+void Farm::idle_handler() {
+  thread_scoped_lock scoped_lock(lock);
+  expire_task_leases();
+  find_straggler_tasks();
+  if(current_time() - last_store_time_ >= store_interval) {
+    store_pending_updates();
+  }
+  storage_->flush_caches();
+  if(current_time() - last_snapshot_time_ >= snapshot_interval) {
+    publish_snapshot(true);
+  }
+}
+
+shared_ptr<const FarmSnapshot> Farm::snapshot() const {
+  return atomic_load(&snapshot_);
+}
+
+void Farm::publish_snapshot(bool reuse_jobs) {
+  shared_ptr<const FarmSnapshot> previous = atomic_load(&snapshot_);
+  shared_ptr<FarmSnapshot> snapshot = make_shared<FarmSnapshot>();
+  snapshot->time = current_time();
+  last_snapshot_time_ = snapshot->time;
+  if(!reuse_jobs) {
+    previous = make_shared<FarmSnapshot>();
+  }
+  /* Jobs are only appended to the list and their IDs are increasing, so
+   * the list is sorted by ID and unchanged jobs keep their position.
+   */
+  bool changed = !reuse_jobs || jobs_.size() != previous->jobs.size();
+  snapshot->jobs.reserve(jobs_.size());
+  for(int i = 0; i < jobs_.size(); ++i) {
+    Job *job = jobs_[i];
+    /* Counters of the job are modified by dispatch under its shard lock. */
+    thread_scoped_lock job_lock(dispatch_queue_.job_mutex(job));
+    if(i < previous->jobs.size() &&
+       previous->jobs[i]->version == job->version()) {
+      snapshot->jobs.push_back(previous->jobs[i]);
+      continue;
+    }
+    snapshot->jobs.push_back(make_shared<JobSnapshot>(*job));
+    changed = true;
+  }
+  if(!changed) {
+    return;
+  }
+  snapshot->version = atomic_load(&snapshot_)->version + 1;
+  atomic_store(&snapshot_, shared_ptr<const FarmSnapshot>(snapshot));
+}
+
+Job* Farm::job_by_id(int id) {
+  thread_scoped_lock scoped_lock(lock);
+  return lookup_job(id);
+}
+
+void Farm::jobs_with_status(Job::Status status, vector<Job*> *jobs) {
+  thread_scoped_lock scoped_lock(lock);
+  jobs->clear();
+  int slot = 0;
+  foreach(const Job::State& state, job_states_) {
+    if(state.status.load(memory_order_relaxed) == status) {
+      jobs->push_back(jobs_[slot]);
+    }
+    ++slot;
+  }
+}
+
+Task *Farm::task_by_id(int id, Job **r_job) {
+  thread_scoped_lock scoped_lock(lock);
+  return lookup_task(id, r_job);
+}
+
 }  /* namespace Farm */
@@ -21,78 +21,520 @@
 #ifndef MODEL_FARM_
 #define MODEL_FARM_
 
+#include "model/model_dispatch_queue.h"
 #include "model/model_job.h"
+#include "model/model_snapshot.h"
+#include "model/model_task.h"
 
-#include "util/util_priority_queue.h"
+#include "util/util_atomic.h"
+#include "util/util_deque.h"
+#include "util/util_function.h"
+#include "util/util_list.h"
+#include "util/util_map.h"
+#include "util/util_memory.h"
 #include "util/util_thread.h"
+#include "util/util_timing_wheel.h"
 #include "util/util_vector.h"
 
 namespace Farm {
 
 class Storage;
-class Task;
 
 class Farm {
  public:
-  explicit Farm(Storage *storage);
+  /* Function which is being called when new tasks might have become
+   * available for dispatch.
+   *
+   * It is called with the farm lock held, so it is not allowed to call
+   * any of the farm's methods.
+   */
+  function<void(void)> tasks_available_cb;
+
+  /* Function which returns current time in seconds, used for leases and
+   * runtimes of tasks. Allows the farm to run in virtual time, is to be
+   * set before the farm is restored. Wall clock is used if not set.
+   */
+  function<double(void)> time_cb;
+
+  /* Time in seconds for which dispatched task is leased to the worker.
+   *
+   * Worker is to extend the lease while it's processing the task, tasks
+   * with expired leases are returned to the dispatch queue.
+   */
+  double task_lease_time;
+
+  /* Number of times failed task is dispatched again before it's given up
+   * on. Job with tasks which were given up on is finished as failed.
+   */
+  int max_task_retries;
+
+  /* Dispatch duplicates of the straggler tasks of jobs which have no more
+   * waiting tasks when there's nothing else to dispatch. Whichever copy
+   * completes first wins, the other one gets its lease cancelled.
+   */
+  bool speculative_dispatch;
+
+  /* Active task is a straggler when it runs this many times longer than
+   * the median runtime of the completed tasks of its job.
+   */
+  double straggler_runtime_factor;
+
+  /* Minimal number of the completed tasks of the job for its median
+   * runtime to be used for stragglers detection.
+   */
+  int straggler_min_samples;
+
+  /* Interval in seconds between checks for stragglers. */
+  double straggler_check_interval;
+
+  /* Memory in bytes which tasks of the jobs which are not running are
+   * allowed to use. Least recently used ones are unloaded when it's
+   * exceeded and loaded from the storage again when needed.
+   *
+   * Running jobs always keep their tasks in memory.
+   */
+  size_t task_cache_size;
+
+  /* Interval in seconds between publishing snapshots of the jobs state,
+   * which is the staleness of the state seen by the snapshot readers.
+   */
+  double snapshot_interval;
+
+  /* Interval in seconds between writes of the modified jobs and tasks to
+   * the storage from the idle handler. Only the latest state of the job or
+   * task modified several times within the interval is written.
+   */
+  double store_interval;
+
+  /* Number of threads used to build jobs from the tasks read by restore,
+   * 0 means one thread per hardware thread.
+   */
+  int num_restore_threads;
+
+  /* Result of the task reported by the worker. */
+  struct TaskReport {
+    int task_id;
+    /* Either STATUS_COMPLETED or STATUS_FAILED. */
+    Task::Status status;
+    /* Runtime of the task measured by the worker in seconds,
+     * negative if unknown.
+     */
+    double runtime;
+  };
+
+  /* Farm with multiple dispatch shards allows tasks to be dispatched
+   * from multiple threads at once without blocking each other.
+   */
+  explicit Farm(Storage *storage, int num_dispatch_shards = 1);
 
   ~Farm();
 
   /* Real all farm data from the storage. */
   bool restore();
 
+  /* Write image of the farm to the file, to be used by restore_image()
+   * on the next start instead of reading the storage.
+   *
+   * Image only matches the storage as long as nothing is changed after
+   * it's written, so it's meant to be written on clean shutdown.
+   */
+  bool store_image(const string& filename);
+
+  /* Restore farm from the image written by store_image().
+   *
+   * The file is mapped into memory and tasks are copied from it in bulk.
+   * Returns false if the image is missing, damaged or was written by an
+   * incompatible version, farm is not changed in that case.
+   */
+  bool restore_image(const string& filename);
+
   /* Store all the pending data to the storage. */
   bool store();
 
-  /* Insert new job into the farm. */
+  /* Insert new job into the farm.
+   *
+   * Tasks of the job are not dispatched until their dependencies and all
+   * the jobs from job_dependencies are completed. Returns NULL if task
+   * dependencies refer to missing tasks or have a cycle, or if IDs for
+   * the job couldn't be reserved in the storage.
+   */
   Job *insert_job(Job::Priority priority,
                   Job::Status status,
-                  string name);
+                  string name,
+                  string owner,
+                  const vector<Job::TaskDependency>& task_dependencies =
+                      vector<Job::TaskDependency>(),
+                  const vector<Job*>& job_dependencies = vector<Job*>());
 
-  /* Dispatch new task to worker/manager. */
+  /* Dispatch new task to worker/manager.
+   *
+   * Safe to be called from multiple threads. Dispatch doesn't take the
+   * farm lock, storage is updated later from the idle handler.
+   */
   Task* dispatch_task();
 
+  /* Dispatch up to num_tasks tasks at once.
+   *
+   * Tasks are appended to the given vector, they are queued for the storage
+   * update as one batch. Returns number of dispatched tasks.
+   */
+  int dispatch_tasks(int num_tasks, vector<Task*> *tasks);
+
+  /* Extend lease of the active task by task_lease_time.
+   *
+   * Returns false if the task is not leased, for example its lease has
+   * already expired and the task was given back to the queue.
+   */
+  bool extend_task_lease(int task_id);
+
+  /* Mark active task as completed, releasing its lease.
+   *
+   * Tasks and jobs which were waiting for it become available for
+   * dispatch. Returns false if the task is not leased.
+   */
+  bool complete_task(int task_id);
+
+  /* Apply results of many tasks at once.
+   *
+   * All reports are applied in a single lock section and the storage gets
+   * them as one batch. Failed tasks are not dispatched again. IDs of tasks
+   * which are not leased are appended to rejected_task_ids if it's not
+   * NULL. Returns number of applied reports.
+   */
+  int report_tasks(const vector<TaskReport>& reports,
+                   vector<int> *rejected_task_ids = NULL);
+
+  /* Change priority of the job.
+   *
+   * Only this job is re-positioned in the dispatch queue, so the cost
+   * is O(log n) where n is number of jobs with waiting tasks.
+   */
+  bool set_job_priority(Job *job, Job::Priority priority);
+
+  /* Change status of the job.
+   *
+   * Job is added to or removed from the dispatch queue when it starts
+   * or stops running.
+   */
+  bool set_job_status(Job *job, Job::Status status);
+
+  /* Pause the job, returns false if the job is not running.
+   *
+   * Completed and cancelled jobs keep their status, so their dependents
+   * are not blocked again.
+   */
+  bool pause_job(Job *job);
+
+  /* Share dispatched tasks between job owners proportionally to their
+   * weights, whatever priorities their jobs have. Priority then only
+   * orders jobs of the same owner.
+   */
+  void set_fair_share(bool fair_share);
+
+  /* Set share weight of the owner, default weight is 1. */
+  void set_owner_weight(const string& owner, double weight);
+
   /* Does all the maintenance work while http server is idling. */
   void idle_handler();
 
+  /* Number of dispatched duplicates of the straggler tasks. */
+  int num_speculative_dispatches() const {
+    return num_speculative_dispatches_;
+  }
+
+  /* Number of straggler tasks which were completed by their duplicate.
+   *
+   * When the worker reports runtime of the task, the duplicate wins if the
+   * completed copy was started after the middle point between the two
+   * dispatches. Otherwise the duplicate is considered to be the winner when
+   * the task is completed no sooner than the job's median runtime after the
+   * duplicate was dispatched.
+   */
+  int num_speculative_wins() const { return num_speculative_wins_; }
+
+  /* Number of changes of jobs and tasks which are to be written to the
+   * storage.
+   */
+  size_t num_recorded_updates();
+
+  /* Number of job and task states written to the storage, lower than the
+   * number of recorded changes when changes of the same job or task are
+   * coalesced.
+   */
+  size_t num_stored_updates() const { return num_stored_updates_; }
+
+  /* Current time in seconds, given by time_cb if it's set. */
+  double current_time();
+
+  /* Latest published snapshot of the jobs state.
+   *
+   * Doesn't take the farm lock, so it's never blocked by dispatch or
+   * storage access. Snapshot stays valid for as long as the caller keeps
+   * the reference, even if a newer one is published meanwhile.
+   */
+  shared_ptr<const FarmSnapshot> snapshot() const;
+
   /* Getters */
   vector<Job*>& jobs() { return jobs_; }
+
+  /* Get job by its ID, NULL if there's no such job. */
   Job* job_by_id(int id);
+
+  /* Get all jobs with the given status, in the order of jobs(). */
+  void jobs_with_status(Job::Status status, vector<Job*> *jobs);
+
+  /* Get task by its ID, NULL if there's no such task.
+   *
+   * Job of the task is returned in r_job if it's not NULL.
+   */
+  Task *task_by_id(int id, Job **r_job = NULL);
  protected:
-  class QueueTask {
-   public:
-    QueueTask(Job *job, Task *task);
-    bool operator <(const QueueTask& other) const;
-    Job *job() const { return job_; }
-    Task *task() const { return task_; }
-   protected:
-    Job *job_;
-    Task *task_;
-  };
-  class QueueTaskPriorityCompare {
-    public:
-      bool operator() (const QueueTask& left, const QueueTask& righr);
-  };
 
   /* Rebuild priority queue of tasks. */
   void rebuild_priority_queue();
 
+  /* Make restored jobs the jobs of the farm, replacing the current ones,
+   * and restore all the indices, leases and the dispatch queue.
+   */
+  void restore_jobs(const vector<Job*>& jobs);
+
+  /* Add job to the dispatch queue, notifying about new tasks. */
+  void queue_job(Job *job);
+
+  /* Add jobs to the dispatch queue at once, notifying about new tasks. */
+  void queue_jobs(const vector<Job*>& jobs);
+
+  /* Change status of the job, farm lock is to be held. */
+  void set_job_status_locked(Job *job, Job::Status status);
+
+  /* Add job to the jobs list, keeping its state in the states table. */
+  void add_job(Job *job);
+
+  /* Get all running jobs, farm lock is to be held. */
+  void find_running_jobs(vector<Job*> *jobs);
+
+  /* Add job and its tasks to the ID indices. */
+  void index_job(Job *job);
+
+  /* Take ID for the new job from the reserved block, reserving new block
+   * in the storage when it's used up. Returns -1 on failure.
+   */
+  int allocate_job_id();
+
+  /* Take consecutive IDs for tasks of the new job, same as above. */
+  int allocate_task_ids(int num_tasks);
+
+  /* Find job of the task and index of the task in the job's task table,
+   * tasks of the job might be not loaded. Returns false if the task is
+   * not in the index.
+   */
+  bool find_task_range(int id, Job **r_job, int *r_index);
+
+  /* Lookup in the ID indices, farm lock is to be held. */
+  Job *lookup_job(int id);
+  Task *lookup_task(int id, Job **r_job);
+
+  /* Mark job as modified, so it's written by the next store. */
+  void add_pending_job(Job *job);
+
+  /* Same as above, recorded in the given shard whose lock is to be held. */
+  struct LeaseShard;
+  void add_pending_job_locked(LeaseShard& shard, Job *job);
+
+  /* Record the task state to be written by the next store, replacing the
+   * state recorded earlier. Lock of the task's shard is to be held.
+   */
+  void add_pending_task_locked(LeaseShard& shard,
+                               const Task& task,
+                               double lease_expire_time);
+
+  /* Make sure tasks of the job are in memory, loading them from the
+   * storage if needed. Farm lock is to be held.
+   */
+  void load_job_tasks(Job *job);
+
+  /* Put tasks of the job which is not running to the tasks cache, or
+   * mark them as recently used if they're already there.
+   */
+  void cache_job_tasks(Job *job);
+
+  /* Remove tasks of the job from the cache, they're kept in memory. */
+  void uncache_job_tasks(Job *job);
+
+  /* Unload least recently used tasks until the cache fits its size.
+   *
+   * Jobs with active tasks are kept, since their leases point to them.
+   */
+  void evict_job_tasks();
+
+  /* Write latest state of the modified jobs and tasks to the storage,
+   * merging the updates recorded in all the shards.
+   */
+  void store_pending_updates();
+
+  /* Copy state of the jobs and make it visible to the snapshot readers.
+   * Farm lock is to be held.
+   *
+   * With reuse_jobs jobs which didn't change since the last publish share
+   * their snapshot with it, and nothing is published if none of the jobs
+   * changed. It's to be false once the jobs are replaced by restore.
+   */
+  void publish_snapshot(bool reuse_jobs);
+
+  /* Link restored jobs with the jobs they depend on. */
+  void restore_job_dependencies();
+
+  /* Lease active tasks of restored jobs, keeping their stored expiration
+   * time if there's one.
+   */
+  void restore_task_leases();
+
+  /* Return tasks with expired leases to the dispatch queue. */
+  void expire_task_leases();
+
+  /* Shard which keeps lease and pending update of the given task. */
+  LeaseShard& task_lease_shard(int task_id);
+
+  /* Lease task to the worker, replacing existing lease of the task.
+   *
+   * Lock of the task's lease shard is to be held.
+   */
+  void lease_task(Job *job,
+                  Task *task,
+                  double dispatch_time,
+                  double expire_time);
+
+  /* Collect straggler tasks for speculative dispatch. */
+  void find_straggler_tasks();
+
+  /* Dispatch duplicates of up to num_tasks straggler tasks.
+   *
+   * Returns number of dispatched tasks.
+   */
+  int dispatch_straggler_tasks(int num_tasks, vector<Task*> *tasks);
+
   /* Descriptor used to communicate with the storage. */
   Storage *storage_;
   /* Jobs registered in the farm. */
   vector<Job*> jobs_;
-  /* Max job ID used for indexing.
+  /* States of the jobs, in the same order as jobs_.
+   *
+   * Scans over all the jobs look here first and only touch jobs they're
+   * interested in. Deque keeps the states in place when it grows, so the
+   * jobs can point to them.
+   */
+  deque<Job::State> job_states_;
+  /* Jobs indexed by their ID, NULL for unused IDs.
+   *
+   * IDs are given from the blocks reserved in the storage in increasing
+   * order, so dense tables are used instead of hash maps.
+   */
+  vector<Job*> jobs_by_id_;
+  /* Run of tasks with consecutive IDs in the job's task table. */
+  struct TaskRange {
+    int job_id;
+    int first_index;
+    int num_tasks;
+  };
+  /* Ranges of tasks of the indexed jobs, by ID of the first task of the
+   * range.
+   *
+   * Tasks of a job are given consecutive IDs, so there's a single range
+   * per job and the index doesn't depend on how far apart IDs of the
+   * indexed jobs are.
+   */
+  map<int, TaskRange> task_ranges_;
+  /* Blocks of IDs reserved in the storage, IDs from next up to end are
+   * free to be given to the new jobs and tasks.
    *
    * This way we're getting rid of need of AUTOINCREMENT fields
    * which are slow in certain database servers and which might
-   * not exist in other storage types.
+   * not exist in other storage types. IDs are also known before the
+   * storage is touched. IDs left in the blocks on shutdown are never
+   * used.
    */
-  int max_job_id_;
+  int next_job_id_;
+  int job_ids_end_;
+  int next_task_id_;
+  int task_ids_end_;
   /* Queue of the tasks, used for faster dispatching. */
-  priority_queue<QueueTask,
-                 vector<QueueTask>,
-                 QueueTaskPriorityCompare> tasks_queue_;
-  /* Mutex lock used for threading critical operations. */
+  DispatchQueue dispatch_queue_;
+  /* Time of the last store of the pending updates. */
+  double last_store_time_;
+  /* Number of job and task states written to the storage. */
+  atomic<size_t> num_stored_updates_;
+  /* Lease of the active task. */
+  struct TaskLease {
+    Job *job;
+    Task *task;
+    /* Handle of the lease in the leases wheel. */
+    timing_wheel<int>::handle_type handle;
+    /* Time at which the lease runs out unless it's extended. */
+    double expire_time;
+    /* Time at which the task was dispatched. */
+    double dispatch_time;
+    /* Time at which the duplicate of the task was dispatched,
+     * 0 if the task was not duplicated.
+     */
+    double duplicate_time;
+    /* Task is queued for speculative dispatch. */
+    bool is_straggler;
+  };
+  /* Leases and pending storage updates of the tasks which fall into the
+   * shard.
+   *
+   * Tasks are distributed over as many shards as there're dispatch
+   * shards by runs of their IDs, so tasks dispatched from different
+   * threads are leased and recorded without blocking each other. Idle
+   * handler merges updates of all the shards into one store.
+   */
+  struct LeaseShard {
+    /* Lock guarding the shard. */
+    thread_mutex mutex;
+    /* Leases of the active tasks, indexed by task ID. */
+    unordered_map<int, TaskLease> task_leases;
+    /* Expiration times of the leases, storing task IDs. */
+    timing_wheel<int> task_leases_wheel;
+    /* IDs of the straggler tasks to be duplicated. */
+    deque<int> straggler_tasks;
+    /* Tasks and jobs modified since the last store which are to be
+     * written to the storage. Tasks are stored by value, so their state
+     * is captured at the moment of the change, every task is stored once
+     * with its latest state. Jobs could be listed multiple times, also
+     * in different shards.
+     */
+    vector<TaskUpdate> pending_tasks;
+    vector<Job*> pending_jobs;
+    /* Indices in the pending tasks, indexed by task ID. */
+    unordered_map<int, int> pending_task_indices;
+    /* Number of changes recorded in the shard. */
+    size_t num_recorded_updates;
+  };
+  vector<LeaseShard*> lease_shards_;
+  /* Number of straggler tasks queued in all the shards, allows dispatch
+   * which found no waiting tasks to skip the shards.
+   */
+  atomic<int> num_straggler_tasks_;
+  /* Time of the last check for stragglers. */
+  double last_straggler_check_time_;
+  /* Statistics of the speculative dispatch. */
+  atomic<int> num_speculative_dispatches_;
+  atomic<int> num_speculative_wins_;
+  /* Jobs with tasks in the cache, most recently used first. */
+  list<Job*> task_cache_;
+  /* Position of the jobs in the cache, indexed by job ID. */
+  unordered_map<int, list<Job*>::iterator> task_cache_positions_;
+  /* Memory used by tasks in the cache, in bytes. */
+  size_t task_cache_memory_;
+  /* Latest published snapshot, only accessed atomically. */
+  shared_ptr<const FarmSnapshot> snapshot_;
+  /* Time of the last snapshot publish. */
+  double last_snapshot_time_;
+  /* Mutex lock used for threading critical operations.
+   *
+   * Serializes all modifications of the jobs list and access to the
+   * storage. Dispatch doesn't use this lock.
+   */
   thread_mutex lock;
 };
 
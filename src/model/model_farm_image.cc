@@ -0,0 +1,363 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "model/model_farm_image.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "model/model_farm.h"
+#include "util/util_algorithm.h"
+#include "util/util_foreach.h"
+#include "util/util_logging.h"
+#include "util/util_time.h"
+
+namespace Farm {
+
+namespace {
+
+/* Round offset up to the alignment of the image sections. */
+uint64_t image_align(uint64_t offset) {
+  return (offset + 15) & ~(uint64_t)15;
+}
+
+/* Writer of the image file which keeps track of the offset and of the
+ * checksum of the written data.
+ */
+class ImageWriter {
+ public:
+  /* Checksum is calculated from the given offset on. */
+  ImageWriter(FILE *file, uint64_t offset)
+      : file_(file),
+        offset_(offset),
+        checksum_(0),
+        ok_(true) {
+  }
+
+  /* Size is to be multiple of 8 bytes, see farm_image_checksum(). */
+  void write(const void *data, size_t size) {
+    if(size == 0) {
+      return;
+    }
+    ok_ &= fwrite(data, 1, size, file_) == size;
+    checksum_ = farm_image_checksum(checksum_, data, size);
+    offset_ += size;
+  }
+
+  /* Write zeros up to the given offset. */
+  void pad(uint64_t offset) {
+    static const char zeros[16] = {0};
+    while(offset_ < offset) {
+      write(zeros, min(offset - offset_, (uint64_t)sizeof(zeros)));
+    }
+  }
+
+  uint64_t offset() const { return offset_; }
+  uint64_t checksum() const { return checksum_; }
+  bool ok() const { return ok_; }
+
+ protected:
+  FILE *file_;
+  uint64_t offset_;
+  uint64_t checksum_;
+  bool ok_;
+};
+
+}  /* namespace */
+
+uint64_t farm_image_checksum(uint64_t checksum,
+                             const void *data,
+                             size_t size) {
+  const char *bytes = (const char*)data;
+  size_t num_words = size / sizeof(uint64_t);
+  for(size_t i = 0; i < num_words; ++i) {
+    uint64_t word;
+    memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+    checksum = (checksum ^ word) * 0x9e3779b97f4a7c15ULL;
+    checksum ^= checksum >> 32;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, bytes + num_words * sizeof(uint64_t), size % sizeof(uint64_t));
+  if(size % sizeof(uint64_t) != 0) {
+    checksum = (checksum ^ tail) * 0x9e3779b97f4a7c15ULL;
+    checksum ^= checksum >> 32;
+  }
+  return checksum;
+}
+
+/* Write image of the farm to the file. */
+bool Farm::store_image(const string& filename) {
+  thread_scoped_lock scoped_lock(lock);
+  double start_time = util_time_dt();
+  /* Lay out the sections first, tasks are only stored for the jobs which
+   * restore() would read them for.
+   */
+  vector<FarmImageJob> image_jobs(jobs_.size());
+  uint64_t num_tasks = 0, num_task_dependencies = 0, data_size = 0;
+  for(int i = 0; i < jobs_.size(); ++i) {
+    Job *job = jobs_[i];
+    if(job->need_always_fetch_tasks()) {
+      load_job_tasks(job);
+    }
+    thread_scoped_lock job_lock(dispatch_queue_.job_mutex(job));
+    FarmImageJob& image_job = image_jobs[i];
+    memset(&image_job, 0, sizeof(image_job));
+    image_job.id = job->id();
+    image_job.priority = job->priority();
+    image_job.status = job->status();
+    if(job->need_always_fetch_tasks()) {
+      image_job.first_task = num_tasks;
+      image_job.num_tasks = job->tasks().size();
+      image_job.first_task_dependency = num_task_dependencies;
+      image_job.num_task_dependencies = job->task_dependencies().size();
+    }
+    image_job.data_offset = data_size;
+    image_job.name_size = job->name().size();
+    image_job.owner_size = job->owner().size();
+    image_job.num_job_dependencies = job->job_dependencies().size();
+    for(int status = 0; status < Task::NUM_STATUSES; ++status) {
+      image_job.num_tasks_by_status[status] =
+          job->num_tasks_with_status((Task::Status)status);
+    }
+    num_tasks += image_job.num_tasks;
+    num_task_dependencies += image_job.num_task_dependencies;
+    /* Keep data of every job 8 byte aligned. */
+    data_size += (image_job.name_size + image_job.owner_size +
+                  image_job.num_job_dependencies * sizeof(int32_t) + 7) &
+                 ~(uint64_t)7;
+  }
+  FarmImageHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FARM_IMAGE_MAGIC, sizeof(FARM_IMAGE_MAGIC));
+  header.version = FARM_IMAGE_VERSION;
+  header.task_size = sizeof(Task);
+  header.num_jobs = jobs_.size();
+  header.jobs_offset = image_align(sizeof(header));
+  header.tasks_offset = image_align(header.jobs_offset +
+                                    jobs_.size() * sizeof(FarmImageJob));
+  header.task_dependencies_offset = header.tasks_offset +
+                                    num_tasks * sizeof(Task);
+  header.data_offset = image_align(
+      header.task_dependencies_offset +
+      num_task_dependencies * sizeof(FarmImageTaskDependency));
+  header.file_size = header.data_offset + data_size;
+
+  string temp_filename = filename + ".tmp";
+  FILE *file = fopen(temp_filename.c_str(), "wb");
+  if(file == NULL) {
+    LOG(ERROR) << "Cannot create farm image " << temp_filename << ": "
+               << strerror(errno);
+    return false;
+  }
+  /* Header is written again with the checksum once data is written. */
+  static const char zeros[16] = {0};
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(zeros, 1, header.jobs_offset - sizeof(header), file);
+  ImageWriter writer(file, header.jobs_offset);
+  if(!image_jobs.empty()) {
+    writer.write(&image_jobs[0], image_jobs.size() * sizeof(FarmImageJob));
+  }
+  writer.pad(header.tasks_offset);
+  for(int i = 0; i < jobs_.size(); ++i) {
+    if(image_jobs[i].num_tasks != 0) {
+      thread_scoped_lock job_lock(dispatch_queue_.job_mutex(jobs_[i]));
+      writer.write(&jobs_[i]->tasks()[0],
+                   image_jobs[i].num_tasks * sizeof(Task));
+    }
+  }
+  for(int i = 0; i < jobs_.size(); ++i) {
+    if(image_jobs[i].num_task_dependencies == 0) {
+      continue;
+    }
+    foreach(const Job::TaskDependency& dependency,
+            jobs_[i]->task_dependencies()) {
+      FarmImageTaskDependency image_dependency = {dependency.task,
+                                                  dependency.depends_on};
+      writer.write(&image_dependency, sizeof(image_dependency));
+    }
+  }
+  writer.pad(header.data_offset);
+  /* Checksum is calculated in words, so data of every job is written as
+   * a whole, padded to the word size.
+   */
+  string job_data;
+  foreach(Job *job, jobs_) {
+    job_data = job->name() + job->owner();
+    foreach(int depends_on, job->job_dependencies()) {
+      int32_t image_depends_on = depends_on;
+      job_data.append((const char*)&image_depends_on,
+                      sizeof(image_depends_on));
+    }
+    job_data.resize((job_data.size() + 7) & ~(size_t)7, '\0');
+    writer.write(job_data.data(), job_data.size());
+  }
+  header.checksum = writer.checksum();
+  bool ok = writer.ok() &&
+            fseek(file, 0, SEEK_SET) == 0 &&
+            fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fflush(file) == 0 &&
+            fsync(fileno(file)) == 0;
+  ok &= fclose(file) == 0;
+  if(!ok || rename(temp_filename.c_str(), filename.c_str()) != 0) {
+    LOG(ERROR) << "Cannot write farm image " << filename << ": "
+               << strerror(errno);
+    unlink(temp_filename.c_str());
+    return false;
+  }
+  VLOG(1) << "Written farm image of " << jobs_.size() << " job(s) and "
+          << num_tasks << " task(s) in " << util_time_dt() - start_time
+          << " seconds.";
+  return true;
+}
+
+/* Restore farm from the image. */
+bool Farm::restore_image(const string& filename) {
+  double start_time = util_time_dt();
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd == -1) {
+    VLOG(1) << "No farm image " << filename << ".";
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size < sizeof(FarmImageHeader)) {
+    LOG(ERROR) << "Farm image " << filename << " is truncated.";
+    close(fd);
+    return false;
+  }
+  size_t file_size = st.st_size;
+  void *mapping = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED) {
+    LOG(ERROR) << "Cannot map farm image " << filename << ": "
+               << strerror(errno);
+    return false;
+  }
+  madvise(mapping, file_size, MADV_SEQUENTIAL);
+  const char *data = (const char*)mapping;
+  const FarmImageHeader& header = *(const FarmImageHeader*)data;
+  uint64_t num_tasks =
+      (header.task_dependencies_offset - header.tasks_offset) / sizeof(Task);
+  uint64_t num_task_dependencies =
+      (header.data_offset - header.task_dependencies_offset) /
+      sizeof(FarmImageTaskDependency);
+  bool ok = memcmp(header.magic,
+                   FARM_IMAGE_MAGIC,
+                   sizeof(FARM_IMAGE_MAGIC)) == 0 &&
+            header.version == FARM_IMAGE_VERSION &&
+            header.task_size == sizeof(Task) &&
+            header.file_size == file_size &&
+            header.jobs_offset >= sizeof(header) &&
+            header.jobs_offset <= header.tasks_offset &&
+            header.tasks_offset <= header.task_dependencies_offset &&
+            header.task_dependencies_offset <= header.data_offset &&
+            header.data_offset <= file_size &&
+            header.num_jobs <= (header.tasks_offset - header.jobs_offset) /
+                               sizeof(FarmImageJob);
+  if(!ok) {
+    LOG(ERROR) << "Farm image " << filename << " is not compatible.";
+    munmap(mapping, file_size);
+    return false;
+  }
+  if(farm_image_checksum(0,
+                         data + header.jobs_offset,
+                         file_size - header.jobs_offset) != header.checksum) {
+    LOG(ERROR) << "Farm image " << filename << " is damaged.";
+    munmap(mapping, file_size);
+    return false;
+  }
+  const FarmImageJob *image_jobs =
+      (const FarmImageJob*)(data + header.jobs_offset);
+  const Task *tasks = (const Task*)(data + header.tasks_offset);
+  const FarmImageTaskDependency *task_dependencies =
+      (const FarmImageTaskDependency*)(data + header.task_dependencies_offset);
+  uint64_t data_size = file_size - header.data_offset;
+  vector<Job*> jobs;
+  jobs.reserve(header.num_jobs);
+  vector<Job::TaskDependency> dependencies;
+  for(uint64_t i = 0; i < header.num_jobs && ok; ++i) {
+    const FarmImageJob& image_job = image_jobs[i];
+    uint64_t job_data_size = image_job.name_size + image_job.owner_size +
+        (uint64_t)image_job.num_job_dependencies * sizeof(int32_t);
+    if(image_job.first_task + image_job.num_tasks > num_tasks ||
+       image_job.first_task_dependency + image_job.num_task_dependencies >
+           num_task_dependencies ||
+       image_job.data_offset + job_data_size > data_size) {
+      ok = false;
+      break;
+    }
+    const char *job_data = data + header.data_offset + image_job.data_offset;
+    Job *job = new Job(image_job.id,
+                       image_job.priority,
+                       (Job::Status)image_job.status,
+                       string(job_data, image_job.name_size),
+                       string(job_data + image_job.name_size,
+                              image_job.owner_size));
+    jobs.push_back(job);
+    job_data += image_job.name_size + image_job.owner_size;
+    for(int j = 0; j < image_job.num_job_dependencies; ++j) {
+      int32_t depends_on;
+      memcpy(&depends_on, job_data + j * sizeof(int32_t), sizeof(int32_t));
+      job->add_job_dependency(depends_on);
+    }
+    if(!job->need_always_fetch_tasks()) {
+      for(int status = 0; status < Task::NUM_STATUSES; ++status) {
+        job->set_num_tasks_with_status((Task::Status)status,
+                                       image_job.num_tasks_by_status[status]);
+      }
+      continue;
+    }
+    dependencies.resize(image_job.num_task_dependencies);
+    for(int j = 0; j < image_job.num_task_dependencies; ++j) {
+      const FarmImageTaskDependency& image_dependency =
+          task_dependencies[image_job.first_task_dependency + j];
+      if(image_dependency.task < 0 ||
+         image_dependency.task >= image_job.num_tasks ||
+         image_dependency.depends_on < 0 ||
+         image_dependency.depends_on >= image_job.num_tasks) {
+        ok = false;
+        break;
+      }
+      dependencies[j].task = image_dependency.task;
+      dependencies[j].depends_on = image_dependency.depends_on;
+    }
+    job->assign_tasks(tasks + image_job.first_task,
+                      image_job.num_tasks,
+                      dependencies);
+  }
+  munmap(mapping, file_size);
+  if(!ok) {
+    LOG(ERROR) << "Farm image " << filename << " has invalid job data.";
+    foreach(Job *job, jobs) {
+      delete job;
+    }
+    return false;
+  }
+  restore_jobs(jobs);
+  VLOG(1) << "Restored " << jobs.size() << " job(s) from farm image in "
+          << util_time_dt() - start_time << " seconds.";
+  return true;
+}
+
+}  /* namespace Farm */
@@ -0,0 +1,106 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef MODEL_FARM_IMAGE_
+#define MODEL_FARM_IMAGE_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "model/model_task.h"
+
+namespace Farm {
+
+/* Binary image of the farm, written by Farm::store_image().
+ *
+ * The image is laid out so it can be mapped into memory and used in
+ * place: fixed-size header, table of jobs, then sections of tasks, task
+ * dependencies and variable-size job data. All sections start at 16 byte
+ * aligned offsets and tasks are stored exactly as they're laid out in
+ * memory, so they are copied to the jobs without any parsing.
+ *
+ * Values are in the native byte order, checksum covers everything after
+ * the header.
+ */
+
+/* Identification of the image file. */
+#define FARM_IMAGE_MAGIC "FARMIMG"
+/* Increased whenever layout of the image or of the Task changes. */
+#define FARM_IMAGE_VERSION 3
+
+struct FarmImageHeader {
+  char magic[8];
+  uint32_t version;
+  /* Size of a task, to catch images written by a build with different
+   * task layout.
+   */
+  uint32_t task_size;
+  uint64_t file_size;
+  uint64_t checksum;
+  uint64_t num_jobs;
+  /* Offsets of the sections from the beginning of the file. */
+  uint64_t jobs_offset;
+  uint64_t tasks_offset;
+  uint64_t task_dependencies_offset;
+  uint64_t data_offset;
+};
+
+/* Job in the jobs table. */
+struct FarmImageJob {
+  int32_t id;
+  uint8_t priority;
+  uint8_t status;
+  uint16_t padding;
+  /* Tasks of the job, only stored for jobs which keep them in memory. */
+  uint64_t first_task;
+  uint32_t num_tasks;
+  /* Dependencies between tasks, as pairs of task indices. */
+  uint32_t num_task_dependencies;
+  uint64_t first_task_dependency;
+  /* Name, owner and IDs of the jobs this job depends on, stored one
+   * after another in the data section.
+   */
+  uint64_t data_offset;
+  uint32_t name_size;
+  uint32_t owner_size;
+  uint32_t num_job_dependencies;
+  /* Number of tasks with every status, so they're known for the jobs
+   * which tasks are not stored.
+   */
+  uint32_t num_tasks_by_status[Task::NUM_STATUSES];
+};
+
+/* Dependency between two tasks of the job, by the task indices. */
+struct FarmImageTaskDependency {
+  int32_t task;
+  int32_t depends_on;
+};
+
+/* Update checksum of the image data with the next chunk of it, initial
+ * checksum is 0.
+ *
+ * Data is processed in 8 byte words, so all the chunks except the last
+ * one are to be multiple of 8 bytes in size.
+ */
+uint64_t farm_image_checksum(uint64_t checksum, const void *data, size_t size);
+
+}  /* namespace Farm */
+
+#endif  /* MODEL_FARM_IMAGE_ */
@@ -20,105 +20,417 @@
 
 #include "model/model_job.h"
 
+#include "model/model_snapshot.h"
 #include "model/model_task.h"
 #include "storage/storage.h"
+#include "util/util_algorithm.h"
 #include "util/util_foreach.h"
 #include "util/util_logging.h"
 
 namespace Farm {
 
+Job::State::State()
+    : id(-1),
+      priority(50),
+      status(STATUS_WAITING) {
+}
+
+Job::State::State(const State& other)
+    : id(other.id),
+      priority(other.priority),
+      status(other.status.load(memory_order_relaxed)) {
+}
+
+Job::State& Job::State::operator=(const State& other) {
+  id = other.id;
+  priority = other.priority;
+  status.store(other.status.load(memory_order_relaxed), memory_order_relaxed);
+  return *this;
+}
+
 Job::Job()
-    : id_(-1),
-      priority_(50),
-      status_(STATUS_WAITING),
-      name_("") {
+    : state_(&detached_state_),
+      name_(""),
+      owner_(""),
+      tasks_resident_(false),
+      waiting_task_cursor_(0),
+      first_task_id_(-1),
+      num_tasks_(0),
+      num_unmet_job_dependencies_(0),
+      total_task_runtime_(0.0),
+      start_time_(0.0),
+      finish_time_(0.0),
+      queue_handle_(-1),
+      version_(0) {
+  fill(num_tasks_by_status_, num_tasks_by_status_ + Task::NUM_STATUSES, 0);
 }
 
 Job::Job(int id,
          Priority priority,
          Status status,
-         string name)
-    : id_(id),
-      priority_(priority),
-      status_(status),
-      name_(name) {
+         string name,
+         string owner)
+    : state_(&detached_state_),
+      name_(name),
+      owner_(owner),
+      tasks_resident_(false),
+      waiting_task_cursor_(0),
+      first_task_id_(-1),
+      num_tasks_(0),
+      num_unmet_job_dependencies_(0),
+      total_task_runtime_(0.0),
+      start_time_(0.0),
+      finish_time_(0.0),
+      queue_handle_(-1),
+      version_(0) {
+  detached_state_.id = id;
+  detached_state_.priority = priority;
+  detached_state_.status.store(status, memory_order_relaxed);
+  fill(num_tasks_by_status_, num_tasks_by_status_ + Task::NUM_STATUSES, 0);
 }
 
 Job::~Job() {
-  foreach(Task *task, tasks_) {
-    delete task;
-  }
+}
+
+/* Move state of the job to the given place. */
+void Job::attach_state(State *state) {
+  *state = *state_;
+  state_ = state;
 }
 
 bool Job::is_running() {
-  return status_ == STATUS_WAITING ||
-         status_ == STATUS_ACTIVE;
+  return is_running_status(status());
 }
 
 bool Job::need_always_fetch_tasks() {
-  /* return is_running(); */
-  /* TODO(sergey): For now we always keep all tasks in memory. */
+  /* Paused jobs might have tasks which are still processed by workers,
+   * they're to be in memory so their leases are restored.
+   */
+  return is_running() || status() == STATUS_PAUSED;
+}
+
+/* Memory used by the tasks of the job. */
+size_t Job::tasks_memory_size() const {
+  return tasks_.capacity() * sizeof(Task) +
+         (task_dependents_offsets_.capacity() +
+          task_dependents_.capacity() +
+          task_unmet_dependencies_.capacity()) * sizeof(int) +
+         task_runs_.capacity() * sizeof(TaskRun);
+}
+
+/* Replace the task table with runs of tasks which share the status. */
+bool Job::compact_tasks() {
+  if(!tasks_resident_ ||
+     tasks_.empty() ||
+     !task_dependents_.empty() ||
+     num_tasks_by_status_[Task::STATUS_ACTIVE] != 0) {
+    return false;
+  }
+  int first_task_id = tasks_[0].id();
+  vector<TaskRun> runs;
+  for(int i = 0; i < tasks_.size(); ++i) {
+    const Task& task = tasks_[i];
+    /* Tasks are brought back from the first ID, so it only works for
+     * tasks with consecutive IDs.
+     */
+    if(task.id() != first_task_id + i) {
+      return false;
+    }
+    if(runs.empty() || runs.back().status != task.status()) {
+      TaskRun run = {i, (unsigned char)task.status()};
+      runs.push_back(run);
+    }
+  }
+  free_tasks();
+  vector<TaskRun>(runs).swap(task_runs_);
+  first_task_id_ = first_task_id;
   return true;
 }
 
+/* Bring back the task table from the runs. */
+void Job::expand_tasks() {
+  tasks_.clear();
+  tasks_.reserve(num_tasks_);
+  for(int i = 0; i < task_runs_.size(); ++i) {
+    int end_index = i + 1 < task_runs_.size() ? task_runs_[i + 1].first_index
+                                              : num_tasks_;
+    Task::Status status = (Task::Status)task_runs_[i].status;
+    for(int index = task_runs_[i].first_index; index < end_index; ++index) {
+      tasks_.push_back(Task(first_task_id_ + index, status));
+    }
+  }
+  vector<TaskRun>().swap(task_runs_);
+  tasks_resident_ = true;
+  set_task_dependencies(vector<TaskDependency>());
+}
+
+/* Free memory used by the tasks. */
+void Job::unload_tasks() {
+  if(!compact_tasks()) {
+    free_tasks();
+  }
+}
+
+/* Free the task table and the dependencies of the tasks. */
+void Job::free_tasks() {
+  vector<Task>().swap(tasks_);
+  vector<int>().swap(task_dependents_offsets_);
+  vector<int>().swap(task_dependents_);
+  vector<int>().swap(task_unmet_dependencies_);
+  reset_waiting_task();
+  tasks_resident_ = false;
+}
+
+/* Peek next waiting task of the job. */
+Task *Job::next_waiting_task() {
+  if(num_unmet_job_dependencies_ != 0) {
+    return NULL;
+  }
+  while(!requeued_tasks_.empty()) {
+    Task *task = requeued_tasks_.back();
+    if(task->status() == Task::STATUS_WAITING) {
+      return task;
+    }
+    requeued_tasks_.pop_back();
+  }
+  while(waiting_task_cursor_ < tasks_.size()) {
+    Task *task = &tasks_[waiting_task_cursor_];
+    /* Tasks with unmet dependencies are requeued once they're met. */
+    if(task->status() == Task::STATUS_WAITING &&
+       task_unmet_dependencies_[waiting_task_cursor_] == 0) {
+      return task;
+    }
+    ++waiting_task_cursor_;
+  }
+  return NULL;
+}
+
+/* Move cursor past the task returned by next_waiting_task(). */
+void Job::advance_waiting_task() {
+  if(!requeued_tasks_.empty()) {
+    requeued_tasks_.pop_back();
+  } else {
+    ++waiting_task_cursor_;
+  }
+}
+
+/* Make next_waiting_task() to re-scan tasks from the beginning. */
+void Job::reset_waiting_task() {
+  waiting_task_cursor_ = 0;
+  requeued_tasks_.clear();
+}
+
+/* Return task back to waiting tasks. */
+void Job::requeue_waiting_task(Task *task) {
+  requeued_tasks_.push_back(task);
+}
+
+/* Change status of the task. */
+void Job::set_task_status(Task *task, Task::Status status) {
+  --num_tasks_by_status_[task->status()];
+  ++num_tasks_by_status_[status];
+  task->set_status(status);
+  ++version_;
+}
+
+/* Set number of tasks with the given status. */
+void Job::set_num_tasks_with_status(Task::Status status, int num_tasks) {
+  num_tasks_ += num_tasks - num_tasks_by_status_[status];
+  num_tasks_by_status_[status] = num_tasks;
+  ++version_;
+}
+
+/* Re-calculate number of tasks with every status from the tasks. */
+void Job::update_task_statuses() {
+  fill(num_tasks_by_status_, num_tasks_by_status_ + Task::NUM_STATUSES, 0);
+  foreach(const Task& task, tasks_) {
+    ++num_tasks_by_status_[task.status()];
+  }
+  num_tasks_ = tasks_.size();
+  ++version_;
+}
+
+/* Set dependencies between tasks of the job. */
+void Job::set_task_dependencies(
+    const vector<TaskDependency>& dependencies) {
+  int num_tasks = tasks_.size();
+  /* Count dependents of every task first, then fill them in. */
+  task_dependents_offsets_.assign(num_tasks + 1, 0);
+  foreach(const TaskDependency& dependency, dependencies) {
+    ++task_dependents_offsets_[dependency.depends_on + 1];
+  }
+  for(int i = 0; i < num_tasks; ++i) {
+    task_dependents_offsets_[i + 1] += task_dependents_offsets_[i];
+  }
+  task_dependents_.resize(dependencies.size());
+  vector<int> fill_offsets(task_dependents_offsets_.begin(),
+                           task_dependents_offsets_.end() - 1);
+  task_unmet_dependencies_.assign(num_tasks, 0);
+  foreach(const TaskDependency& dependency, dependencies) {
+    task_dependents_[fill_offsets[dependency.depends_on]++] =
+        dependency.task;
+    if(tasks_[dependency.depends_on].status() != Task::STATUS_COMPLETED) {
+      ++task_unmet_dependencies_[dependency.task];
+    }
+  }
+  update_task_statuses();
+  reset_waiting_task();
+}
+
+/* Check dependencies between tasks of the job. */
+bool Job::valid_task_dependencies(
+    int num_tasks,
+    const vector<TaskDependency>& dependencies) {
+  vector<int> num_unmet_dependencies(num_tasks, 0);
+  vector<int> dependents_offsets(num_tasks + 1, 0);
+  foreach(const TaskDependency& dependency, dependencies) {
+    if(dependency.task < 0 || dependency.task >= num_tasks ||
+       dependency.depends_on < 0 || dependency.depends_on >= num_tasks) {
+      return false;
+    }
+    ++num_unmet_dependencies[dependency.task];
+    ++dependents_offsets[dependency.depends_on + 1];
+  }
+  for(int i = 0; i < num_tasks; ++i) {
+    dependents_offsets[i + 1] += dependents_offsets[i];
+  }
+  vector<int> dependents(dependencies.size());
+  vector<int> fill_offsets(dependents_offsets.begin(),
+                           dependents_offsets.end() - 1);
+  foreach(const TaskDependency& dependency, dependencies) {
+    dependents[fill_offsets[dependency.depends_on]++] = dependency.task;
+  }
+  /* Complete tasks in dependency order, tasks left over are on a cycle. */
+  vector<int> ready_tasks;
+  for(int i = 0; i < num_tasks; ++i) {
+    if(num_unmet_dependencies[i] == 0) {
+      ready_tasks.push_back(i);
+    }
+  }
+  int num_completed = 0;
+  while(!ready_tasks.empty()) {
+    int task = ready_tasks.back();
+    ready_tasks.pop_back();
+    ++num_completed;
+    for(int i = dependents_offsets[task];
+        i < dependents_offsets[task + 1];
+        ++i) {
+      if(--num_unmet_dependencies[dependents[i]] == 0) {
+        ready_tasks.push_back(dependents[i]);
+      }
+    }
+  }
+  return num_completed == num_tasks;
+}
+
+/* Get all dependencies between tasks of the job. */
+vector<Job::TaskDependency> Job::task_dependencies() const {
+  vector<TaskDependency> dependencies;
+  dependencies.reserve(task_dependents_.size());
+  for(int i = 0; i < tasks_.size(); ++i) {
+    for(int j = task_dependents_offsets_[i];
+        j < task_dependents_offsets_[i + 1];
+        ++j) {
+      TaskDependency dependency = {task_dependents_[j], i};
+      dependencies.push_back(dependency);
+    }
+  }
+  return dependencies;
+}
+
+/* Mark active task as completed. */
+bool Job::complete_task(Task *task) {
+  return finish_task(task, Task::STATUS_COMPLETED);
+}
+
+/* Mark active task as failed for good. */
+bool Job::fail_task(Task *task) {
+  return finish_task(task, Task::STATUS_FAILED);
+}
+
+/* Finish active task, releasing its dependents. */
+bool Job::finish_task(Task *task, Task::Status status) {
+  int index = task_index(task);
+  set_task_status(task, status);
+  bool has_ready_tasks = false;
+  for(int i = task_dependents_offsets_[index];
+      i < task_dependents_offsets_[index + 1];
+      ++i) {
+    int dependent = task_dependents_[i];
+    if(--task_unmet_dependencies_[dependent] == 0 &&
+       tasks_[dependent].status() == Task::STATUS_WAITING) {
+      requeue_waiting_task(&tasks_[dependent]);
+      has_ready_tasks = true;
+    }
+  }
+  return has_ready_tasks;
+}
+
 /* (Re-)generate tasks for the job. */
 void Job::generate_tasks(int start_task_id) {
   tasks_.clear();
   /* TODO(sergey): Do a real thing here. */
-  for(int i = 0; i < 1024; ++i) {
-    Task *new_task = new Task(start_task_id, Task::STATUS_WAITING);
-    tasks_.push_back(new_task);
+  tasks_.reserve(NUM_GENERATED_TASKS);
+  for(int i = 0; i < NUM_GENERATED_TASKS; ++i) {
+    tasks_.push_back(Task(start_task_id + i, Task::STATUS_WAITING));
   }
+  tasks_resident_ = true;
+  set_task_dependencies(vector<TaskDependency>());
 }
 
 /* Real tasks from the storage. */
 bool Job::restore_tasks(Storage *storage) {
+  vector<TaskRun>().swap(task_runs_);
   storage->retrieve_all_tasks(*this, &tasks_);
-  VLOG(1) << "Restored " << tasks_.size()  << " task(s) for job id " << id_;
+  /* Table doesn't grow after restore, so give back unused capacity. */
+  tasks_.shrink_to_fit();
+  tasks_resident_ = true;
+  vector<TaskDependency> dependencies;
+  storage->retrieve_task_dependencies(*this, &dependencies);
+  set_task_dependencies(dependencies);
+  VLOG(1) << "Restored " << tasks_.size()  << " task(s) for job id " << id();
   return true;
 }
 
+/* Fill task table with a copy of the given tasks. */
+void Job::assign_tasks(const Task *tasks,
+                       int num_tasks,
+                       const vector<TaskDependency>& dependencies) {
+  vector<Task>(tasks, tasks + num_tasks).swap(tasks_);
+  tasks_resident_ = true;
+  set_task_dependencies(dependencies);
+}
+
+/* Take tasks retrieved from the storage. */
+void Job::take_tasks(vector<Task> *tasks,
+                     const vector<TaskDependency>& dependencies) {
+  tasks_.swap(*tasks);
+  tasks->clear();
+  tasks_.shrink_to_fit();
+  tasks_resident_ = true;
+  set_task_dependencies(dependencies);
+}
+
 /* Store all tasks to the storage. */
 bool Job::store_tasks(Storage *storage) {
   return true;
 }
 
 /* Serialize the job into JSON. */
-json Job::serialize_json(bool detail) {
-  /* TODO(sergey): Need to fill in a real information here. */
-  json manager;
-  manager["name"] = "Blender Institute";
-  manager["logo"] = "http://i.imgur.com/tVQSqq3s.jpg";
-  json job;
-  job["id"] = id_;
-  job["time_remaining"] = 0;
-  job["time_average"] = 0;
-  job["time_total"] = 0;
-  job["time_elapsed"] = 0;
-  job["job_name"] = name_;
-  job["percentage_done"] = name_;
-  job["status"] = "waiting";
-  job["creation_date"] = "Creation Time";
-  job["date_edit"] = "Edit Time";
-  job["priority"] = priority_;
-  job["manager"] = manager;
-  job["tasks_status"] = json();
-  job["username"] = "Marty McFly";
-  if(detail) {
-    json settings;
-    settings["frame_start"] = 0;
-    settings["frame_end"] = 250;
-    settings["chunk_size"] = 0;
-
-    /* TODO(sergey): This guys are to be unified in flamenco.*/
-    job["total_time"] = 0;
-    job["average_time"] = 0;
-
-    job["average_time_frame"] = 0;
-    job["tasks"] = "";
-    job["settings"] = settings;
-  }
-  return job;
+json Job::serialize_json(double current_time, bool detail) {
+  return JobSnapshot(*this).serialize_json(current_time, detail);
+}
+
+JobUpdate::JobUpdate(const Job& job)
+    : id(job.id()),
+      priority(job.priority()),
+      status(job.status()),
+      name(job.name()),
+      owner(job.owner()) {
+  for(int status = 0; status < Task::NUM_STATUSES; ++status) {
+    num_tasks_by_status[status] =
+        job.num_tasks_with_status((Task::Status)status);
+  }
 }
 
 }  /* namespace Farm */
@@ -21,25 +21,63 @@
 #ifndef MODEL_JOB_
 #define MODEL_JOB_
 
+#include "model/model_task.h"
+
+#include "util/util_atomic.h"
 #include "util/util_json.h"
+#include "util/util_running_median.h"
 #include "util/util_string.h"
 #include "util/util_vector.h"
 
 namespace Farm {
 
 class Storage;
-class Task;
 
 class Job {
  public:
   typedef unsigned char Priority;
 
+  /* Number of tasks created by generate_tasks(). */
+  static const int NUM_GENERATED_TASKS = 1024;
+
   enum Status {
     STATUS_WAITING = 0,
     STATUS_ACTIVE,
     STATUS_COMPLETED,
     STATUS_CANCELLED,
     STATUS_PAUSED,
+    /* All tasks are finished, some of them failed. */
+    STATUS_FAILED,
+  };
+
+  /* Scheduling state of the job, read by the scans over all the jobs.
+   *
+   * Farm keeps states of its jobs packed in a table, apart from the rest
+   * of the job, so such scans don't drag descriptive data of the jobs
+   * through the cache.
+   */
+  struct State {
+    State();
+    State(const State& other);
+    State& operator=(const State& other);
+
+    int id;
+    Priority priority;
+    /* Dispatch changes status from waiting to active holding only the
+     * job's lock, while the scans read it holding only the farm's lock, so
+     * it's atomic. Relaxed access is enough: the locks order everything
+     * else, and dispatch never moves the job in or out of the running
+     * statuses, so the scans only might see an active job as waiting.
+     */
+    atomic<unsigned char> status;
+  };
+
+  /* Dependency between two tasks of the job, given by their indices:
+   * task is not dispatched until depends_on is completed.
+   */
+  struct TaskDependency {
+    int task;
+    int depends_on;
   };
 
   Job();
@@ -47,19 +85,68 @@ class Job {
   Job(int id,
       Priority priority,
       Status status,
-      string name);
+      string name,
+      string owner);
 
   ~Job();
 
-  inline int id() const { return id_; }
-  inline void set_id(int id) { id_ = id; }
-  inline int priority() const { return priority_; }
-  inline void set_priority(Priority priority) { priority_ = priority; }
-  inline int status() const { return status_; }
-  inline void set_status(Status status) { status_ = status; }
+  inline int id() const { return state_->id; }
+  inline void set_id(int id) { state_->id = id; }
+  inline int priority() const { return state_->priority; }
+  inline void set_priority(Priority priority) {
+    state_->priority = priority;
+    ++version_;
+  }
+  inline int status() const {
+    return state_->status.load(memory_order_relaxed);
+  }
+  inline void set_status(Status status) {
+    state_->status.store(status, memory_order_relaxed);
+    ++version_;
+  }
   inline const string& name() const { return name_; }
-  inline void set_name(string name) { name_ = name; }
-  inline vector<Task*>& tasks() { return tasks_; }
+  inline void set_name(string name) {
+    name_ = name;
+    ++version_;
+  }
+  inline const string& owner() const { return owner_; }
+  inline void set_owner(string owner) {
+    owner_ = owner;
+    ++version_;
+  }
+
+  /* Number of changes of the job state which is shown to the users, so
+   * unchanged jobs could be told apart without comparing their state.
+   */
+  inline unsigned int version() const { return version_; }
+  inline vector<Task>& tasks() { return tasks_; }
+  inline const vector<Task>& tasks() const { return tasks_; }
+
+  /* Index of the task within the job's task table. */
+  inline int task_index(const Task *task) const {
+    return task - &tasks_[0];
+  }
+  inline int queue_handle() const { return queue_handle_; }
+  inline void set_queue_handle(int handle) { queue_handle_ = handle; }
+
+  inline const State& state() const { return *state_; }
+
+  /* Move state of the job to the given place, which is to outlive the
+   * job. Used by the farm to keep states of its jobs in a table.
+   */
+  void attach_state(State *state);
+
+  /* Check whether the job with the given status is still running. */
+  static inline bool is_running_status(int status) {
+    return status == STATUS_WAITING || status == STATUS_ACTIVE;
+  }
+
+  /* Check whether the job with the given status has finished all its
+   * tasks, so jobs depending on it could run.
+   */
+  static inline bool is_finished_status(int status) {
+    return status == STATUS_COMPLETED || status == STATUS_FAILED;
+  }
 
   /* Check whether the job is stll running. */
   bool is_running();
@@ -71,28 +158,296 @@ class Job {
    */
   bool need_always_fetch_tasks();
 
+  /* Number of tasks of the job, known even if they're not in memory
+   * as long as they were loaded once.
+   */
+  inline int num_tasks() const { return num_tasks_; }
+
+  /* Number of tasks which have the given status. */
+  inline int num_tasks_with_status(Task::Status status) const {
+    return num_tasks_by_status_[status];
+  }
+
+  /* Set number of tasks with the given status while the tasks are not
+   * loaded, so storage could give the counts of the restored jobs. Counts
+   * are re-calculated once the tasks are loaded.
+   */
+  void set_num_tasks_with_status(Task::Status status, int num_tasks);
+
+  /* Change status of the task, keeping the counts of tasks by status up
+   * to date.
+   */
+  void set_task_status(Task *task, Task::Status status);
+
+  /* Check whether tasks of the job are loaded into memory. */
+  inline bool tasks_resident() const { return tasks_resident_; }
+
+  /* Check whether statuses of the tasks which are not resident are kept
+   * as runs, so the tasks could be brought back without the storage.
+   */
+  inline bool tasks_compacted() const { return !task_runs_.empty(); }
+
+  /* Memory used by the tasks of the job, in bytes. */
+  size_t tasks_memory_size() const;
+
+  /* Replace the task table with runs of tasks which share the status,
+   * which is a few bytes per run instead of bytes per task.
+   *
+   * Returns false if the job has active tasks, which are pointed to by
+   * their leases, or task dependencies, which are only kept with the
+   * table. Tasks are left as they are in this case.
+   */
+  bool compact_tasks();
+
+  /* Bring back the task table from the runs kept by compact_tasks(). */
+  void expand_tasks();
+
+  /* Free memory used by the tasks. They're compacted if possible,
+   * otherwise they're to be restored from the storage before they can be
+   * used again. Number of tasks with every status is kept.
+   */
+  void unload_tasks();
+
+  /* Peek next waiting task of the job, NULL if there's no such task.
+   *
+   * Tasks are scanned in order using a cursor, so the cost of getting all
+   * the waiting tasks one by one is linear in the number of job's tasks.
+   */
+  Task *next_waiting_task();
+
+  /* Move cursor past the task returned by next_waiting_task(). */
+  void advance_waiting_task();
+
+  /* Make next_waiting_task() to re-scan tasks from the beginning. */
+  void reset_waiting_task();
+
+  /* Return task which is behind the cursor back to waiting tasks,
+   * it'll be returned by next_waiting_task() before any other task.
+   */
+  void requeue_waiting_task(Task *task);
+
+  /* Set dependencies between tasks of the job.
+   *
+   * Counters of unmet dependencies are calculated from the current
+   * status of the tasks, so it's to be called after the tasks are
+   * generated or restored.
+   */
+  void set_task_dependencies(const vector<TaskDependency>& dependencies);
+
+  /* Check that dependencies refer to existing tasks and have no cycles,
+   * so every task of the job could eventually be dispatched.
+   */
+  static bool valid_task_dependencies(
+      int num_tasks,
+      const vector<TaskDependency>& dependencies);
+
+  /* Get all dependencies between tasks of the job. */
+  vector<TaskDependency> task_dependencies() const;
+
+  /* Mark active task as completed.
+   *
+   * Tasks which depended on it and have no other unmet dependencies are
+   * returned to the waiting tasks. Returns true if there're such tasks.
+   */
+  bool complete_task(Task *task);
+
+  /* Mark active task as failed for good.
+   *
+   * Dependents are released the same way as for completed task, so a
+   * single broken task doesn't hold the rest of the job forever.
+   */
+  bool fail_task(Task *task);
+
+  /* Check whether all tasks of the job are completed or failed. */
+  bool all_tasks_finished() const {
+    return num_tasks_by_status_[Task::STATUS_COMPLETED] +
+           num_tasks_by_status_[Task::STATUS_FAILED] == num_tasks_;
+  }
+
+  /* IDs of the jobs this job depends on. */
+  inline const vector<int>& job_dependencies() const {
+    return job_dependencies_;
+  }
+  inline void add_job_dependency(int job_id) {
+    job_dependencies_.push_back(job_id);
+  }
+
+  /* Jobs which depend on this job. */
+  inline const vector<Job*>& dependent_jobs() const {
+    return dependent_jobs_;
+  }
+  inline void add_dependent_job(Job *job) { dependent_jobs_.push_back(job); }
+
+  /* Number of the jobs this job depends on which are not completed yet,
+   * tasks of the job are not dispatched until it becomes zero.
+   */
+  inline int num_unmet_job_dependencies() const {
+    return num_unmet_job_dependencies_;
+  }
+  inline void set_num_unmet_job_dependencies(int num) {
+    num_unmet_job_dependencies_ = num;
+  }
+
+  /* Median estimate and count of the runtimes of the completed tasks, in
+   * seconds.
+   */
+  inline const running_median<double>& task_runtimes() const {
+    return task_runtimes_;
+  }
+  inline void add_task_runtime(double runtime) {
+    task_runtimes_.add(runtime);
+    total_task_runtime_ += runtime;
+    ++version_;
+  }
+
+  /* Sum and average of the runtimes of the completed tasks. */
+  inline double total_task_runtime() const { return total_task_runtime_; }
+  inline double average_task_runtime() const {
+    return task_runtimes_.empty()
+        ? 0.0
+        : total_task_runtime_ / task_runtimes_.size();
+  }
+
+  /* Time at which first task of the job was dispatched and time at which
+   * the job was completed, 0 if it didn't happen yet.
+   */
+  inline double start_time() const { return start_time_; }
+  inline void set_start_time(double time) {
+    start_time_ = time;
+    ++version_;
+  }
+  inline double finish_time() const { return finish_time_; }
+  inline void set_finish_time(double time) {
+    finish_time_ = time;
+    ++version_;
+  }
+
   /* (Re-)generate tasks for the job. */
   void generate_tasks(int start_task_id);
 
   /* Real tasks from the storage. */
   bool restore_tasks(Storage *storage);
 
+  /* Fill task table with a copy of the given tasks, used to restore
+   * tasks in bulk from a memory-mapped farm image.
+   */
+  void assign_tasks(const Task *tasks,
+                    int num_tasks,
+                    const vector<TaskDependency>& dependencies);
+
+  /* Take tasks retrieved from the storage, the given vector is left
+   * empty. Used by restore to build jobs from the tasks read in bulk.
+   */
+  void take_tasks(vector<Task> *tasks,
+                  const vector<TaskDependency>& dependencies);
+
   /* Store all tasks to the storage. */
   bool store_tasks(Storage *storage);
 
-  /* Serialize the job into JSON. */
-  json serialize_json(bool detail = false);
+  /* Serialize the job into JSON.
+   *
+   * Progress is reported from the counters kept up to date by the task
+   * status changes, so no tasks are scanned. current_time is used for
+   * the elapsed time of the running job.
+   */
+  json serialize_json(double current_time, bool detail = false);
  protected:
-  /* Unique ID of the job. */
-  int id_;
-  /* Priority of the job. */
-  Priority priority_;
-  /* Status of the job. */
-  Status status_;
+  /* Re-calculate number of tasks with every status from the tasks. */
+  void update_task_statuses();
+
+  /* Free the task table and the dependencies of the tasks. */
+  void free_tasks();
+
+  /* Finish active task with the given status, releasing its dependents.
+   * Returns true if some of them became ready for dispatch.
+   */
+  bool finish_task(Task *task, Task::Status status);
+
+  /* ID, priority and status of the job, points to detached_state_
+   * until the state is attached to the farm's table.
+   */
+  State *state_;
+  State detached_state_;
   /* Name of the job. */
   string name_;
-  /* Tasks of the job. */
-  vector<Task*> tasks_;
+  /* Name of the user who owns the job. */
+  string owner_;
+  /* Table of the job's tasks, stored contiguously.
+   *
+   * The table is replaced by unload_tasks(), assign_tasks() and
+   * take_tasks(), which invalidates pointers to the tasks. Only tasks of
+   * the jobs which are not running are unloaded, and Farm::evict_job_tasks()
+   * skips jobs with active tasks, since their leases point to the tasks.
+   */
+  vector<Task> tasks_;
+  /* Tasks are loaded into memory. */
+  bool tasks_resident_;
+  /* Index of the first task which might be waiting for dispatch. */
+  int waiting_task_cursor_;
+  /* Tasks which became waiting again after the cursor passed them. */
+  vector<Task*> requeued_tasks_;
+  /* Dependent tasks of every task, in compressed sparse row format:
+   * dependents of the task i are task_dependents_[offsets[i]] up to
+   * task_dependents_[offsets[i + 1]].
+   */
+  vector<int> task_dependents_offsets_;
+  vector<int> task_dependents_;
+  /* Number of not completed dependencies of every task. */
+  vector<int> task_unmet_dependencies_;
+  /* Run of tasks which share the status, up to the first task of the
+   * next run.
+   */
+  struct TaskRun {
+    int first_index;
+    unsigned char status;
+  };
+  /* Statuses of the compacted tasks, empty if the job is not compacted.
+   * Tasks of the job have consecutive IDs starting at first_task_id_.
+   */
+  vector<TaskRun> task_runs_;
+  int first_task_id_;
+  /* Number of tasks and number of tasks with every status, kept when the
+   * tasks are unloaded.
+   */
+  int num_tasks_;
+  int num_tasks_by_status_[Task::NUM_STATUSES];
+  /* IDs of the jobs this job depends on. */
+  vector<int> job_dependencies_;
+  /* Jobs which depend on this job, not owned by the job. */
+  vector<Job*> dependent_jobs_;
+  /* Number of the jobs this job depends on which are not completed. */
+  int num_unmet_job_dependencies_;
+  /* Median estimate of the runtimes of the completed tasks, only covers
+   * tasks completed since the farm was restored. Takes the same memory
+   * whatever number of tasks is completed.
+   */
+  running_median<double> task_runtimes_;
+  /* Sum of the runtimes of the completed tasks. */
+  double total_task_runtime_;
+  /* Time of the first dispatch and of the completion. */
+  double start_time_;
+  double finish_time_;
+  /* Handle of the job in the farm's dispatch queue, -1 if not queued. */
+  int queue_handle_;
+  /* Number of changes of the state shown to the users. */
+  unsigned int version_;
+};
+
+/* Change of the job which is written to the storage, copied from the job
+ * so it could be written after the job's lock is released.
+ */
+struct JobUpdate {
+  explicit JobUpdate(const Job& job);
+
+  int id;
+  Job::Priority priority;
+  unsigned char status;
+  string name;
+  string owner;
+  /* Number of tasks with every status, kept with the job so they're
+   * known without reading the tasks.
+   */
+  int num_tasks_by_status[Task::NUM_STATUSES];
 };
 
 }  /* namespace Farm */
@@ -0,0 +1,145 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "model/model_snapshot.h"
+
+#include "util/util_algorithm.h"
+
+namespace Farm {
+
+namespace {
+
+bool job_snapshot_id_less(const shared_ptr<const JobSnapshot>& job, int id) {
+  return job->id < id;
+}
+
+}  /* namespace */
+
+JobSnapshot::JobSnapshot()
+    : id(-1),
+      priority(50),
+      status(Job::STATUS_WAITING),
+      num_tasks(0),
+      total_task_runtime(0.0),
+      average_task_runtime(0.0),
+      start_time(0.0),
+      finish_time(0.0),
+      version(0) {
+  fill(num_tasks_by_status, num_tasks_by_status + Task::NUM_STATUSES, 0);
+}
+
+JobSnapshot::JobSnapshot(const Job& job)
+    : id(job.id()),
+      priority(job.priority()),
+      status((Job::Status)job.status()),
+      name(job.name()),
+      owner(job.owner()),
+      num_tasks(job.num_tasks()),
+      total_task_runtime(job.total_task_runtime()),
+      average_task_runtime(job.average_task_runtime()),
+      start_time(job.start_time()),
+      finish_time(job.finish_time()),
+      version(job.version()) {
+  for(int i = 0; i < Task::NUM_STATUSES; ++i) {
+    num_tasks_by_status[i] = job.num_tasks_with_status((Task::Status)i);
+  }
+}
+
+/* Serialize the job into JSON. */
+json JobSnapshot::serialize_json(double current_time, bool detail) const {
+  /* TODO(sergey): Need to fill in a real information here. */
+  json manager;
+  manager["name"] = "Blender Institute";
+  manager["logo"] = "http://i.imgur.com/tVQSqq3s.jpg";
+  double time_elapsed = 0.0;
+  if(start_time != 0.0) {
+    time_elapsed = (finish_time != 0.0 ? finish_time : current_time) -
+                   start_time;
+  }
+  /* Remaining tasks are expected to be processed with the same number
+   * of workers as the job is using now.
+   */
+  int num_remaining_tasks = num_tasks_by_status[Task::STATUS_WAITING] +
+                            num_tasks_by_status[Task::STATUS_ACTIVE];
+  int num_workers = max(num_tasks_by_status[Task::STATUS_ACTIVE], 1);
+  json job;
+  job["id"] = id;
+  job["time_remaining"] =
+      average_task_runtime * num_remaining_tasks / num_workers;
+  job["time_average"] = average_task_runtime;
+  job["time_total"] = total_task_runtime;
+  job["time_elapsed"] = time_elapsed;
+  job["job_name"] = name;
+  job["percentage_done"] =
+      num_tasks != 0
+          ? 100.0 * num_tasks_by_status[Task::STATUS_COMPLETED] / num_tasks
+          : 0.0;
+  static const char *status_names[] = {"waiting",
+                                       "active",
+                                       "completed",
+                                       "cancelled",
+                                       "paused",
+                                       "failed"};
+  job["status"] = status_names[status];
+  job["creation_date"] = "Creation Time";
+  job["date_edit"] = "Edit Time";
+  job["priority"] = priority;
+  job["manager"] = manager;
+  json tasks_status;
+  tasks_status["waiting"] = num_tasks_by_status[Task::STATUS_WAITING];
+  tasks_status["processing"] = num_tasks_by_status[Task::STATUS_PROCESSING];
+  tasks_status["active"] = num_tasks_by_status[Task::STATUS_ACTIVE];
+  tasks_status["completed"] = num_tasks_by_status[Task::STATUS_COMPLETED];
+  tasks_status["failed"] = num_tasks_by_status[Task::STATUS_FAILED];
+  job["tasks_status"] = tasks_status;
+  job["username"] = owner;
+  if(detail) {
+    json settings;
+    settings["frame_start"] = 0;
+    settings["frame_end"] = 250;
+    settings["chunk_size"] = 0;
+
+    /* TODO(sergey): This guys are to be unified in flamenco.*/
+    job["total_time"] = total_task_runtime;
+    job["average_time"] = average_task_runtime;
+
+    job["average_time_frame"] = 0;
+    job["tasks"] = "";
+    job["settings"] = settings;
+  }
+  return job;
+}
+
+FarmSnapshot::FarmSnapshot()
+    : version(0),
+      time(0.0) {
+}
+
+/* Get job by its ID. */
+const JobSnapshot *FarmSnapshot::job_by_id(int id) const {
+  vector<shared_ptr<const JobSnapshot> >::const_iterator it =
+      lower_bound(jobs.begin(), jobs.end(), id, job_snapshot_id_less);
+  if(it == jobs.end() || (*it)->id != id) {
+    return NULL;
+  }
+  return it->get();
+}
+
+}  /* namespace Farm */
@@ -0,0 +1,84 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef MODEL_SNAPSHOT_
+#define MODEL_SNAPSHOT_
+
+#include "model/model_job.h"
+#include "model/model_task.h"
+
+#include "util/util_json.h"
+#include "util/util_memory.h"
+#include "util/util_string.h"
+#include "util/util_vector.h"
+
+namespace Farm {
+
+/* Immutable copy of the job state shown to the users. */
+struct JobSnapshot {
+  JobSnapshot();
+
+  /* Copy state of the job, job's lock is to be held. */
+  explicit JobSnapshot(const Job& job);
+
+  /* Serialize the job into JSON, current_time is used for the elapsed
+   * time of the running job.
+   */
+  json serialize_json(double current_time, bool detail = false) const;
+
+  int id;
+  Job::Priority priority;
+  Job::Status status;
+  string name;
+  string owner;
+  int num_tasks;
+  int num_tasks_by_status[Task::NUM_STATUSES];
+  double total_task_runtime;
+  double average_task_runtime;
+  double start_time;
+  double finish_time;
+  /* Version of the job the snapshot was taken at. */
+  unsigned int version;
+};
+
+/* Immutable copy of the state of all the jobs of the farm.
+ *
+ * Snapshots are published by the farm and shared by the readers, so
+ * reading them never blocks the farm.
+ */
+struct FarmSnapshot {
+  FarmSnapshot();
+
+  /* Get job by its ID, NULL if there's no such job. */
+  const JobSnapshot *job_by_id(int id) const;
+
+  /* Version of the snapshot, increased with every publish. */
+  int version;
+  /* Time at which the snapshot was taken. */
+  double time;
+  /* Jobs sorted by their ID, jobs which didn't change between publishes
+   * share their snapshot.
+   */
+  vector<shared_ptr<const JobSnapshot> > jobs;
+};
+
+}  /* namespace Farm */
+
+#endif  /* MODEL_SNAPSHOT_ */
@@ -24,12 +24,14 @@ namespace Farm {
 
 Task::Task()
     : id_(-1),
-      status_(STATUS_WAITING) {
+      status_(STATUS_WAITING),
+      num_failures_(0) {
 }
 
 Task::Task(int id, Status status)
     : id_(id),
-      status_(status) {
+      status_(status),
+      num_failures_(0) {
 }
 
 /* Check whether the task is stll running. */
@@ -23,6 +23,10 @@
 
 namespace Farm {
 
+/* Tasks are stored by value in the task table of their job, so the class
+ * is kept small: 8 bytes per task. Lease of the active task is kept by the
+ * farm, only leased tasks pay for it.
+ */
 class Task {
  public:
   enum Status {
@@ -33,14 +37,24 @@ class Task {
     STATUS_FAILED,
   };
 
+  /* Number of values of Status. */
+  static const int NUM_STATUSES = STATUS_FAILED + 1;
+
   Task();
 
   Task(int id, Status status);
 
   inline int id() const { return id_; }
   inline void set_id(int id) { id_ = id; }
-  inline Status status() const { return status_; }
+  inline Status status() const { return (Status)status_; }
   inline void set_status(Status status) { status_ = status; }
+  /* Number of times the task failed, saturates at 255. */
+  inline int num_failures() const { return num_failures_; }
+  inline void add_failure() {
+    if(num_failures_ != 255) {
+      ++num_failures_;
+    }
+  }
 
   /* Check whether the task is stll running. */
   bool is_running();
@@ -48,8 +62,22 @@ class Task {
  protected:
   /* Unique ID of the task. */
   int id_;
-  /* Status of the task. */
-  Status status_;
+  /* Status of the task, one of Status values. */
+  unsigned char status_;
+  /* Failures so far, only kept in memory. Takes padding after the status
+   * so the task stays the same size.
+   */
+  unsigned char num_failures_;
+};
+
+/* Change of the task which is written to the storage. */
+struct TaskUpdate {
+  int id;
+  unsigned char status;
+  /* Time at which the worker's lease on the active task runs out, 0 if
+   * the task is not leased.
+   */
+  double lease_expire_time;
 };
 
 }  /* namespace Farm */
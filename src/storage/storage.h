@@ -23,12 +23,19 @@
 
 #include "model/model_job.h"
 #include "model/model_task.h"
+#include "util/util_map.h"
 #include "util/util_vector.h"
 
 namespace Farm {
 
 class Storage {
  public:
+  /* Kinds of IDs handed out by reserve_ids(). */
+  enum IDType {
+    ID_TYPE_JOB,
+    ID_TYPE_TASK,
+  };
+
   Storage() {}
 
   virtual ~Storage() {}
@@ -39,23 +46,86 @@ class Storage {
   /* Disconnect from the storage. */
   virtual bool disconnect() = 0;
 
-  /* Retrieve all jobs from the storage. */
+  /* Retrieve all jobs from the storage, including IDs of the jobs
+   * they depend on.
+   */
   virtual bool retrieve_all_jobs(vector<Job*> *all_jobs) = 0;
 
-  /* Retrieve all tasks of a given job from the storage. */
+  /* Retrieve all tasks of a given job from the storage, filling the
+   * task table in bulk.
+   */
   virtual bool retrieve_all_tasks(const Job& job,
-                                  vector<Task*> *all_tasks) = 0;
+                                  vector<Task> *all_tasks) = 0;
+
+  /* Retrieve lease expiration times of the leased tasks, by task ID. */
+  virtual bool retrieve_task_leases(
+      unordered_map<int, double> *lease_expire_times) = 0;
+
+  /* Retrieve ID of the job the task belongs to, -1 if there's no such
+   * task in the storage.
+   */
+  virtual int retrieve_task_job_id(int task_id) = 0;
+
+  /* Retrieve dependencies between tasks of a given job.
+   *
+   * Tasks of the job are to be retrieved already, dependencies are
+   * given by indices of the tasks.
+   */
+  virtual bool retrieve_task_dependencies(
+      const Job& job,
+      vector<Job::TaskDependency> *dependencies) = 0;
+
+  /* Retrieve tasks and task dependencies of all the given jobs at once,
+   * tasks of jobs[i] are put to (*all_tasks)[i] and their dependencies to
+   * (*all_dependencies)[i].
+   *
+   * Used by restore, so storages could read tasks in a single pass
+   * instead of doing a query per job. Storages which can't do that, or
+   * for which it's not worth it for the given jobs, return false and
+   * tasks are then retrieved job by job.
+   */
+  virtual bool retrieve_jobs_tasks(
+      const vector<Job*>& /*jobs*/,
+      vector<vector<Task> >* /*all_tasks*/,
+      vector<vector<Job::TaskDependency> >* /*all_dependencies*/) {
+    return false;
+  }
+
+  /* Reserve a block of consecutive IDs of the given type.
+   *
+   * Returns first ID of the block, -1 on failure. The reservation is
+   * persistent, so IDs of the block are never given out again, even
+   * after reconnect.
+   */
+  virtual int reserve_ids(IDType type, int num_ids) = 0;
 
   /* Insert new job into the database.
-   * Will take care of filling Job ID in,
+   *
+   * Job and tasks which already have IDs, normally taken from blocks
+   * given by reserve_ids(), are inserted with them. Otherwise storage
+   * will take care of filling IDs in.
    */
   virtual bool insert_job(Job *job) = 0;
 
   /* Update job in the stroage. */
-  virtual bool update_job(const Job& job) = 0;
+  virtual bool update_job(const JobUpdate& job) = 0;
+
+  /* Update multiple jobs in the storage at once. */
+  virtual bool update_jobs(const vector<JobUpdate>& jobs) {
+    bool ok = true;
+    for(int i = 0; i < jobs.size(); ++i) {
+      if(!update_job(jobs[i])) {
+        ok = false;
+      }
+    }
+    return ok;
+  }
 
   /* Update task in the stroage. */
-  virtual bool update_task(const Task& task) = 0;
+  virtual bool update_task(const TaskUpdate& task) = 0;
+
+  /* Update multiple tasks in the storage at once. */
+  virtual bool update_tasks(const vector<TaskUpdate>& tasks) = 0;
 
   /* Fliush caches to the actual storage. */
   virtual bool flush_caches(bool force = false) = 0;
@@ -0,0 +1,296 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "storage/storage_async.h"
+
+#include "util/util_foreach.h"
+#include "util/util_function.h"
+#include "util/util_logging.h"
+
+namespace Farm {
+
+AsyncStorage::AsyncStorage(Storage *storage)
+    : max_queued_updates(1024 * 1024),
+      storage_(storage),
+      num_queued_updates_(0),
+      num_written_updates_(0),
+      flush_requested_(false),
+      write_failed_(false),
+      stop_requested_(false),
+      writer_thread_(NULL) {
+}
+
+AsyncStorage::~AsyncStorage() {
+  if(writer_thread_ != NULL) {
+    disconnect();
+  }
+  delete storage_;
+}
+
+/* Start the writer thread. */
+bool AsyncStorage::connect() {
+  thread_scoped_lock queue_lock(queue_lock_);
+  if(writer_thread_ == NULL) {
+    stop_requested_ = false;
+    writer_thread_ = new thread(function_bind(&AsyncStorage::writer_run,
+                                              this));
+  }
+  return true;
+}
+
+/* Write queued updates, stop the writer and disconnect. */
+bool AsyncStorage::disconnect() {
+  thread *writer_thread;
+  {
+    thread_scoped_lock queue_lock(queue_lock_);
+    stop_requested_ = true;
+    writer_thread = writer_thread_;
+  }
+  if(writer_thread != NULL) {
+    queue_condition_.notify_one();
+    writer_thread->join();
+    delete writer_thread;
+    thread_scoped_lock queue_lock(queue_lock_);
+    writer_thread_ = NULL;
+  }
+  thread_scoped_lock storage_lock(storage_lock_);
+  return storage_->disconnect();
+}
+
+/* Retrieve all jobs from the storage. */
+bool AsyncStorage::retrieve_all_jobs(vector<Job*> *all_jobs) {
+  wait_written();
+  thread_scoped_lock storage_lock(storage_lock_);
+  return storage_->retrieve_all_jobs(all_jobs);
+}
+
+/* Retrieve all tasks of a given job from the storage. */
+bool AsyncStorage::retrieve_all_tasks(const Job& job,
+                                      vector<Task> *all_tasks) {
+  wait_written();
+  thread_scoped_lock storage_lock(storage_lock_);
+  return storage_->retrieve_all_tasks(job, all_tasks);
+}
+
+/* Retrieve lease expiration times of the leased tasks. */
+bool AsyncStorage::retrieve_task_leases(
+    unordered_map<int, double> *lease_expire_times) {
+  wait_written();
+  thread_scoped_lock storage_lock(storage_lock_);
+  return storage_->retrieve_task_leases(lease_expire_times);
+}
+
+/* Retrieve ID of the job the task belongs to. */
+int AsyncStorage::retrieve_task_job_id(int task_id) {
+  /* Tasks never move between jobs, so queued updates don't matter. */
+  thread_scoped_lock storage_lock(storage_lock_);
+  return storage_->retrieve_task_job_id(task_id);
+}
+
+/* Retrieve dependencies between tasks of a given job. */
+bool AsyncStorage::retrieve_task_dependencies(
+    const Job& job,
+    vector<Job::TaskDependency> *dependencies) {
+  wait_written();
+  thread_scoped_lock storage_lock(storage_lock_);
+  return storage_->retrieve_task_dependencies(job, dependencies);
+}
+
+/* Retrieve tasks and task dependencies of all the given jobs. */
+bool AsyncStorage::retrieve_jobs_tasks(
+    const vector<Job*>& jobs,
+    vector<vector<Task> > *all_tasks,
+    vector<vector<Job::TaskDependency> > *all_dependencies) {
+  wait_written();
+  thread_scoped_lock storage_lock(storage_lock_);
+  return storage_->retrieve_jobs_tasks(jobs, all_tasks, all_dependencies);
+}
+
+/* Reserve a block of consecutive IDs of the given type. */
+int AsyncStorage::reserve_ids(IDType type, int num_ids) {
+  /* Reservations don't depend on the queued updates. */
+  thread_scoped_lock storage_lock(storage_lock_);
+  return storage_->reserve_ids(type, num_ids);
+}
+
+/* Insert new job into the database. */
+bool AsyncStorage::insert_job(Job *job) {
+  /* Job is inserted directly, so it's in the storage before any of its
+   * updates. Queued updates are for other jobs, so there's no need to
+   * wait.
+   */
+  thread_scoped_lock storage_lock(storage_lock_);
+  return storage_->insert_job(job);
+}
+
+/* Queue update of the job. */
+bool AsyncStorage::update_job(const JobUpdate& job) {
+  thread_scoped_lock queue_lock(queue_lock_);
+  if(writer_thread_ == NULL) {
+    queue_lock.unlock();
+    thread_scoped_lock storage_lock(storage_lock_);
+    return storage_->update_job(job);
+  }
+  wait_queue_space(&queue_lock, 1);
+  queued_jobs_.push_back(job);
+  ++num_queued_updates_;
+  queue_lock.unlock();
+  queue_condition_.notify_one();
+  return true;
+}
+
+/* Queue update of multiple jobs. */
+bool AsyncStorage::update_jobs(const vector<JobUpdate>& jobs) {
+  thread_scoped_lock queue_lock(queue_lock_);
+  if(writer_thread_ == NULL) {
+    queue_lock.unlock();
+    thread_scoped_lock storage_lock(storage_lock_);
+    return storage_->update_jobs(jobs);
+  }
+  wait_queue_space(&queue_lock, jobs.size());
+  queued_jobs_.insert(queued_jobs_.end(), jobs.begin(), jobs.end());
+  num_queued_updates_ += jobs.size();
+  queue_lock.unlock();
+  queue_condition_.notify_one();
+  return true;
+}
+
+/* Queue update of the task. */
+bool AsyncStorage::update_task(const TaskUpdate& task) {
+  return update_tasks(vector<TaskUpdate>(1, task));
+}
+
+/* Queue update of multiple tasks. */
+bool AsyncStorage::update_tasks(const vector<TaskUpdate>& tasks) {
+  thread_scoped_lock queue_lock(queue_lock_);
+  if(writer_thread_ == NULL) {
+    queue_lock.unlock();
+    thread_scoped_lock storage_lock(storage_lock_);
+    return storage_->update_tasks(tasks);
+  }
+  wait_queue_space(&queue_lock, tasks.size());
+  queued_tasks_.insert(queued_tasks_.end(), tasks.begin(), tasks.end());
+  num_queued_updates_ += tasks.size();
+  queue_lock.unlock();
+  queue_condition_.notify_one();
+  return true;
+}
+
+/* Fliush caches to the actual storage. */
+bool AsyncStorage::flush_caches(bool force) {
+  if(!force) {
+    thread_scoped_lock queue_lock(queue_lock_);
+    if(writer_thread_ == NULL) {
+      queue_lock.unlock();
+      thread_scoped_lock storage_lock(storage_lock_);
+      return storage_->flush_caches(false);
+    }
+    flush_requested_ = true;
+    queue_lock.unlock();
+    queue_condition_.notify_one();
+    return true;
+  }
+  wait_written();
+  bool ok;
+  {
+    thread_scoped_lock storage_lock(storage_lock_);
+    ok = storage_->flush_caches(true);
+  }
+  thread_scoped_lock queue_lock(queue_lock_);
+  ok = ok && !write_failed_;
+  write_failed_ = false;
+  return ok;
+}
+
+/* Wait until there's room for the updates in the queue. */
+void AsyncStorage::wait_queue_space(thread_scoped_lock *queue_lock,
+                                    size_t num_updates) {
+  /* Updates which don't fit the queue at all are let into the empty one,
+   * so they don't wait forever.
+   */
+  while(writer_thread_ != NULL &&
+        !(queued_jobs_.empty() && queued_tasks_.empty()) &&
+        queued_jobs_.size() + queued_tasks_.size() + num_updates >
+            max_queued_updates) {
+    written_condition_.wait(*queue_lock);
+  }
+}
+
+/* Wait until all the updates queued so far are written. */
+void AsyncStorage::wait_written() {
+  thread_scoped_lock queue_lock(queue_lock_);
+  size_t num_updates = num_queued_updates_;
+  while(num_written_updates_ < num_updates) {
+    written_condition_.wait(queue_lock);
+  }
+}
+
+/* Write queued updates in groups. */
+void AsyncStorage::writer_run() {
+  VLOG(1) << "Storage writer thread started.";
+  thread_scoped_lock queue_lock(queue_lock_);
+  while(true) {
+    while(queued_jobs_.empty() &&
+          queued_tasks_.empty() &&
+          !flush_requested_ &&
+          !stop_requested_) {
+      queue_condition_.wait(queue_lock);
+    }
+    if(queued_jobs_.empty() &&
+       queued_tasks_.empty() &&
+       !flush_requested_) {
+      break;
+    }
+    /* Everything queued so far goes to the storage as one group. */
+    vector<JobUpdate> jobs;
+    vector<TaskUpdate> tasks;
+    jobs.swap(queued_jobs_);
+    tasks.swap(queued_tasks_);
+    size_t num_updates = num_queued_updates_;
+    flush_requested_ = false;
+    queue_lock.unlock();
+    written_condition_.notify_all();
+    bool ok = true;
+    {
+      thread_scoped_lock storage_lock(storage_lock_);
+      if(!jobs.empty() && !storage_->update_jobs(jobs)) {
+        ok = false;
+      }
+      if(!tasks.empty() && !storage_->update_tasks(tasks)) {
+        ok = false;
+      }
+      /* Storage commits its caches from here when it's time to. */
+      storage_->flush_caches();
+    }
+    if(!ok) {
+      LOG(ERROR) << "Failed to write " << jobs.size() + tasks.size()
+                 << " update(s) to the storage.";
+    }
+    queue_lock.lock();
+    num_written_updates_ = num_updates;
+    if(!ok) {
+      write_failed_ = true;
+    }
+    written_condition_.notify_all();
+  }
+  VLOG(1) << "Storage writer thread stopped.";
+}
+
+} /* namespace Farm */
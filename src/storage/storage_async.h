@@ -0,0 +1,163 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef STORAGE_ASYNC_H_
+#define STORAGE_ASYNC_H_
+
+#include "storage/storage.h"
+#include "util/util_string.h"
+#include "util/util_thread.h"
+#include "util/util_vector.h"
+
+namespace Farm {
+
+/* Storage which writes updates to another storage from a separate thread.
+ *
+ * Updates of jobs and tasks are put to a queue and return immediately,
+ * writer thread takes everything queued so far and writes it as a single
+ * group, so the caller never waits for the disk. Queue is bounded, when
+ * it's full updates wait for the writer to catch up.
+ *
+ * Reads and job inserts are done on the caller's thread, reads are only
+ * done once all the queued updates are written, so they see them. Forced
+ * flush is a durability barrier: it returns once everything queued before
+ * it is written and synced.
+ */
+class AsyncStorage : public Storage {
+ public:
+  /* Storage is to be connected already, it's owned by the async storage
+   * from now on.
+   */
+  explicit AsyncStorage(Storage *storage);
+
+  ~AsyncStorage();
+
+  /* Start the writer thread. */
+  bool connect();
+
+  /* Write all the queued updates, stop the writer thread and disconnect
+   * from the storage.
+   */
+  bool disconnect();
+
+  /* Retrieve all jobs from the storage. */
+  bool retrieve_all_jobs(vector<Job*> *all_jobs);
+
+  /* Retrieve all tasks of a given job from the storage. */
+  bool retrieve_all_tasks(const Job& job,
+                          vector<Task> *all_tasks);
+
+  /* Retrieve lease expiration times of the leased tasks. */
+  bool retrieve_task_leases(unordered_map<int, double> *lease_expire_times);
+
+  /* Retrieve ID of the job the task belongs to. */
+  int retrieve_task_job_id(int task_id);
+
+  /* Retrieve dependencies between tasks of a given job. */
+  bool retrieve_task_dependencies(const Job& job,
+                                  vector<Job::TaskDependency> *dependencies);
+
+  /* Retrieve tasks and task dependencies of all the given jobs. */
+  bool retrieve_jobs_tasks(
+      const vector<Job*>& jobs,
+      vector<vector<Task> > *all_tasks,
+      vector<vector<Job::TaskDependency> > *all_dependencies);
+
+  /* Reserve a block of consecutive IDs of the given type. */
+  int reserve_ids(IDType type, int num_ids);
+
+  /* Insert new job into the database. */
+  bool insert_job(Job *job);
+
+  /* Queue update of the job. */
+  bool update_job(const JobUpdate& job);
+
+  /* Queue update of multiple jobs. */
+  bool update_jobs(const vector<JobUpdate>& jobs);
+
+  /* Queue update of the task. */
+  bool update_task(const TaskUpdate& task);
+
+  /* Queue update of multiple tasks. */
+  bool update_tasks(const vector<TaskUpdate>& tasks);
+
+  /* Fliush caches to the actual storage.
+   *
+   * Without force it only wakes the writer up, so the storage could commit
+   * its caches from there. With force waits for all the queued updates to
+   * be written and synced. Returns false if any of the updates written
+   * since the previous forced flush failed.
+   */
+  bool flush_caches(bool force = false);
+
+  /* ** Performance parameters ** */
+
+  /* Number of queued updates after which new updates wait for the writer,
+   * so memory used by the queue is bounded when the disk can't keep up.
+   */
+  size_t max_queued_updates;
+
+ protected:
+  /* Wait until there's room for the given number of updates in the queue,
+   * queue lock is to be held.
+   */
+  void wait_queue_space(thread_scoped_lock *queue_lock, size_t num_updates);
+
+  /* Wait until all the updates queued so far are written. */
+  void wait_written();
+
+  /* Write queued updates in groups, runs in the writer thread. */
+  void writer_run();
+
+  /* Storage the updates are written to. */
+  Storage *storage_;
+  /* Lock serializing access to the storage from the writer thread and
+   * the callers.
+   */
+  thread_mutex storage_lock_;
+
+  /* Lock guarding the queue and the writer state below. */
+  thread_mutex queue_lock_;
+  /* Signalled when there's work for the writer. */
+  thread_condition_variable queue_condition_;
+  /* Signalled when queued updates are taken or written by the writer. */
+  thread_condition_variable written_condition_;
+  /* Updates which are not taken by the writer yet. */
+  vector<JobUpdate> queued_jobs_;
+  vector<TaskUpdate> queued_tasks_;
+  /* Total number of updates ever queued and written, the difference is
+   * what's still queued or is being written.
+   */
+  size_t num_queued_updates_;
+  size_t num_written_updates_;
+  /* Writer is asked to flush storage caches. */
+  bool flush_requested_;
+  /* Some write failed since the last forced flush. */
+  bool write_failed_;
+  /* Writer is asked to stop once the queue is empty. */
+  bool stop_requested_;
+
+  /* Thread which writes the updates, NULL if it's not running. */
+  thread *writer_thread_;
+};
+
+} /* namespace Farm */
+
+#endif  /* STORAGE_ASYNC_H_ */
@@ -23,8 +23,11 @@
 #include <cassert>
 
 #include "sqlite/sqlite3.h"
+#include "util/util_algorithm.h"
 #include "util/util_foreach.h"
 #include "util/util_logging.h"
+#include "util/util_map.h"
+#include "util/util_string.h"
 #include "util/util_time.h"
 
 /* Cofigure sqlite to b as fast as possible, need reliable back-UPSed
@@ -35,15 +38,98 @@
 
 namespace Farm {
 
+namespace {
+
+/* Restore scans the whole tasks table only when it needs tasks of at
+ * least this fraction of all jobs, otherwise tasks of the needed jobs are
+ * looked up with the job_id index. Lookup of a task with the index costs
+ * about as much as scanning two or three tasks.
+ */
+const int full_scan_jobs_fraction = 2;
+
+/* Number of rows inserted by a single multi-row INSERT, keeps number of
+ * the bound parameters below the SQLite's default limit of 999.
+ */
+const int insert_batch_size = 128;
+
+/* Placeholders of the given number of rows for the INSERT's VALUES. */
+string values_placeholders(int num_columns, int num_rows) {
+  string row = "(?";
+  for(int i = 1; i < num_columns; ++i) {
+    row += ", ?";
+  }
+  row += ")";
+  string values = row;
+  for(int i = 1; i < num_rows; ++i) {
+    values += ", " + row;
+  }
+  return values;
+}
+
+/* Columns of the jobs table with number of tasks of the job with every
+ * status, so the counts are known without reading the tasks.
+ */
+const char *task_count_columns[Task::NUM_STATUSES] = {
+  "num_waiting_tasks",
+  "num_processing_tasks",
+  "num_active_tasks",
+  "num_completed_tasks",
+  "num_failed_tasks",
+};
+
+/* List of the task count columns, every one followed by the suffix. */
+string task_count_columns_list(const string& suffix) {
+  string columns;
+  for(int status = 0; status < Task::NUM_STATUSES; ++status) {
+    columns += string(", ") + task_count_columns[status] + suffix;
+  }
+  return columns;
+}
+
+bool task_id_less(const Task& task, int id) {
+  return task.id() < id;
+}
+
+/* Index of the task with given ID in the sorted by ID tasks, or -1. */
+int task_index_by_id(const vector<Task>& tasks, int id) {
+  vector<Task>::const_iterator it =
+      lower_bound(tasks.begin(), tasks.end(), id, task_id_less);
+  if(it == tasks.end() || it->id() != id) {
+    return -1;
+  }
+  return it - tasks.begin();
+}
+
+}  /* namespace */
+
 SQLiteStorage::SQLiteStorage(string filename)
     : filename_(filename),
       database_(NULL),
       has_open_transaction_(false),
+      transaction_open_timestamp_(0.0),
       select_all_jobs_statement_(NULL),
       select_job_tasks_statement_(NULL),
+      select_task_job_id_statement_(NULL),
       insert_job_statement_(NULL),
       insert_task_statement_(NULL),
-      update_task_statement_(NULL) {
+      update_task_statement_(NULL),
+      select_all_job_dependencies_statement_(NULL),
+      select_job_task_dependencies_statement_(NULL),
+      insert_job_dependency_statement_(NULL),
+      insert_task_dependency_statement_(NULL),
+      select_num_jobs_statement_(NULL),
+      select_all_tasks_statement_(NULL),
+      select_all_task_dependencies_statement_(NULL),
+      select_max_job_id_statement_(NULL),
+      select_max_task_id_statement_(NULL),
+      insert_tasks_batch_statement_(NULL),
+      insert_task_dependencies_batch_statement_(NULL),
+      select_next_id_statement_(NULL),
+      update_next_id_statement_(NULL),
+      select_task_leases_statement_(NULL),
+      insert_restore_job_statement_(NULL),
+      select_restore_tasks_statement_(NULL),
+      select_restore_task_dependencies_statement_(NULL) {
   VLOG(1) << "Using SQLite version " << sqlite3_libversion();
   /* Those are tweakable performance parameters.
    * By default we do maximum reliability.
@@ -58,25 +144,125 @@ bool SQLiteStorage::create_schema() {
                "id INTEGER PRIMARY KEY ASC, "
                "priority INT, "
                "status INT, "
-               "name TEXT_);");
+               "name TEXT_, "
+               "owner TEXT" + task_count_columns_list(" INT") + ");");
   sql_exec("CREATE TABLE IF NOT EXISTS tasks("
                "id INTEGER PRIMARY KEY ASC, "
                "job_id INT, "
-               "status INT);");
+               "status INT, "
+               "lease_expire REAL);");
+  sql_exec("CREATE TABLE IF NOT EXISTS job_dependencies("
+               "job_id INT, "
+               "depends_on INT);");
+  sql_exec("CREATE TABLE IF NOT EXISTS task_dependencies("
+               "job_id INT, "
+               "task_id INT, "
+               "depends_on INT);");
+  sql_exec("CREATE TABLE IF NOT EXISTS id_blocks("
+               "type INTEGER PRIMARY KEY, "
+               "next_id INT);");
+  sql_exec("CREATE INDEX IF NOT EXISTS tasks_job_id ON tasks(job_id);");
+  sql_exec("CREATE INDEX IF NOT EXISTS task_dependencies_job_id "
+               "ON task_dependencies(job_id);");
+
+  /* Columns added after the initial schema. */
+  sql_add_column("jobs", "owner", "TEXT DEFAULT ''");
+  sql_add_column("tasks", "lease_expire", "REAL DEFAULT 0");
+  /* Only active tasks are leased, index them so the leases are found
+   * without scanning all the tasks.
+   */
+  sql_exec("CREATE INDEX IF NOT EXISTS tasks_leased ON tasks(lease_expire) "
+               "WHERE lease_expire != 0;");
+  for(int status = 0; status < Task::NUM_STATUSES; ++status) {
+    sql_add_column("jobs", task_count_columns[status], "INT");
+  }
+  /* Counts of the jobs stored by older versions are taken from their
+   * tasks once.
+   */
+  string count_tasks;
+  for(int status = 0; status < Task::NUM_STATUSES; ++status) {
+    count_tasks += string(status == 0 ? "" : ", ") +
+                   task_count_columns[status] +
+                   string_printf("=(SELECT COUNT(*) FROM tasks "
+                                 "WHERE job_id=jobs.id AND status=%d)",
+                                 status);
+  }
+  sql_exec("UPDATE jobs SET " + count_tasks + " WHERE " +
+           task_count_columns[0] + " IS NULL;");
+  /* IDs of the jobs which tasks are restored, only lives as long as the
+   * connection.
+   */
+  sql_exec("CREATE TEMP TABLE IF NOT EXISTS restore_jobs("
+               "id INTEGER PRIMARY KEY);");
 
   /* Prepare statements, */
   select_all_jobs_statement_ =
-        sql_prepare("SELECT id, priority, status, name FROM jobs");
+        sql_prepare("SELECT id, priority, status, name, owner" +
+                    task_count_columns_list("") + " FROM jobs");
   select_job_tasks_statement_ =
         sql_prepare("SELECT id, status FROM tasks WHERE job_id=?");
+  select_task_job_id_statement_ =
+        sql_prepare("SELECT job_id FROM tasks WHERE id=?");
   insert_job_statement_ =
-        sql_prepare("INSERT INTO jobs VALUES(NULL, ?, ?, ?)");
+        sql_prepare("INSERT INTO jobs(id, priority, status, name, owner" +
+                    task_count_columns_list("") + ") VALUES" +
+                    values_placeholders(5 + Task::NUM_STATUSES, 1));
   insert_task_statement_ =
-        sql_prepare("INSERT INTO tasks VALUES(NULL, ?, ?)");
+        sql_prepare("INSERT INTO tasks(id, job_id, status, lease_expire) "
+                    "VALUES(?, ?, ?, ?)");
   update_job_statement_ =
-        sql_prepare("UPDATE jobs SET priority=?, status=?, name=? WHERE id=?");
+        sql_prepare("UPDATE jobs SET priority=?, status=?, name=?, owner=?" +
+                    task_count_columns_list("=?") + " WHERE id=?");
   update_task_statement_ =
-        sql_prepare("UPDATE tasks SET status=? WHERE id=?");
+        sql_prepare("UPDATE tasks SET status=?, lease_expire=? WHERE id=?");
+  select_all_job_dependencies_statement_ =
+        sql_prepare("SELECT job_id, depends_on FROM job_dependencies");
+  select_job_task_dependencies_statement_ =
+        sql_prepare("SELECT task_id, depends_on FROM task_dependencies "
+                    "WHERE job_id=?");
+  insert_job_dependency_statement_ =
+        sql_prepare("INSERT INTO job_dependencies VALUES(?, ?)");
+  insert_task_dependency_statement_ =
+        sql_prepare("INSERT INTO task_dependencies VALUES(?, ?, ?)");
+  select_num_jobs_statement_ =
+        sql_prepare("SELECT COUNT(*) FROM jobs");
+  select_all_tasks_statement_ =
+        sql_prepare("SELECT id, job_id, status FROM tasks ORDER BY id");
+  select_all_task_dependencies_statement_ =
+        sql_prepare("SELECT job_id, task_id, depends_on "
+                    "FROM task_dependencies");
+  select_max_job_id_statement_ =
+        sql_prepare("SELECT MAX(id) FROM jobs");
+  select_max_task_id_statement_ =
+        sql_prepare("SELECT MAX(id) FROM tasks");
+  insert_tasks_batch_statement_ =
+        sql_prepare("INSERT INTO tasks(id, job_id, status, lease_expire) "
+                    "VALUES" + values_placeholders(4, insert_batch_size));
+  insert_task_dependencies_batch_statement_ =
+        sql_prepare("INSERT INTO task_dependencies VALUES" +
+                    values_placeholders(3, insert_batch_size));
+  select_next_id_statement_ =
+        sql_prepare("SELECT next_id FROM id_blocks WHERE type=?");
+  update_next_id_statement_ =
+        sql_prepare("INSERT OR REPLACE INTO id_blocks(type, next_id) "
+                    "VALUES(?, ?)");
+  select_task_leases_statement_ =
+        sql_prepare("SELECT id, lease_expire FROM tasks "
+                    "WHERE lease_expire != 0");
+  insert_restore_job_statement_ =
+        sql_prepare("INSERT INTO restore_jobs(id) VALUES(?)");
+  /* CROSS JOIN keeps the restored jobs in the outer loop, so only their
+   * tasks are read and they come in the order of the index.
+   */
+  select_restore_tasks_statement_ =
+        sql_prepare("SELECT tasks.id, tasks.job_id, tasks.status "
+                    "FROM restore_jobs CROSS JOIN tasks "
+                    "ON tasks.job_id=restore_jobs.id "
+                    "ORDER BY restore_jobs.id, tasks.id");
+  select_restore_task_dependencies_statement_ =
+        sql_prepare("SELECT task_dependencies.job_id, task_id, depends_on "
+                    "FROM restore_jobs CROSS JOIN task_dependencies "
+                    "ON task_dependencies.job_id=restore_jobs.id");
 
   return true;
 }
@@ -115,10 +301,28 @@ bool SQLiteStorage::disconnect() {
   transaction_commit_pending(true);
   sqlite3_finalize(select_all_jobs_statement_);
   sqlite3_finalize(select_job_tasks_statement_);
+  sqlite3_finalize(select_task_job_id_statement_);
   sqlite3_finalize(insert_job_statement_);
   sqlite3_finalize(insert_task_statement_);
   sqlite3_finalize(update_job_statement_);
   sqlite3_finalize(update_task_statement_);
+  sqlite3_finalize(select_all_job_dependencies_statement_);
+  sqlite3_finalize(select_job_task_dependencies_statement_);
+  sqlite3_finalize(insert_job_dependency_statement_);
+  sqlite3_finalize(insert_task_dependency_statement_);
+  sqlite3_finalize(select_num_jobs_statement_);
+  sqlite3_finalize(select_all_tasks_statement_);
+  sqlite3_finalize(select_all_task_dependencies_statement_);
+  sqlite3_finalize(select_max_job_id_statement_);
+  sqlite3_finalize(select_max_task_id_statement_);
+  sqlite3_finalize(insert_tasks_batch_statement_);
+  sqlite3_finalize(insert_task_dependencies_batch_statement_);
+  sqlite3_finalize(select_next_id_statement_);
+  sqlite3_finalize(update_next_id_statement_);
+  sqlite3_finalize(select_task_leases_statement_);
+  sqlite3_finalize(insert_restore_job_statement_);
+  sqlite3_finalize(select_restore_tasks_statement_);
+  sqlite3_finalize(select_restore_task_dependencies_statement_);
   sqlite3_close(database_);
   return true;
 }
@@ -135,16 +339,42 @@ bool SQLiteStorage::retrieve_all_jobs(vector<Job*> *all_jobs) {
           (Job::Status)sqlite3_column_int(select_all_jobs_statement_, 2);
     const char *name =
           (const char*)sqlite3_column_text(select_all_jobs_statement_, 3);
-    Job *new_job = new Job(id, priority, status, name);
+    const char *owner =
+          (const char*)sqlite3_column_text(select_all_jobs_statement_, 4);
+    Job *new_job = new Job(id, priority, status, name, owner ? owner : "");
+    /* Tasks of most of the jobs are not loaded, so their counts are only
+     * known from here.
+     */
+    for(int task_status = 0;
+        task_status < Task::NUM_STATUSES;
+        ++task_status) {
+      new_job->set_num_tasks_with_status(
+          (Task::Status)task_status,
+          sqlite3_column_int(select_all_jobs_statement_, 5 + task_status));
+    }
     all_jobs->push_back(new_job);
   }
   sqlite3_reset(select_all_jobs_statement_);
+  unordered_map<int, Job*> jobs_by_id;
+  foreach(Job *job, *all_jobs) {
+    jobs_by_id[job->id()] = job;
+  }
+  sqlite3_stmt *statement = select_all_job_dependencies_statement_;
+  while((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+    int job_id = sqlite3_column_int(statement, 0);
+    int depends_on = sqlite3_column_int(statement, 1);
+    unordered_map<int, Job*>::iterator it = jobs_by_id.find(job_id);
+    if(it != jobs_by_id.end()) {
+      it->second->add_job_dependency(depends_on);
+    }
+  }
+  sqlite3_reset(statement);
   return true;
 }
 
 /* Retrieve all tasks of a given job from the storage. */
 bool SQLiteStorage::retrieve_all_tasks(const Job& job,
-                                       vector<Task*> *all_tasks) {
+                                       vector<Task> *all_tasks) {
   int rc;
   all_tasks->clear();
   sqlite3_bind_int(select_job_tasks_statement_, 1, job.id());
@@ -152,65 +382,422 @@ bool SQLiteStorage::retrieve_all_tasks(const Job& job,
     int id = sqlite3_column_int(select_job_tasks_statement_, 0);
     Task::Status status =
           (Task::Status)sqlite3_column_int(select_job_tasks_statement_, 1);
-    Task *new_task = new Task(id, status);
-    all_tasks->push_back(new_task);
+    all_tasks->push_back(Task(id, status));
   }
   sqlite3_reset(select_job_tasks_statement_);
   return true;
 }
 
+/* Retrieve lease expiration times of the leased tasks. */
+bool SQLiteStorage::retrieve_task_leases(
+    unordered_map<int, double> *lease_expire_times) {
+  int rc;
+  lease_expire_times->clear();
+  while((rc = sqlite3_step(select_task_leases_statement_)) == SQLITE_ROW) {
+    int id = sqlite3_column_int(select_task_leases_statement_, 0);
+    (*lease_expire_times)[id] =
+          sqlite3_column_double(select_task_leases_statement_, 1);
+  }
+  sqlite3_reset(select_task_leases_statement_);
+  return true;
+}
+
+/* Retrieve ID of the job the task belongs to. */
+int SQLiteStorage::retrieve_task_job_id(int task_id) {
+  int job_id = -1;
+  sqlite3_bind_int(select_task_job_id_statement_, 1, task_id);
+  if(sqlite3_step(select_task_job_id_statement_) == SQLITE_ROW) {
+    job_id = sqlite3_column_int(select_task_job_id_statement_, 0);
+  }
+  sqlite3_reset(select_task_job_id_statement_);
+  return job_id;
+}
+
+/* Retrieve dependencies between tasks of a given job. */
+bool SQLiteStorage::retrieve_task_dependencies(
+    const Job& job,
+    vector<Job::TaskDependency> *dependencies) {
+  int rc;
+  dependencies->clear();
+  unordered_map<int, int> task_index_by_id;
+  const vector<Task>& tasks = job.tasks();
+  for(int i = 0; i < tasks.size(); ++i) {
+    task_index_by_id[tasks[i].id()] = i;
+  }
+  sqlite3_stmt *statement = select_job_task_dependencies_statement_;
+  sqlite3_bind_int(statement, 1, job.id());
+  while((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+    int task_id = sqlite3_column_int(statement, 0);
+    int depends_on_id = sqlite3_column_int(statement, 1);
+    if(task_index_by_id.count(task_id) == 0 ||
+       task_index_by_id.count(depends_on_id) == 0) {
+      LOG(WARNING) << "Ignoring dependency of task " << task_id
+                   << " on unknown task " << depends_on_id << ".";
+      continue;
+    }
+    Job::TaskDependency dependency = {task_index_by_id[task_id],
+                                      task_index_by_id[depends_on_id]};
+    dependencies->push_back(dependency);
+  }
+  sqlite3_reset(statement);
+  return true;
+}
+
+/* Retrieve tasks and task dependencies of all the given jobs. */
+bool SQLiteStorage::retrieve_jobs_tasks(
+    const vector<Job*>& jobs,
+    vector<vector<Task> > *all_tasks,
+    vector<vector<Job::TaskDependency> > *all_dependencies) {
+  int rc;
+  int num_jobs = 0;
+  if(sqlite3_step(select_num_jobs_statement_) == SQLITE_ROW) {
+    num_jobs = sqlite3_column_int(select_num_jobs_statement_, 0);
+  }
+  sqlite3_reset(select_num_jobs_statement_);
+  if(jobs.empty()) {
+    return false;
+  }
+  sqlite3_stmt *tasks_statement = select_all_tasks_statement_;
+  sqlite3_stmt *dependencies_statement =
+      select_all_task_dependencies_statement_;
+  if(jobs.size() * full_scan_jobs_fraction < num_jobs) {
+    /* Most of the tasks belong to the jobs which are not restored, so
+     * the needed jobs are joined with the tasks instead.
+     */
+    sql_exec("SAVEPOINT restore_jobs");
+    sql_exec("DELETE FROM restore_jobs");
+    foreach(const Job *job, jobs) {
+      sqlite3_bind_int(insert_restore_job_statement_, 1, job->id());
+      if(!sql_exec_prepared(insert_restore_job_statement_)) {
+        sql_exec("ROLLBACK TO restore_jobs");
+        sql_exec("RELEASE restore_jobs");
+        return false;
+      }
+    }
+    sql_exec("RELEASE restore_jobs");
+    tasks_statement = select_restore_tasks_statement_;
+    dependencies_statement = select_restore_task_dependencies_statement_;
+  }
+  /* Map job IDs to indices in the requested jobs. */
+  int max_job_id = 0;
+  foreach(const Job *job, jobs) {
+    max_job_id = max(max_job_id, job->id());
+  }
+  vector<int> job_index_by_id(max_job_id + 1, -1);
+  for(int i = 0; i < jobs.size(); ++i) {
+    job_index_by_id[jobs[i]->id()] = i;
+  }
+  all_tasks->clear();
+  all_tasks->resize(jobs.size());
+  all_dependencies->clear();
+  all_dependencies->resize(jobs.size());
+  /* Tasks of every job come in the order of their IDs. Tasks of a job
+   * are usually inserted together, so give back unused capacity once the
+   * scan moves on to the next job, this way memory is reused while tables
+   * are growing.
+   */
+  int last_job_index = -1;
+  sqlite3_stmt *statement = tasks_statement;
+  while((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+    int job_id = sqlite3_column_int(statement, 1);
+    if(job_id < 0 || job_id > max_job_id || job_index_by_id[job_id] == -1) {
+      continue;
+    }
+    int job_index = job_index_by_id[job_id];
+    if(job_index != last_job_index && last_job_index != -1) {
+      (*all_tasks)[last_job_index].shrink_to_fit();
+    }
+    last_job_index = job_index;
+    int id = sqlite3_column_int(statement, 0);
+    Task::Status status = (Task::Status)sqlite3_column_int(statement, 2);
+    (*all_tasks)[job_index].push_back(Task(id, status));
+  }
+  sqlite3_reset(statement);
+  if(last_job_index != -1) {
+    (*all_tasks)[last_job_index].shrink_to_fit();
+  }
+  statement = dependencies_statement;
+  while((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+    int job_id = sqlite3_column_int(statement, 0);
+    if(job_id < 0 || job_id > max_job_id || job_index_by_id[job_id] == -1) {
+      continue;
+    }
+    int job_index = job_index_by_id[job_id];
+    int task_id = sqlite3_column_int(statement, 1);
+    int depends_on_id = sqlite3_column_int(statement, 2);
+    const vector<Task>& tasks = (*all_tasks)[job_index];
+    int task_index = task_index_by_id(tasks, task_id),
+        depends_on_index = task_index_by_id(tasks, depends_on_id);
+    if(task_index == -1 || depends_on_index == -1) {
+      LOG(WARNING) << "Ignoring dependency of task " << task_id
+                   << " on unknown task " << depends_on_id << ".";
+      continue;
+    }
+    Job::TaskDependency dependency = {task_index, depends_on_index};
+    (*all_dependencies)[job_index].push_back(dependency);
+  }
+  sqlite3_reset(statement);
+  return true;
+}
+
+/* Reserve a block of consecutive IDs of the given type. */
+int SQLiteStorage::reserve_ids(IDType type, int num_ids) {
+  /* Rows inserted by older versions are not covered by the stored
+   * blocks, so the block also starts past the max ID in use.
+   */
+  sqlite3_stmt *select_max_id_statement = (type == ID_TYPE_JOB)
+      ? select_max_job_id_statement_
+      : select_max_task_id_statement_;
+  int first_id = 1;
+  if(sqlite3_step(select_max_id_statement) == SQLITE_ROW) {
+    first_id = sqlite3_column_int(select_max_id_statement, 0) + 1;
+  }
+  sqlite3_reset(select_max_id_statement);
+  sqlite3_bind_int(select_next_id_statement_, 1, type);
+  if(sqlite3_step(select_next_id_statement_) == SQLITE_ROW) {
+    first_id = max(first_id,
+                   sqlite3_column_int(select_next_id_statement_, 0));
+  }
+  sqlite3_reset(select_next_id_statement_);
+  /* With bulked transactions the reservation is committed together with
+   * or before the rows which use the reserved IDs.
+   */
+  transaction_begin_pending();
+  sqlite3_bind_int(update_next_id_statement_, 1, type);
+  sqlite3_bind_int(update_next_id_statement_, 2, first_id + num_ids);
+  if(!sql_exec_prepared(update_next_id_statement_)) {
+    return -1;
+  }
+  return first_id;
+}
+
 /* Insert new job into the database. */
 bool SQLiteStorage::insert_job(Job *job) {
   VLOG(1) << "Inserting new job: " << job->name() << ".";
-  /* Force apply all the pending transactions. */
-  transaction_commit_pending(true);
-  sqlite3_bind_int(insert_job_statement_, 1, job->priority());
-  sqlite3_bind_int(insert_job_statement_, 2, job->status());
-  sqlite3_bind_text(insert_job_statement_, 3,
+  /* IDs which are not given by the caller are reserved here, so they
+   * don't collide with the blocks reserved by the caller.
+   */
+  if(job->id() == -1) {
+    int job_id = reserve_ids(ID_TYPE_JOB, 1);
+    if(job_id == -1) {
+      return false;
+    }
+    job->set_id(job_id);
+  }
+  vector<Task> &tasks = job->tasks();
+  if(!tasks.empty() && tasks[0].id() == -1) {
+    int first_task_id = reserve_ids(ID_TYPE_TASK, tasks.size());
+    if(first_task_id == -1) {
+      return false;
+    }
+    for(int i = 0; i < tasks.size(); ++i) {
+      tasks[i].set_id(first_task_id + i);
+    }
+  }
+  /* With bulked transactions the job goes to the pending transaction,
+   * so it doesn't force commit of the unrelated pending updates. Savepoint
+   * makes sure partially inserted job is not left there.
+   */
+  bool own_transaction = false;
+  if(use_bulked_transactions) {
+    transaction_begin_pending();
+    sql_exec("SAVEPOINT insert_job");
+  } else {
+    transaction_begin();
+    own_transaction = true;
+  }
+  if(!insert_job_rows(job)) {
+    if(own_transaction) {
+      transaction_rollback();
+    } else {
+      sql_exec("ROLLBACK TO insert_job");
+      sql_exec("RELEASE insert_job");
+    }
+    return false;
+  }
+  if(own_transaction) {
+    transaction_commit();
+  } else {
+    sql_exec("RELEASE insert_job");
+  }
+  return true;
+}
+
+/* Insert rows of the job, its tasks and dependencies. */
+bool SQLiteStorage::insert_job_rows(Job *job) {
+  sqlite3_bind_int(insert_job_statement_, 1, job->id());
+  sqlite3_bind_int(insert_job_statement_, 2, job->priority());
+  sqlite3_bind_int(insert_job_statement_, 3, job->status());
+  sqlite3_bind_text(insert_job_statement_, 4,
                     job->name().c_str(),
                     job->name().size(),
                     SQLITE_TRANSIENT);
-  transaction_begin();
+  sqlite3_bind_text(insert_job_statement_, 5,
+                    job->owner().c_str(),
+                    job->owner().size(),
+                    SQLITE_TRANSIENT);
+  for(int status = 0; status < Task::NUM_STATUSES; ++status) {
+    sqlite3_bind_int(insert_job_statement_,
+                     6 + status,
+                     job->num_tasks_with_status((Task::Status)status));
+  }
   if(!sql_exec_prepared(insert_job_statement_)) {
-    transaction_rollback();
     return false;
   }
-  job->set_id(sqlite3_last_insert_rowid(database_));
-  vector<Task*> &tasks = job->tasks();
-  foreach(Task *task, tasks) {
-    sqlite3_bind_int(insert_task_statement_, 1, job->id());
-    sqlite3_bind_int(insert_task_statement_, 2, task->status());
+  /* IDs of the tasks are known up front, so they're inserted in batches
+   * without reading back ID of every inserted row.
+   */
+  const vector<Task> &tasks = job->tasks();
+  int num_tasks = tasks.size(), i = 0;
+  for(; i + insert_batch_size <= num_tasks; i += insert_batch_size) {
+    for(int j = 0; j < insert_batch_size; ++j) {
+      const Task& task = tasks[i + j];
+      sqlite3_bind_int(insert_tasks_batch_statement_, j * 4 + 1, task.id());
+      sqlite3_bind_int(insert_tasks_batch_statement_, j * 4 + 2, job->id());
+      sqlite3_bind_int(insert_tasks_batch_statement_,
+                       j * 4 + 3,
+                       task.status());
+      sqlite3_bind_double(insert_tasks_batch_statement_, j * 4 + 4, 0.0);
+    }
+    if(!sql_exec_prepared(insert_tasks_batch_statement_)) {
+      return false;
+    }
+  }
+  for(; i < num_tasks; ++i) {
+    const Task& task = tasks[i];
+    sqlite3_bind_int(insert_task_statement_, 1, task.id());
+    sqlite3_bind_int(insert_task_statement_, 2, job->id());
+    sqlite3_bind_int(insert_task_statement_, 3, task.status());
+    sqlite3_bind_double(insert_task_statement_, 4, 0.0);
     if(!sql_exec_prepared(insert_task_statement_)) {
-      transaction_rollback();
       return false;
     }
-    task->set_id(sqlite3_last_insert_rowid(database_));
   }
-  transaction_commit();
+  foreach(int depends_on, job->job_dependencies()) {
+    sqlite3_bind_int(insert_job_dependency_statement_, 1, job->id());
+    sqlite3_bind_int(insert_job_dependency_statement_, 2, depends_on);
+    if(!sql_exec_prepared(insert_job_dependency_statement_)) {
+      return false;
+    }
+  }
+  vector<Job::TaskDependency> dependencies = job->task_dependencies();
+  int num_dependencies = dependencies.size();
+  i = 0;
+  for(; i + insert_batch_size <= num_dependencies; i += insert_batch_size) {
+    for(int j = 0; j < insert_batch_size; ++j) {
+      const Job::TaskDependency& dependency = dependencies[i + j];
+      sqlite3_bind_int(insert_task_dependencies_batch_statement_,
+                       j * 3 + 1,
+                       job->id());
+      sqlite3_bind_int(insert_task_dependencies_batch_statement_,
+                       j * 3 + 2,
+                       tasks[dependency.task].id());
+      sqlite3_bind_int(insert_task_dependencies_batch_statement_,
+                       j * 3 + 3,
+                       tasks[dependency.depends_on].id());
+    }
+    if(!sql_exec_prepared(insert_task_dependencies_batch_statement_)) {
+      return false;
+    }
+  }
+  for(; i < num_dependencies; ++i) {
+    const Job::TaskDependency& dependency = dependencies[i];
+    sqlite3_bind_int(insert_task_dependency_statement_, 1, job->id());
+    sqlite3_bind_int(insert_task_dependency_statement_,
+                     2,
+                     tasks[dependency.task].id());
+    sqlite3_bind_int(insert_task_dependency_statement_,
+                     3,
+                     tasks[dependency.depends_on].id());
+    if(!sql_exec_prepared(insert_task_dependency_statement_)) {
+      return false;
+    }
+  }
   return true;
 }
 
 /* Update job in the stroage. */
-bool SQLiteStorage::update_job(const Job& job) {
-  sqlite3_bind_int(update_job_statement_, 1, job.priority());
-  sqlite3_bind_int(update_job_statement_, 2, job.status());
+bool SQLiteStorage::update_job(const JobUpdate& job) {
+  sqlite3_bind_int(update_job_statement_, 1, job.priority);
+  sqlite3_bind_int(update_job_statement_, 2, job.status);
   sqlite3_bind_text(update_job_statement_, 3,
-                    job.name().c_str(),
-                    job.name().size(),
+                    job.name.c_str(),
+                    job.name.size(),
                     SQLITE_TRANSIENT);
-  sqlite3_bind_int(update_job_statement_, 4, job.id());
+  sqlite3_bind_text(update_job_statement_, 4,
+                    job.owner.c_str(),
+                    job.owner.size(),
+                    SQLITE_TRANSIENT);
+  for(int status = 0; status < Task::NUM_STATUSES; ++status) {
+    sqlite3_bind_int(update_job_statement_,
+                     5 + status,
+                     job.num_tasks_by_status[status]);
+  }
+  sqlite3_bind_int(update_job_statement_, 5 + Task::NUM_STATUSES, job.id);
   return sql_exec_prepared(update_job_statement_);
 }
 
+/* Update multiple jobs in the storage at once. */
+bool SQLiteStorage::update_jobs(const vector<JobUpdate>& jobs) {
+  /* Make sure all the updates are going to the same transaction. */
+  bool own_transaction = false;
+  if(use_bulked_transactions) {
+    transaction_begin_pending();
+  } else {
+    transaction_begin();
+    own_transaction = true;
+  }
+  foreach(const JobUpdate& job, jobs) {
+    if(!update_job(job)) {
+      if(own_transaction) {
+        transaction_rollback();
+      }
+      return false;
+    }
+  }
+  if(own_transaction) {
+    transaction_commit();
+  }
+  return true;
+}
+
 /* Update task in the stroage. */
-bool SQLiteStorage::update_task(const Task& task) {
+bool SQLiteStorage::update_task(const TaskUpdate& task) {
   transaction_begin_pending();
-  sqlite3_bind_int(update_task_statement_, 1, task.status());
-  sqlite3_bind_int(update_task_statement_, 2, task.id());
+  sqlite3_bind_int(update_task_statement_, 1, task.status);
+  sqlite3_bind_double(update_task_statement_, 2, task.lease_expire_time);
+  sqlite3_bind_int(update_task_statement_, 3, task.id);
   return sql_exec_prepared(update_task_statement_);
   transaction_commit_pending();
 }
 
+/* Update multiple tasks in the storage at once. */
+bool SQLiteStorage::update_tasks(const vector<TaskUpdate>& tasks) {
+  /* Make sure all the updates are going to the same transaction. */
+  bool own_transaction = false;
+  if(use_bulked_transactions) {
+    transaction_begin_pending();
+  } else {
+    transaction_begin();
+    own_transaction = true;
+  }
+  foreach(const TaskUpdate& task, tasks) {
+    sqlite3_bind_int(update_task_statement_, 1, task.status);
+    sqlite3_bind_double(update_task_statement_, 2, task.lease_expire_time);
+    sqlite3_bind_int(update_task_statement_, 3, task.id);
+    if(!sql_exec_prepared(update_task_statement_)) {
+      if(own_transaction) {
+        transaction_rollback();
+      }
+      return false;
+    }
+  }
+  if(own_transaction) {
+    transaction_commit();
+  }
+  return true;
+}
+
 /* Fliush caches to the actual storage. */
 bool SQLiteStorage::flush_caches(bool force) {
   transaction_commit_pending(force);
@@ -287,6 +874,26 @@ bool SQLiteStorage::sql_exec(string sql) {
   return true;
 }
 
+bool SQLiteStorage::sql_add_column(string table,
+                                   string column,
+                                   string definition) {
+  /* Column exists if a statement which is using it could be prepared. */
+  string select = "SELECT " + column + " FROM " + table;
+  sqlite3_stmt *statement;
+  int rc = sqlite3_prepare(database_,
+                           select.c_str(),
+                           select.size(),
+                           &statement,
+                           NULL);
+  if(rc == SQLITE_OK) {
+    sqlite3_finalize(statement);
+    return true;
+  }
+  VLOG(1) << "Adding column " << column << " to table " << table << ".";
+  return sql_exec("ALTER TABLE " + table + " ADD COLUMN " +
+                  column + " " + definition);
+}
+
 bool SQLiteStorage::sql_exec_prepared(sqlite3_stmt *statement) {
   int rc = sqlite3_step(statement);
   if(rc != SQLITE_DONE) {
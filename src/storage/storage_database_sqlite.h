@@ -48,16 +48,41 @@ class SQLiteStorage : public DatabaseStorage {
 
   /* Retrieve all tasks of a given job from the storage. */
   bool retrieve_all_tasks(const Job& job,
-                          vector<Task*> *all_tasks);
+                          vector<Task> *all_tasks);
+
+  /* Retrieve lease expiration times of the leased tasks. */
+  bool retrieve_task_leases(unordered_map<int, double> *lease_expire_times);
+
+  /* Retrieve ID of the job the task belongs to. */
+  int retrieve_task_job_id(int task_id);
+
+  /* Retrieve dependencies between tasks of a given job. */
+  bool retrieve_task_dependencies(const Job& job,
+                                  vector<Job::TaskDependency> *dependencies);
+
+  /* Retrieve tasks and task dependencies of all the given jobs. */
+  bool retrieve_jobs_tasks(
+      const vector<Job*>& jobs,
+      vector<vector<Task> > *all_tasks,
+      vector<vector<Job::TaskDependency> > *all_dependencies);
+
+  /* Reserve a block of consecutive IDs of the given type. */
+  int reserve_ids(IDType type, int num_ids);
 
   /* Insert new job into the database. */
   bool insert_job(Job *job);
 
   /* Update job in the stroage. */
-  bool update_job(const Job& job);
+  bool update_job(const JobUpdate& job);
+
+  /* Update multiple jobs in the storage at once. */
+  bool update_jobs(const vector<JobUpdate>& jobs);
 
   /* Update task in the stroage. */
-  bool update_task(const Task& task);
+  bool update_task(const TaskUpdate& task);
+
+  /* Update multiple tasks in the storage at once. */
+  bool update_tasks(const vector<TaskUpdate>& tasks);
 
   /* Fliush caches to the actual storage. */
   bool flush_caches(bool force = false);
@@ -90,6 +115,11 @@ class SQLiteStorage : public DatabaseStorage {
   /* Commit possibly pending transaction. */
   void transaction_commit_pending(bool force = false);
 
+  /* Insert rows of the job, its tasks and dependencies with their given
+   * IDs, transaction is to be opened already.
+   */
+  bool insert_job_rows(Job *job);
+
   /* Prepare statement. */
   sqlite3_stmt *sql_prepare(string sql);
 
@@ -101,6 +131,12 @@ class SQLiteStorage : public DatabaseStorage {
    */
   bool sql_exec(string sql);
 
+  /* Add column to the table if it doesn't exist yet.
+   *
+   * Used to update schema of databases created by older versions.
+   */
+  bool sql_add_column(string table, string column, string definition);
+
   /* Execute prepared statement.
    *
    * Equals to running sqlite3_step() and sqlite3_reset().
@@ -117,7 +153,7 @@ class SQLiteStorage : public DatabaseStorage {
   bool has_open_transaction_;
 
   /* Timestamp of currently opened transaction. */
-  bool transaction_open_timestamp_;
+  double transaction_open_timestamp_;
 
   /* Prepared statements.
    *
@@ -127,10 +163,28 @@ class SQLiteStorage : public DatabaseStorage {
    */
   sqlite3_stmt *select_all_jobs_statement_;
   sqlite3_stmt *select_job_tasks_statement_;
+  sqlite3_stmt *select_task_job_id_statement_;
   sqlite3_stmt *insert_job_statement_;
   sqlite3_stmt *insert_task_statement_;
   sqlite3_stmt *update_job_statement_;
   sqlite3_stmt *update_task_statement_;
+  sqlite3_stmt *select_all_job_dependencies_statement_;
+  sqlite3_stmt *select_job_task_dependencies_statement_;
+  sqlite3_stmt *insert_job_dependency_statement_;
+  sqlite3_stmt *insert_task_dependency_statement_;
+  sqlite3_stmt *select_num_jobs_statement_;
+  sqlite3_stmt *select_all_tasks_statement_;
+  sqlite3_stmt *select_all_task_dependencies_statement_;
+  sqlite3_stmt *select_max_job_id_statement_;
+  sqlite3_stmt *select_max_task_id_statement_;
+  sqlite3_stmt *insert_tasks_batch_statement_;
+  sqlite3_stmt *insert_task_dependencies_batch_statement_;
+  sqlite3_stmt *select_next_id_statement_;
+  sqlite3_stmt *update_next_id_statement_;
+  sqlite3_stmt *select_task_leases_statement_;
+  sqlite3_stmt *insert_restore_job_statement_;
+  sqlite3_stmt *select_restore_tasks_statement_;
+  sqlite3_stmt *select_restore_task_dependencies_statement_;
 };
 
 } /* namespace Farm */
@@ -20,6 +20,7 @@
 
 #include "storage/storage_dryrun.h"
 
+#include "util/util_algorithm.h"
 #include "util/util_foreach.h"
 #include "util/util_logging.h"
 
@@ -27,9 +28,12 @@ namespace Farm {
 
 #define NUM_DUMMY_JOBS  512
 #define NUM_DUMMY_TASKS 1024
+#define NUM_DUMMY_OWNERS 4
 
 DryRunStorage::DryRunStorage(bool populate)
-    : populate_(populate) {
+    : populate_(populate),
+      next_job_id_(populate ? NUM_DUMMY_JOBS : 0),
+      next_task_id_(populate ? NUM_DUMMY_JOBS * NUM_DUMMY_TASKS : 0) {
 }
 
 /* Perform connection to the storage. */
@@ -50,7 +54,10 @@ bool DryRunStorage::retrieve_all_jobs(vector<Job*> *all_jobs) {
   if(populate_) {
     for(int i = 0; i < NUM_DUMMY_JOBS; ++i) {
       string name = string_printf("Job %d", i);
-      Job *new_job = new Job(i, 50, Job::STATUS_WAITING, name);
+      string owner = string_printf("user%d", i % NUM_DUMMY_OWNERS);
+      Job *new_job = new Job(i, 50, Job::STATUS_WAITING, name, owner);
+      new_job->set_num_tasks_with_status(Task::STATUS_WAITING,
+                                         NUM_DUMMY_TASKS);
       all_jobs->push_back(new_job);
     }
   }
@@ -59,28 +66,126 @@ bool DryRunStorage::retrieve_all_jobs(vector<Job*> *all_jobs) {
 
 /* Retrieve all tasks of a given job from the storage. */
 bool DryRunStorage::retrieve_all_tasks(const Job& job,
-                                       vector<Task*> *all_tasks) {
+                                       vector<Task> *all_tasks) {
   all_tasks->clear();
-  for(int i = 0; i < NUM_DUMMY_TASKS; ++i) {
-    Task *task = new Task(job.id() * NUM_DUMMY_TASKS + i,
-                          Task::STATUS_WAITING);
-    all_tasks->push_back(task);
+  int first_task_id, num_tasks;
+  if(is_dummy_job(job.id())) {
+    first_task_id = job.id() * NUM_DUMMY_TASKS;
+    num_tasks = NUM_DUMMY_TASKS;
+  } else {
+    unordered_map<int, InsertedJob>::const_iterator it =
+        inserted_jobs_.find(job.id());
+    if(it == inserted_jobs_.end()) {
+      return false;
+    }
+    first_task_id = it->second.first_task_id;
+    num_tasks = it->second.num_tasks;
+  }
+  /* Updates are not stored, so tasks are as they were inserted. */
+  all_tasks->reserve(num_tasks);
+  for(int i = 0; i < num_tasks; ++i) {
+    all_tasks->push_back(Task(first_task_id + i, Task::STATUS_WAITING));
+  }
+  return true;
+}
+
+/* Retrieve lease expiration times of the leased tasks. */
+bool DryRunStorage::retrieve_task_leases(
+    unordered_map<int, double> *lease_expire_times) {
+  lease_expire_times->clear();
+  return true;
+}
+
+/* Retrieve ID of the job the task belongs to. */
+int DryRunStorage::retrieve_task_job_id(int task_id) {
+  if(task_id < 0) {
+    return -1;
+  }
+  if(is_dummy_job(task_id / NUM_DUMMY_TASKS)) {
+    return task_id / NUM_DUMMY_TASKS;
+  }
+  map<int, int>::const_iterator it =
+      job_ids_by_first_task_id_.upper_bound(task_id);
+  if(it == job_ids_by_first_task_id_.begin()) {
+    return -1;
+  }
+  --it;
+  const InsertedJob& inserted_job = inserted_jobs_[it->second];
+  if(task_id >= inserted_job.first_task_id + inserted_job.num_tasks) {
+    return -1;
+  }
+  return it->second;
+}
+
+/* Retrieve dependencies between tasks of a given job. */
+bool DryRunStorage::retrieve_task_dependencies(
+    const Job& /*job*/,
+    vector<Job::TaskDependency> *dependencies) {
+  dependencies->clear();
+  return true;
+}
+
+/* Retrieve tasks and task dependencies of all the given jobs. */
+bool DryRunStorage::retrieve_jobs_tasks(
+    const vector<Job*>& jobs,
+    vector<vector<Task> > *all_tasks,
+    vector<vector<Job::TaskDependency> > *all_dependencies) {
+  all_tasks->clear();
+  all_tasks->resize(jobs.size());
+  all_dependencies->clear();
+  all_dependencies->resize(jobs.size());
+  for(int i = 0; i < jobs.size(); ++i) {
+    if(!retrieve_all_tasks(*jobs[i], &(*all_tasks)[i]) ||
+       !retrieve_task_dependencies(*jobs[i], &(*all_dependencies)[i])) {
+      return false;
+    }
   }
   return true;
 }
 
 /* Insert new job into the database. */
-bool DryRunStorage::insert_job(Job * /*job*/) {
+bool DryRunStorage::insert_job(Job *job) {
+  if(job->id() == -1) {
+    job->set_id(next_job_id_);
+  }
+  next_job_id_ = max(next_job_id_, job->id() + 1);
+  foreach(Task& task, job->tasks()) {
+    if(task.id() == -1) {
+      task.set_id(next_task_id_);
+    }
+    next_task_id_ = max(next_task_id_, task.id() + 1);
+  }
+  const vector<Task>& tasks = job->tasks();
+  InsertedJob inserted_job;
+  inserted_job.first_task_id = tasks.empty() ? -1 : tasks[0].id();
+  inserted_job.num_tasks = tasks.size();
+  inserted_jobs_[job->id()] = inserted_job;
+  if(!tasks.empty()) {
+    job_ids_by_first_task_id_[inserted_job.first_task_id] = job->id();
+  }
   return true;
 }
 
+/* Reserve a block of consecutive IDs of the given type. */
+int DryRunStorage::reserve_ids(IDType type, int num_ids) {
+  int *next_id = (type == ID_TYPE_JOB) ? &next_job_id_ : &next_task_id_;
+  int first_id = *next_id;
+  *next_id += num_ids;
+  return first_id;
+}
+
 /* Update job in the stroage. */
-bool DryRunStorage::update_job(const Job& /*job*/) {
+bool DryRunStorage::update_job(const JobUpdate& /*job*/) {
   return true;
 }
 
 /* Update task in the stroage. */
-bool DryRunStorage::update_task(const Task& /*task*/) {
+bool DryRunStorage::update_task(const TaskUpdate& /*task*/) {
+  return true;
+}
+
+/* Update multiple tasks in the storage at once. */
+bool DryRunStorage::update_tasks(const vector<TaskUpdate>& /*tasks*/) {
   return true;
 }
 
@@ -89,4 +194,9 @@ bool DryRunStorage::flush_caches(bool force) {
   return true;
 }
 
+/* Check whether the job is one of the populated test jobs. */
+bool DryRunStorage::is_dummy_job(int id) const {
+  return populate_ && id >= 0 && id < NUM_DUMMY_JOBS;
+}
+
 } /* namespace Farm */
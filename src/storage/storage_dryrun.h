@@ -40,22 +40,66 @@ class DryRunStorage : public Storage {
 
   /* Retrieve all tasks of a given job from the storage. */
   bool retrieve_all_tasks(const Job& job,
-                          vector<Task*> *all_tasks);
+                          vector<Task> *all_tasks);
+
+  /* Retrieve lease expiration times of the leased tasks. */
+  bool retrieve_task_leases(unordered_map<int, double> *lease_expire_times);
+
+  /* Retrieve ID of the job the task belongs to. */
+  int retrieve_task_job_id(int task_id);
+
+  /* Retrieve dependencies between tasks of a given job. */
+  bool retrieve_task_dependencies(const Job& job,
+                                  vector<Job::TaskDependency> *dependencies);
+
+  /* Retrieve tasks and task dependencies of all the given jobs. */
+  bool retrieve_jobs_tasks(
+      const vector<Job*>& jobs,
+      vector<vector<Task> > *all_tasks,
+      vector<vector<Job::TaskDependency> > *all_dependencies);
+
+  /* Reserve a block of consecutive IDs of the given type. */
+  int reserve_ids(IDType type, int num_ids);
 
   /* Insert new job into the database. */
   bool insert_job(Job *job);
 
   /* Update job in the stroage. */
-  bool update_job(const Job& job);
+  bool update_job(const JobUpdate& job);
 
   /* Update task in the stroage. */
-  bool update_task(const Task& task);
+  bool update_task(const TaskUpdate& task);
+
+  /* Update multiple tasks in the storage at once. */
+  bool update_tasks(const vector<TaskUpdate>& tasks);
 
   /* Fliush caches to the actual storage. */
   bool flush_caches(bool force = false);
  public:
   /* Populate the storage with test jobs/tasls. */
   bool populate_;
+  /* IDs to be given to the next inserted job and task. */
+  int next_job_id_;
+  int next_task_id_;
+
+ protected:
+  /* Tasks of the job inserted into the storage, which have sequential
+   * IDs.
+   */
+  struct InsertedJob {
+    int first_task_id;
+    int num_tasks;
+  };
+
+  /* Check whether the job is one of the populated test jobs. */
+  bool is_dummy_job(int id) const;
+
+  /* Jobs inserted into the storage by their ID. */
+  unordered_map<int, InsertedJob> inserted_jobs_;
+  /* IDs of the inserted jobs by ID of their first task, used for task
+   * lookups.
+   */
+  map<int, int> job_ids_by_first_task_id_;
 };
 
 } /* namespace Farm */
@@ -0,0 +1,791 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "storage/storage_log.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util/util_algorithm.h"
+#include "util/util_foreach.h"
+#include "util/util_function.h"
+#include "util/util_logging.h"
+#include "util/util_time.h"
+
+namespace Farm {
+
+namespace {
+
+/* Every record of the log and the snapshot is framed as:
+ *
+ *   uint32 size of the payload
+ *   uint32 checksum of the payload
+ *   payload, starting with the record type byte
+ *
+ * Values are written in the native byte order, the files are not meant
+ * to be moved between machines.
+ */
+enum RecordType {
+  /* First record of the snapshot: sequence number of the log which
+   * continues the snapshot, next job and task IDs.
+   */
+  RECORD_SNAPSHOT = 1,
+  /* Job with its tasks and dependencies. */
+  RECORD_INSERT_JOB,
+  /* Priority, status, name and owner of the job. */
+  RECORD_UPDATE_JOB,
+  /* Status and lease expiration time of the task. */
+  RECORD_UPDATE_TASK,
+  /* Type of the reserved IDs and the ID following the reserved block. */
+  RECORD_RESERVE_IDS,
+};
+
+const size_t record_header_size = 2 * sizeof(unsigned int);
+
+/* FNV-1a hash of the data, used to detect torn writes. */
+unsigned int record_checksum(const char *data, size_t size) {
+  unsigned int hash = 2166136261u;
+  for(size_t i = 0; i < size; ++i) {
+    hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+template<typename T>
+void put_value(string *record, T value) {
+  record->append((const char*)&value, sizeof(value));
+}
+
+void put_string(string *record, const string& value) {
+  put_value<int>(record, value.size());
+  record->append(value);
+}
+
+/* Frame the payload and append it to the data. */
+void put_record(string *data, const string& payload) {
+  put_value<unsigned int>(data, payload.size());
+  put_value<unsigned int>(data,
+                          record_checksum(payload.data(), payload.size()));
+  data->append(payload);
+}
+
+/* Sequential reader of the record payload. */
+class RecordReader {
+ public:
+  explicit RecordReader(const string& record)
+      : record_(record),
+        offset_(0) {
+  }
+
+  template<typename T>
+  bool get(T *value) {
+    if(record_.size() - offset_ < sizeof(T)) {
+      return false;
+    }
+    memcpy(value, record_.data() + offset_, sizeof(T));
+    offset_ += sizeof(T);
+    return true;
+  }
+
+  bool get_string(string *value) {
+    int size;
+    if(!get(&size) || size < 0 || record_.size() - offset_ < size) {
+      return false;
+    }
+    value->assign(record_.data() + offset_, size);
+    offset_ += size;
+    return true;
+  }
+
+  bool get_bytes(size_t size, const char **data) {
+    if(record_.size() - offset_ < size) {
+      return false;
+    }
+    *data = record_.data() + offset_;
+    offset_ += size;
+    return true;
+  }
+
+ protected:
+  const string& record_;
+  size_t offset_;
+};
+
+/* Read whole file into the string, false if it doesn't exist. */
+bool read_file(const string& path, string *data) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if(file == NULL) {
+    return false;
+  }
+  data->clear();
+  char buffer[65536];
+  size_t size;
+  while((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data->append(buffer, size);
+  }
+  fclose(file);
+  return true;
+}
+
+/* Write all the data to the descriptor and sync it. */
+bool write_all(int fd, const string& data) {
+  size_t offset = 0;
+  while(offset < data.size()) {
+    ssize_t written = write(fd, data.data() + offset, data.size() - offset);
+    if(written < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    offset += written;
+  }
+  return fdatasync(fd) == 0;
+}
+
+bool file_exists(const string& path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+}  /* namespace */
+
+LogStorage::LogStorage(string filename)
+    : sync_interval(0.0),
+      snapshot_log_size(64 * 1024 * 1024),
+      filename_(filename),
+      next_job_id_(1),
+      next_task_id_(1),
+      log_fd_(-1),
+      log_sequence_(0),
+      log_size_(0),
+      buffer_timestamp_(0.0),
+      snapshot_thread_(NULL),
+      snapshot_done_(false) {
+}
+
+LogStorage::~LogStorage() {
+  join_snapshot_thread();
+  if(log_fd_ != -1) {
+    close(log_fd_);
+  }
+}
+
+/* Perform connection to the storage. */
+bool LogStorage::connect() {
+  jobs_.clear();
+  job_ids_by_first_task_id_.clear();
+  task_statuses_.clear();
+  task_lease_expire_times_.clear();
+  next_job_id_ = next_task_id_ = 1;
+  log_sequence_ = 0;
+  string snapshot_path = filename_ + ".snapshot";
+  /* Snapshot is only renamed into place once it's fully written. */
+  if(file_exists(snapshot_path) &&
+     !replay_file(snapshot_path, false, NULL)) {
+    return false;
+  }
+  /* Logs which are covered by the snapshot might be left if the server
+   * stopped before removing them.
+   */
+  for(int sequence = log_sequence_ - 1;
+      sequence >= 0 && unlink(log_path(sequence).c_str()) == 0;
+      --sequence) {
+  }
+  int sequence = log_sequence_;
+  size_t valid_size = 0;
+  while(file_exists(log_path(sequence))) {
+    /* Only tail of the last log might be torn by a crash. */
+    bool is_last = !file_exists(log_path(sequence + 1));
+    if(!replay_file(log_path(sequence), is_last, &valid_size)) {
+      return false;
+    }
+    if(is_last) {
+      break;
+    }
+    ++sequence;
+  }
+  if(!open_log(sequence)) {
+    return false;
+  }
+  /* Drop torn record at the end of the log, if any. */
+  if(ftruncate(log_fd_, valid_size) != 0) {
+    LOG(ERROR) << "Cannot truncate log " << log_path(sequence) << ": "
+               << strerror(errno);
+    return false;
+  }
+  log_size_ = valid_size;
+  VLOG(1) << "Restored " << jobs_.size() << " job(s) and "
+          << next_task_id_ - 1 << " task(s) from " << filename_ << ".";
+  return true;
+}
+
+/* Disconnect from the storage. */
+bool LogStorage::disconnect() {
+  VLOG(1) << "Disconnecting from " << filename_ << ".";
+  bool ok = write_buffer();
+  join_snapshot_thread();
+  if(log_fd_ != -1) {
+    close(log_fd_);
+    log_fd_ = -1;
+  }
+  return ok;
+}
+
+/* Retrieve all jobs from the storage. */
+bool LogStorage::retrieve_all_jobs(vector<Job*> *all_jobs) {
+  all_jobs->clear();
+  for(map<int, StoredJob>::const_iterator it = jobs_.begin();
+      it != jobs_.end();
+      ++it) {
+    const StoredJob& stored_job = it->second;
+    Job *job = new Job(it->first,
+                       stored_job.priority,
+                       (Job::Status)stored_job.status,
+                       stored_job.name,
+                       stored_job.owner);
+    foreach(int depends_on, stored_job.job_dependencies) {
+      job->add_job_dependency(depends_on);
+    }
+    int num_tasks_by_status[Task::NUM_STATUSES] = {0};
+    for(int i = 0; i < stored_job.num_tasks; ++i) {
+      ++num_tasks_by_status[task_statuses_[stored_job.first_task_id + i]];
+    }
+    for(int status = 0; status < Task::NUM_STATUSES; ++status) {
+      job->set_num_tasks_with_status((Task::Status)status,
+                                     num_tasks_by_status[status]);
+    }
+    all_jobs->push_back(job);
+  }
+  return true;
+}
+
+/* Retrieve all tasks of a given job from the storage. */
+bool LogStorage::retrieve_all_tasks(const Job& job,
+                                    vector<Task> *all_tasks) {
+  all_tasks->clear();
+  map<int, StoredJob>::const_iterator it = jobs_.find(job.id());
+  if(it == jobs_.end()) {
+    return false;
+  }
+  const StoredJob& stored_job = it->second;
+  all_tasks->reserve(stored_job.num_tasks);
+  for(int i = 0; i < stored_job.num_tasks; ++i) {
+    int id = stored_job.first_task_id + i;
+    all_tasks->push_back(Task(id, (Task::Status)task_statuses_[id]));
+  }
+  return true;
+}
+
+/* Retrieve lease expiration times of the leased tasks. */
+bool LogStorage::retrieve_task_leases(
+    unordered_map<int, double> *lease_expire_times) {
+  *lease_expire_times = task_lease_expire_times_;
+  return true;
+}
+
+/* Retrieve ID of the job the task belongs to. */
+int LogStorage::retrieve_task_job_id(int task_id) {
+  map<int, int>::const_iterator it =
+      job_ids_by_first_task_id_.upper_bound(task_id);
+  if(it == job_ids_by_first_task_id_.begin()) {
+    return -1;
+  }
+  --it;
+  const StoredJob& stored_job = jobs_[it->second];
+  if(task_id >= stored_job.first_task_id + stored_job.num_tasks) {
+    return -1;
+  }
+  return it->second;
+}
+
+/* Retrieve dependencies between tasks of a given job. */
+bool LogStorage::retrieve_task_dependencies(
+    const Job& job,
+    vector<Job::TaskDependency> *dependencies) {
+  dependencies->clear();
+  map<int, StoredJob>::const_iterator it = jobs_.find(job.id());
+  if(it == jobs_.end()) {
+    return false;
+  }
+  *dependencies = it->second.task_dependencies;
+  return true;
+}
+
+/* Retrieve tasks and task dependencies of all the given jobs. */
+bool LogStorage::retrieve_jobs_tasks(
+    const vector<Job*>& jobs,
+    vector<vector<Task> > *all_tasks,
+    vector<vector<Job::TaskDependency> > *all_dependencies) {
+  all_tasks->clear();
+  all_tasks->resize(jobs.size());
+  all_dependencies->clear();
+  all_dependencies->resize(jobs.size());
+  for(int i = 0; i < jobs.size(); ++i) {
+    if(!retrieve_all_tasks(*jobs[i], &(*all_tasks)[i]) ||
+       !retrieve_task_dependencies(*jobs[i], &(*all_dependencies)[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Reserve a block of consecutive IDs of the given type. */
+int LogStorage::reserve_ids(IDType type, int num_ids) {
+  int first_id = (type == ID_TYPE_JOB) ? next_job_id_ : next_task_id_;
+  string record;
+  put_value<unsigned char>(&record, RECORD_RESERVE_IDS);
+  put_value<unsigned char>(&record, type);
+  put_value<int>(&record, first_id + num_ids);
+  if(!apply_record(record)) {
+    return -1;
+  }
+  /* Rows using the reserved IDs are appended after the reservation, so
+   * it doesn't need to be written right away.
+   */
+  append_record(record);
+  return first_id;
+}
+
+/* Insert new job into the database. */
+bool LogStorage::insert_job(Job *job) {
+  VLOG(1) << "Inserting new job: " << job->name() << ".";
+  if(job->id() == -1) {
+    job->set_id(next_job_id_);
+  } else if(jobs_.find(job->id()) != jobs_.end()) {
+    LOG(ERROR) << "Job " << job->id() << " is already in the storage.";
+    return false;
+  }
+  vector<Task>& tasks = job->tasks();
+  /* Tasks are stored as a range of IDs starting at the first one. */
+  int first_task_id = next_task_id_;
+  if(!tasks.empty() && tasks[0].id() != -1) {
+    first_task_id = tasks[0].id();
+    for(int i = 0; i < tasks.size(); ++i) {
+      if(tasks[i].id() != first_task_id + i) {
+        LOG(ERROR) << "Tasks of job " << job->id()
+                   << " don't have consecutive IDs.";
+        return false;
+      }
+    }
+  }
+  StoredJob stored_job;
+  stored_job.priority = job->priority();
+  stored_job.status = job->status();
+  stored_job.name = job->name();
+  stored_job.owner = job->owner();
+  stored_job.first_task_id = first_task_id;
+  stored_job.num_tasks = tasks.size();
+  stored_job.job_dependencies = job->job_dependencies();
+  stored_job.task_dependencies = job->task_dependencies();
+  vector<unsigned char> task_statuses(tasks.size());
+  for(int i = 0; i < tasks.size(); ++i) {
+    tasks[i].set_id(stored_job.first_task_id + i);
+    task_statuses[i] = tasks[i].status();
+  }
+  string record;
+  encode_job(job->id(),
+             stored_job,
+             tasks.empty() ? NULL : &task_statuses[0],
+             &record);
+  if(!apply_record(record)) {
+    return false;
+  }
+  append_record(record);
+  /* New jobs are written right away. */
+  return write_buffer();
+}
+
+/* Update job in the stroage. */
+bool LogStorage::update_job(const JobUpdate& job) {
+  string record;
+  put_value<unsigned char>(&record, RECORD_UPDATE_JOB);
+  put_value<int>(&record, job.id);
+  put_value<Job::Priority>(&record, job.priority);
+  put_value<unsigned char>(&record, job.status);
+  put_string(&record, job.name);
+  put_string(&record, job.owner);
+  if(!apply_record(record)) {
+    return false;
+  }
+  append_record(record);
+  return true;
+}
+
+/* Update task in the stroage. */
+bool LogStorage::update_task(const TaskUpdate& task) {
+  string record;
+  put_value<unsigned char>(&record, RECORD_UPDATE_TASK);
+  put_value<int>(&record, task.id);
+  put_value<unsigned char>(&record, task.status);
+  put_value<double>(&record, task.lease_expire_time);
+  if(!apply_record(record)) {
+    return false;
+  }
+  append_record(record);
+  return true;
+}
+
+/* Update multiple tasks in the storage at once. */
+bool LogStorage::update_tasks(const vector<TaskUpdate>& tasks) {
+  bool ok = true;
+  foreach(const TaskUpdate& task, tasks) {
+    ok &= update_task(task);
+  }
+  return ok;
+}
+
+/* Fliush caches to the actual storage. */
+bool LogStorage::flush_caches(bool force) {
+  if(!buffer_.empty() &&
+     (force || util_time_dt() - buffer_timestamp_ >= sync_interval)) {
+    if(!write_buffer()) {
+      return false;
+    }
+  }
+  if(snapshot_done_) {
+    join_snapshot_thread();
+  }
+  if(log_size_ >= snapshot_log_size && snapshot_thread_ == NULL) {
+    return start_snapshot();
+  }
+  return true;
+}
+
+/* Path of the log file with the given sequence number. */
+string LogStorage::log_path(int sequence) const {
+  return string_printf("%s.log.%d", filename_.c_str(), sequence);
+}
+
+/* Read all records of the file and apply them to the state. */
+bool LogStorage::replay_file(const string& path,
+                             bool is_last,
+                             size_t *r_valid_size) {
+  string data;
+  if(!read_file(path, &data)) {
+    LOG(ERROR) << "Cannot read " << path << ": " << strerror(errno);
+    return false;
+  }
+  size_t offset = 0;
+  int num_records = 0;
+  string payload;
+  while(data.size() - offset >= record_header_size) {
+    unsigned int size, checksum;
+    memcpy(&size, data.data() + offset, sizeof(size));
+    memcpy(&checksum, data.data() + offset + sizeof(size), sizeof(checksum));
+    if(data.size() - offset - record_header_size < size) {
+      break;
+    }
+    const char *payload_data = data.data() + offset + record_header_size;
+    if(record_checksum(payload_data, size) != checksum) {
+      break;
+    }
+    payload.assign(payload_data, size);
+    if(!apply_record(payload)) {
+      LOG(ERROR) << "Invalid record at offset " << offset << " of "
+                 << path << ".";
+      break;
+    }
+    offset += record_header_size + size;
+    ++num_records;
+  }
+  if(offset != data.size()) {
+    if(!is_last) {
+      LOG(ERROR) << path << " is damaged at offset " << offset << ".";
+      return false;
+    }
+    LOG(WARNING) << "Ignoring " << data.size() - offset
+                 << " damaged byte(s) at the end of " << path << ".";
+  }
+  VLOG(1) << "Replayed " << num_records << " record(s) from " << path << ".";
+  if(r_valid_size != NULL) {
+    *r_valid_size = offset;
+  }
+  return true;
+}
+
+/* Apply single record to the state. */
+bool LogStorage::apply_record(const string& record) {
+  RecordReader reader(record);
+  unsigned char type;
+  if(!reader.get(&type)) {
+    return false;
+  }
+  switch(type) {
+    case RECORD_SNAPSHOT:
+      return reader.get(&log_sequence_) &&
+             reader.get(&next_job_id_) &&
+             reader.get(&next_task_id_);
+    case RECORD_INSERT_JOB: {
+      int id, num_job_dependencies, num_task_dependencies;
+      const char *statuses;
+      StoredJob job;
+      if(!reader.get(&id) ||
+         !reader.get(&job.priority) ||
+         !reader.get(&job.status) ||
+         !reader.get_string(&job.name) ||
+         !reader.get_string(&job.owner) ||
+         !reader.get(&job.first_task_id) ||
+         !reader.get(&job.num_tasks) ||
+         job.first_task_id < 1 || job.num_tasks < 0 ||
+         !reader.get_bytes(job.num_tasks, &statuses) ||
+         !reader.get(&num_job_dependencies) ||
+         num_job_dependencies < 0) {
+        return false;
+      }
+      job.job_dependencies.resize(num_job_dependencies);
+      foreach(int& depends_on, job.job_dependencies) {
+        if(!reader.get(&depends_on)) {
+          return false;
+        }
+      }
+      if(!reader.get(&num_task_dependencies) || num_task_dependencies < 0) {
+        return false;
+      }
+      job.task_dependencies.resize(num_task_dependencies);
+      foreach(Job::TaskDependency& dependency, job.task_dependencies) {
+        if(!reader.get(&dependency.task) ||
+           !reader.get(&dependency.depends_on)) {
+          return false;
+        }
+      }
+      int end_task_id = job.first_task_id + job.num_tasks;
+      if(task_statuses_.size() < end_task_id) {
+        task_statuses_.resize(end_task_id, Task::STATUS_WAITING);
+      }
+      if(job.num_tasks != 0) {
+        memcpy(&task_statuses_[job.first_task_id], statuses, job.num_tasks);
+        job_ids_by_first_task_id_[job.first_task_id] = id;
+      }
+      next_job_id_ = max(next_job_id_, id + 1);
+      next_task_id_ = max(next_task_id_, end_task_id);
+      jobs_[id] = job;
+      return true;
+    }
+    case RECORD_UPDATE_JOB: {
+      int id;
+      Job::Priority priority;
+      unsigned char status;
+      string name, owner;
+      if(!reader.get(&id) ||
+         !reader.get(&priority) ||
+         !reader.get(&status) ||
+         !reader.get_string(&name) ||
+         !reader.get_string(&owner)) {
+        return false;
+      }
+      map<int, StoredJob>::iterator it = jobs_.find(id);
+      if(it == jobs_.end()) {
+        return false;
+      }
+      it->second.priority = priority;
+      it->second.status = status;
+      it->second.name = name;
+      it->second.owner = owner;
+      return true;
+    }
+    case RECORD_UPDATE_TASK: {
+      int id;
+      unsigned char status;
+      double lease_expire_time;
+      if(!reader.get(&id) ||
+         !reader.get(&status) ||
+         !reader.get(&lease_expire_time) ||
+         id < 1 || id >= task_statuses_.size()) {
+        return false;
+      }
+      task_statuses_[id] = status;
+      if(lease_expire_time != 0.0) {
+        task_lease_expire_times_[id] = lease_expire_time;
+      } else {
+        task_lease_expire_times_.erase(id);
+      }
+      return true;
+    }
+    case RECORD_RESERVE_IDS: {
+      unsigned char id_type;
+      int end_id;
+      if(!reader.get(&id_type) || !reader.get(&end_id)) {
+        return false;
+      }
+      if(id_type == ID_TYPE_JOB) {
+        next_job_id_ = max(next_job_id_, end_id);
+      } else if(id_type == ID_TYPE_TASK) {
+        next_task_id_ = max(next_task_id_, end_id);
+      } else {
+        return false;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Encode job as an insert record. */
+void LogStorage::encode_job(int id,
+                            const StoredJob& job,
+                            const unsigned char *task_statuses,
+                            string *record) const {
+  put_value<unsigned char>(record, RECORD_INSERT_JOB);
+  put_value<int>(record, id);
+  put_value<Job::Priority>(record, job.priority);
+  put_value<unsigned char>(record, job.status);
+  put_string(record, job.name);
+  put_string(record, job.owner);
+  put_value<int>(record, job.first_task_id);
+  put_value<int>(record, job.num_tasks);
+  record->append((const char*)task_statuses, job.num_tasks);
+  put_value<int>(record, job.job_dependencies.size());
+  foreach(int depends_on, job.job_dependencies) {
+    put_value<int>(record, depends_on);
+  }
+  put_value<int>(record, job.task_dependencies.size());
+  foreach(const Job::TaskDependency& dependency, job.task_dependencies) {
+    put_value<int>(record, dependency.task);
+    put_value<int>(record, dependency.depends_on);
+  }
+}
+
+/* Add record to the buffer of records to be written. */
+void LogStorage::append_record(const string& record) {
+  if(buffer_.empty()) {
+    buffer_timestamp_ = util_time_dt();
+  }
+  put_record(&buffer_, record);
+}
+
+/* Write buffered records to the log and sync it. */
+bool LogStorage::write_buffer() {
+  if(buffer_.empty()) {
+    return true;
+  }
+  if(log_fd_ == -1 || !write_all(log_fd_, buffer_)) {
+    LOG(ERROR) << "Cannot write log " << log_path(log_sequence_) << ": "
+               << strerror(errno);
+    return false;
+  }
+  log_size_ += buffer_.size();
+  buffer_.clear();
+  return true;
+}
+
+/* Open log with the given sequence number for appending. */
+bool LogStorage::open_log(int sequence) {
+  string path = log_path(sequence);
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd == -1) {
+    LOG(ERROR) << "Cannot open log " << path << ": " << strerror(errno);
+    return false;
+  }
+  if(log_fd_ != -1) {
+    close(log_fd_);
+  }
+  log_fd_ = fd;
+  log_sequence_ = sequence;
+  log_size_ = 0;
+  return true;
+}
+
+/* Write the state to a new snapshot and start new log. */
+bool LogStorage::start_snapshot() {
+  if(!write_buffer() || !open_log(log_sequence_ + 1)) {
+    return false;
+  }
+  VLOG(1) << "Taking snapshot of " << filename_ << ".";
+  /* Encoding is a copy of compact state, writing and syncing it is what
+   * takes time, so only that is done in the background.
+   */
+  string *snapshot = new string();
+  string record;
+  put_value<unsigned char>(&record, RECORD_SNAPSHOT);
+  put_value<int>(&record, log_sequence_);
+  put_value<int>(&record, next_job_id_);
+  put_value<int>(&record, next_task_id_);
+  put_record(snapshot, record);
+  for(map<int, StoredJob>::const_iterator it = jobs_.begin();
+      it != jobs_.end();
+      ++it) {
+    record.clear();
+    const StoredJob& job = it->second;
+    encode_job(it->first,
+               job,
+               job.num_tasks == 0 ? NULL : &task_statuses_[job.first_task_id],
+               &record);
+    put_record(snapshot, record);
+  }
+  for(unordered_map<int, double>::const_iterator it =
+          task_lease_expire_times_.begin();
+      it != task_lease_expire_times_.end();
+      ++it) {
+    record.clear();
+    put_value<unsigned char>(&record, RECORD_UPDATE_TASK);
+    put_value<int>(&record, it->first);
+    put_value<unsigned char>(&record, task_statuses_[it->first]);
+    put_value<double>(&record, it->second);
+    put_record(snapshot, record);
+  }
+  snapshot_done_ = false;
+  snapshot_thread_ = new thread(function_bind(&LogStorage::write_snapshot,
+                                              this,
+                                              snapshot,
+                                              log_sequence_));
+  return true;
+}
+
+/* Wait for the snapshot thread to finish. */
+void LogStorage::join_snapshot_thread() {
+  if(snapshot_thread_ == NULL) {
+    return;
+  }
+  snapshot_thread_->join();
+  delete snapshot_thread_;
+  snapshot_thread_ = NULL;
+}
+
+/* Write snapshot to the disk. */
+void LogStorage::write_snapshot(const string *snapshot, int log_sequence) {
+  string path = filename_ + ".snapshot";
+  string temp_path = path + ".tmp";
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd != -1 && write_all(fd, *snapshot);
+  if(fd != -1) {
+    close(fd);
+  }
+  /* Snapshot replaces the previous one only once it's complete, logs
+   * which it covers are not needed after that.
+   */
+  if(ok && rename(temp_path.c_str(), path.c_str()) == 0) {
+    for(int sequence = log_sequence - 1;
+        sequence >= 0 && unlink(log_path(sequence).c_str()) == 0;
+        --sequence) {
+    }
+    VLOG(1) << "Written snapshot of " << snapshot->size() << " bytes.";
+  } else {
+    LOG(ERROR) << "Cannot write snapshot " << path << ": "
+               << strerror(errno);
+    unlink(temp_path.c_str());
+  }
+  delete snapshot;
+  snapshot_done_ = true;
+}
+
+} /* namespace Farm */
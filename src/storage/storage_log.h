@@ -0,0 +1,198 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef STORAGE_LOG_H_
+#define STORAGE_LOG_H_
+
+#include "storage/storage.h"
+#include "util/util_atomic.h"
+#include "util/util_map.h"
+#include "util/util_string.h"
+#include "util/util_thread.h"
+#include "util/util_vector.h"
+
+namespace Farm {
+
+/* Storage which appends all the changes to a binary log.
+ *
+ * Whole state is kept in memory, compactly, and is written to the disk
+ * as a sequence of log records. Records are collected in a buffer and
+ * written with a single fsync by flush_caches(), so a status change of a
+ * task costs a few bytes of sequential write instead of a B-tree update.
+ *
+ * When the log grows big enough the state is written to a snapshot in a
+ * background thread and the log is started over, so restore only replays
+ * the latest snapshot and the log written after it.
+ *
+ * Files used are <filename>.snapshot and <filename>.log.<sequence>.
+ */
+class LogStorage : public Storage {
+ public:
+  explicit LogStorage(string filename);
+
+  ~LogStorage();
+
+  /* Perform connection to the storage, replaying the snapshot and the
+   * log into memory.
+   */
+  bool connect();
+
+  /* Disconnect from the storage. */
+  bool disconnect();
+
+  /* Retrieve all jobs from the storage. */
+  bool retrieve_all_jobs(vector<Job*> *all_jobs);
+
+  /* Retrieve all tasks of a given job from the storage. */
+  bool retrieve_all_tasks(const Job& job,
+                          vector<Task> *all_tasks);
+
+  /* Retrieve lease expiration times of the leased tasks. */
+  bool retrieve_task_leases(unordered_map<int, double> *lease_expire_times);
+
+  /* Retrieve ID of the job the task belongs to. */
+  int retrieve_task_job_id(int task_id);
+
+  /* Retrieve dependencies between tasks of a given job. */
+  bool retrieve_task_dependencies(const Job& job,
+                                  vector<Job::TaskDependency> *dependencies);
+
+  /* Retrieve tasks and task dependencies of all the given jobs. */
+  bool retrieve_jobs_tasks(
+      const vector<Job*>& jobs,
+      vector<vector<Task> > *all_tasks,
+      vector<vector<Job::TaskDependency> > *all_dependencies);
+
+  /* Reserve a block of consecutive IDs of the given type. */
+  int reserve_ids(IDType type, int num_ids);
+
+  /* Insert new job into the database. */
+  bool insert_job(Job *job);
+
+  /* Update job in the stroage. */
+  bool update_job(const JobUpdate& job);
+
+  /* Update task in the stroage. */
+  bool update_task(const TaskUpdate& task);
+
+  /* Update multiple tasks in the storage at once. */
+  bool update_tasks(const vector<TaskUpdate>& tasks);
+
+  /* Fliush caches to the actual storage. */
+  bool flush_caches(bool force = false);
+
+  /* ** Performance parameters ** */
+
+  /* Minimal interval in seconds between writes of the buffered records,
+   * every write is followed by fsync. Zero means every flush_caches()
+   * call writes the records buffered since the previous one.
+   */
+  double sync_interval;
+
+  /* Size of the log in bytes after which the snapshot is taken and the
+   * log is started over.
+   */
+  size_t snapshot_log_size;
+
+ protected:
+  /* Job as it's kept in memory, tasks of the job have sequential IDs. */
+  struct StoredJob {
+    Job::Priority priority;
+    unsigned char status;
+    string name;
+    string owner;
+    int first_task_id;
+    int num_tasks;
+    vector<int> job_dependencies;
+    vector<Job::TaskDependency> task_dependencies;
+  };
+
+  /* Path of the log file with the given sequence number. */
+  string log_path(int sequence) const;
+
+  /* Read all records of the file and apply them to the state.
+   *
+   * Reading stops at the first damaged record, which is only allowed in
+   * the last log. Size of the valid part of the file is returned in
+   * r_valid_size if it's not NULL.
+   */
+  bool replay_file(const string& path, bool is_last, size_t *r_valid_size);
+
+  /* Apply single record to the state. */
+  bool apply_record(const string& record);
+
+  /* Encode job and statuses of its tasks as an insert record. */
+  void encode_job(int id,
+                  const StoredJob& job,
+                  const unsigned char *task_statuses,
+                  string *record) const;
+
+  /* Add record to the buffer of records to be written. */
+  void append_record(const string& record);
+
+  /* Write buffered records to the log and sync it. */
+  bool write_buffer();
+
+  /* Open log with the given sequence number for appending. */
+  bool open_log(int sequence);
+
+  /* Write the state to a new snapshot and start new log. */
+  bool start_snapshot();
+
+  /* Wait for the snapshot thread to finish. */
+  void join_snapshot_thread();
+
+  /* Write snapshot to the disk, called from the snapshot thread. */
+  void write_snapshot(const string *snapshot, int log_sequence);
+
+  /* Base name of the files. */
+  string filename_;
+  /* Jobs by their ID. */
+  map<int, StoredJob> jobs_;
+  /* IDs of jobs by ID of their first task, used for task lookups. */
+  map<int, int> job_ids_by_first_task_id_;
+  /* Statuses of tasks, indexed by task ID. */
+  vector<unsigned char> task_statuses_;
+  /* Non-zero lease expiration times of tasks, by task ID. */
+  unordered_map<int, double> task_lease_expire_times_;
+  /* IDs to be given to the next inserted job and task. */
+  int next_job_id_;
+  int next_task_id_;
+
+  /* Descriptor of the log being appended to, -1 if not opened. */
+  int log_fd_;
+  /* Sequence number of the log being appended to. */
+  int log_sequence_;
+  /* Size of the log being appended to. */
+  size_t log_size_;
+  /* Records which are not written to the log yet. */
+  string buffer_;
+  /* Time at which the first record was put to the empty buffer. */
+  double buffer_timestamp_;
+
+  /* Thread which writes snapshot, NULL if there's none. */
+  thread *snapshot_thread_;
+  /* Snapshot thread is done and is to be joined. */
+  atomic<bool> snapshot_done_;
+};
+
+} /* namespace Farm */
+
+#endif  /* STORAGE_LOG_H_ */
@@ -25,8 +25,11 @@
 
 namespace Farm {
 
+using std::fill;
+using std::lower_bound;
 using std::sort;
 using std::swap;
+using std::unique;
 using std::max;
 using std::min;
 using std::remove;
@@ -28,7 +28,8 @@ json_value::json_value()
     value_string_(""),
     value_integer_(0),
     value_float_(0),
-    value_json_(NULL) {
+    value_json_(NULL),
+    value_array_(NULL) {
 }
 
 json_value::json_value(const json_value& other) {
@@ -42,6 +43,12 @@ json_value::json_value(const json_value& other) {
   else {
     value_json_ = NULL;
   }
+  if(other.value_array_) {
+    value_array_ = new json_array(*other.value_array_);
+  }
+  else {
+    value_array_ = NULL;
+  }
 }
 
 json_value::json_value(string value)
@@ -49,7 +56,8 @@ json_value::json_value(string value)
     value_string_(value),
     value_integer_(0),
     value_float_(0),
-    value_json_(NULL) {
+    value_json_(NULL),
+    value_array_(NULL) {
 }
 
 json_value::json_value(int value)
@@ -57,7 +65,8 @@ json_value::json_value(int value)
     value_string_(""),
     value_integer_(value),
     value_float_(0),
-    value_json_(NULL) {
+    value_json_(NULL),
+    value_array_(NULL) {
 }
 
 json_value::json_value(double value)
@@ -65,32 +74,50 @@ json_value::json_value(double value)
     value_string_(""),
     value_integer_(0),
     value_float_(value),
-    value_json_(NULL) {
+    value_json_(NULL),
+    value_array_(NULL) {
 }
 
 json_value::json_value(const json& value)
   : type_(JSON),
     value_string_(""),
     value_integer_(0),
-    value_float_(0) {
+    value_float_(0),
+    value_array_(NULL) {
   value_json_ = new json(value);
 }
 
+json_value::json_value(const json_array& value)
+  : type_(ARRAY),
+    value_string_(""),
+    value_integer_(0),
+    value_float_(0),
+    value_json_(NULL) {
+  value_array_ = new json_array(value);
+}
+
 json_value::~json_value() {
   if(type_ == JSON) {
     delete value_json_;
   }
+  else if(type_ == ARRAY) {
+    delete value_array_;
+  }
 }
 
 void json_value::reset() {
   if(type_ == JSON) {
     delete value_json_;
   }
+  else if(type_ == ARRAY) {
+    delete value_array_;
+  }
   type_ = UNKNOWN;
   value_string_.clear();
   value_integer_ = 0;
   value_float_ = 0.0;
   value_json_ = NULL;
+  value_array_ = NULL;
 }
 
 string json_value::serialize() {
@@ -103,6 +130,8 @@ string json_value::serialize() {
       return string_printf("%f", value_float_);
     case JSON:
       return value_json_->serialize();
+    case ARRAY:
+      return value_array_->serialize();
     default:
       return "";
   }
@@ -136,6 +165,13 @@ json_value& json_value::operator= (const json& value) {
   return *this;
 }
 
+json_value& json_value::operator= (const json_array& value) {
+  reset();
+  type_ = ARRAY;
+  value_array_ = new json_array(value);
+  return *this;
+}
+
 /* JSON serialization/deserialization */
 
 json::json() {
@@ -170,4 +206,29 @@ string json::serialize() {
   return result;
 }
 
+/* JSON array serialization */
+
+json_array::json_array() {
+}
+
+json_array::json_array(const json_array& other)
+  : values_(other.values_) {
+}
+
+void json_array::push_back(const json_value& value) {
+  values_.push_back(value);
+}
+
+string json_array::serialize() {
+  string result = "[";
+  for(int i = 0; i < values_.size(); ++i) {
+    if(i != 0) {
+      result += ", ";
+    }
+    result += values_[i].serialize();
+  }
+  result += "]";
+  return result;
+}
+
 } /* namespace Farm */
@@ -22,11 +22,13 @@
 #define UTIL_JSON_H_
 
 #include "util/util_map.h"
+#include "util/util_vector.h"
 #include "util_string.h"
 
 namespace Farm {
 
 class json;
+class json_array;
 
 class json_value {
  public:
@@ -35,7 +37,8 @@ class json_value {
     STRING,
     INTEGER,
     FLOAT,
-    JSON
+    JSON,
+    ARRAY
   };
   json_value();
   json_value(const json_value& other);
@@ -43,6 +46,7 @@ class json_value {
   json_value(int value);
   json_value(double value);
   json_value(const json& value);
+  json_value(const json_array& value);
   ~json_value();
 
   void reset();
@@ -53,12 +57,14 @@ class json_value {
   json_value& operator= (int value);
   json_value& operator= (double value);
   json_value& operator= (const json& value);
+  json_value& operator= (const json_array& value);
  protected:
   Type type_;
   string value_string_;
   int value_integer_;
   double value_float_;
   json *value_json_;
+  json_array *value_array_;
 };
 
 class json {
@@ -73,6 +79,17 @@ class json {
   storage_type storage_;
 };
 
+class json_array {
+ public:
+  json_array();
+  json_array(const json_array& other);
+  void push_back(const json_value& value);
+  size_t size() const { return values_.size(); }
+  string serialize();
+ protected:
+  vector<json_value> values_;
+};
+
 } /* namespace Farm */
 
 #endif  /* UTIL_JSON_H_ */
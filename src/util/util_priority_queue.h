@@ -21,12 +21,194 @@
 #ifndef UTIL_PRIORITY_QUEUE_H_
 #define UTIL_PRIORITY_QUEUE_H_
 
+#include <cassert>
+#include <cstddef>
+#include <functional>
 #include <queue>
 
+#include "util/util_vector.h"
+
 namespace Farm {
 
 using std::priority_queue;
 
+/* Binary heap which gives a stable handle for every pushed element.
+ *
+ * Handle could be used to remove an element from the middle of the queue
+ * or to restore the heap property after the element's key was changed,
+ * both in O(log n). Ordering follows std::priority_queue: the element
+ * for which compare returns false against all the others is on top.
+ */
+template<typename T, typename Compare = std::less<T> >
+class indexed_priority_queue {
+ public:
+  typedef int handle_type;
+
+  explicit indexed_priority_queue(const Compare& compare = Compare())
+      : compare_(compare) {
+  }
+
+  bool empty() const { return heap_.empty(); }
+  size_t size() const { return heap_.size(); }
+
+  const T& top() const { return heap_.front().value; }
+  handle_type top_handle() const { return heap_.front().handle; }
+
+  /* Check whether handle points to an element which is still queued. */
+  bool contains(handle_type handle) const {
+    return handle >= 0 &&
+           handle < positions_.size() &&
+           positions_[handle] != -1;
+  }
+
+  const T& get(handle_type handle) const {
+    assert(contains(handle));
+    return heap_[positions_[handle]].value;
+  }
+
+  /* Push new element, returns handle of the element. */
+  handle_type push(const T& value) {
+    handle_type handle;
+    if(free_handles_.empty()) {
+      handle = positions_.size();
+      positions_.push_back(-1);
+    } else {
+      handle = free_handles_.back();
+      free_handles_.pop_back();
+    }
+    node new_node = {value, handle};
+    heap_.push_back(new_node);
+    positions_[handle] = heap_.size() - 1;
+    sift_up(heap_.size() - 1);
+    return handle;
+  }
+
+  /* Replace content of the queue with the given values in O(n), handle
+   * of values[i] is i.
+   */
+  void assign(const vector<T>& values) {
+    clear();
+    heap_.reserve(values.size());
+    positions_.reserve(values.size());
+    for(int i = 0; i < values.size(); ++i) {
+      node new_node = {values[i], i};
+      heap_.push_back(new_node);
+      positions_.push_back(i);
+    }
+    for(int i = (int)heap_.size() / 2 - 1; i >= 0; --i) {
+      sift_down(i);
+    }
+  }
+
+  void pop() {
+    erase(top_handle());
+  }
+
+  /* Remove element from the queue, handle becomes invalid. */
+  void erase(handle_type handle) {
+    assert(contains(handle));
+    int position = positions_[handle];
+    int last = heap_.size() - 1;
+    if(position != last) {
+      move_node(last, position);
+    }
+    heap_.pop_back();
+    positions_[handle] = -1;
+    free_handles_.push_back(handle);
+    if(position != last) {
+      update_at(position);
+    }
+  }
+
+  /* Restore heap property after the key of the element has changed. */
+  void update(handle_type handle) {
+    assert(contains(handle));
+    update_at(positions_[handle]);
+  }
+
+  /* Replace value of the element, keeping its handle. */
+  void update(handle_type handle, const T& value) {
+    assert(contains(handle));
+    heap_[positions_[handle]].value = value;
+    update_at(positions_[handle]);
+  }
+
+  void clear() {
+    heap_.clear();
+    positions_.clear();
+    free_handles_.clear();
+  }
+
+  void reserve(size_t size) {
+    heap_.reserve(size);
+    positions_.reserve(size);
+  }
+
+ protected:
+  struct node {
+    T value;
+    handle_type handle;
+  };
+
+  void move_node(int from, int to) {
+    heap_[to] = heap_[from];
+    positions_[heap_[to].handle] = to;
+  }
+
+  void update_at(int position) {
+    if(position > 0 &&
+       compare_(heap_[(position - 1) / 2].value, heap_[position].value)) {
+      sift_up(position);
+    } else {
+      sift_down(position);
+    }
+  }
+
+  void sift_up(int position) {
+    node current = heap_[position];
+    while(position > 0) {
+      int parent = (position - 1) / 2;
+      if(!compare_(heap_[parent].value, current.value)) {
+        break;
+      }
+      move_node(parent, position);
+      position = parent;
+    }
+    heap_[position] = current;
+    positions_[current.handle] = position;
+  }
+
+  void sift_down(int position) {
+    node current = heap_[position];
+    int size = heap_.size();
+    for(;;) {
+      int child = position * 2 + 1;
+      if(child >= size) {
+        break;
+      }
+      if(child + 1 < size &&
+         compare_(heap_[child].value, heap_[child + 1].value)) {
+        ++child;
+      }
+      if(!compare_(current.value, heap_[child].value)) {
+        break;
+      }
+      move_node(child, position);
+      position = child;
+    }
+    heap_[position] = current;
+    positions_[current.handle] = position;
+  }
+
+  /* Heap-ordered elements. */
+  vector<node> heap_;
+  /* Handle to position in the heap_ mapping, -1 for unused handles. */
+  vector<int> positions_;
+  /* Handles which could be re-used for new elements. */
+  vector<handle_type> free_handles_;
+  Compare compare_;
+};
+
 } /* namespace Farm */
 
 #endif  /* UTIL_PRIORITY_QUEUE_H_ */
@@ -0,0 +1,140 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef UTIL_RUNNING_MEDIAN_H_
+#define UTIL_RUNNING_MEDIAN_H_
+
+#include <cstddef>
+
+namespace Farm {
+
+/* Estimate of the median of a stream of values in constant memory.
+ *
+ * Uses the P-square algorithm: five markers track minimum, maximum,
+ * median and the quartiles, and are moved along a piecewise-parabolic
+ * curve as values come in. Adding a value and getting the median are
+ * O(1). Median of the first five values is exact.
+ */
+template<typename T>
+class running_median {
+ public:
+  running_median() : size_(0) {}
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+
+  void add(const T& value) {
+    if(size_ < num_markers) {
+      /* Keep the first values sorted, they're the initial markers. */
+      int i = size_++;
+      for(; i > 0 && heights_[i - 1] > value; --i) {
+        heights_[i] = heights_[i - 1];
+      }
+      heights_[i] = value;
+      for(i = 0; i < num_markers; ++i) {
+        positions_[i] = i;
+        desired_positions_[i] = i;
+      }
+      return;
+    }
+    ++size_;
+    /* Find cell of the value, extending the extreme markers. */
+    int cell;
+    if(value < heights_[0]) {
+      heights_[0] = value;
+      cell = 0;
+    } else if(value >= heights_[num_markers - 1]) {
+      heights_[num_markers - 1] = value;
+      cell = num_markers - 2;
+    } else {
+      cell = 0;
+      while(value >= heights_[cell + 1]) {
+        ++cell;
+      }
+    }
+    for(int i = cell + 1; i < num_markers; ++i) {
+      ++positions_[i];
+    }
+    for(int i = 0; i < num_markers; ++i) {
+      desired_positions_[i] += median_increment(i);
+    }
+    /* Move middle markers which are off their desired positions. */
+    for(int i = 1; i < num_markers - 1; ++i) {
+      double offset = desired_positions_[i] - positions_[i];
+      if((offset >= 1.0 && positions_[i + 1] - positions_[i] > 1) ||
+         (offset <= -1.0 && positions_[i - 1] - positions_[i] < -1)) {
+        int step = (offset > 0.0) ? 1 : -1;
+        T height = parabolic_height(i, step);
+        if(heights_[i - 1] < height && height < heights_[i + 1]) {
+          heights_[i] = height;
+        } else {
+          heights_[i] = linear_height(i, step);
+        }
+        positions_[i] += step;
+      }
+    }
+  }
+
+  /* Median of the added values, lower median while there're less than
+   * five of them.
+   *
+   * Only to be called on a non-empty stream.
+   */
+  T median() const {
+    if(size_ < num_markers) {
+      return heights_[(size_ - 1) / 2];
+    }
+    return heights_[num_markers / 2];
+  }
+
+ protected:
+  static const int num_markers = 5;
+
+  /* Increment of the desired position of the marker per added value. */
+  static double median_increment(int marker) {
+    return marker * 0.25;
+  }
+
+  T parabolic_height(int i, int step) const {
+    double left = positions_[i] - positions_[i - 1];
+    double right = positions_[i + 1] - positions_[i];
+    return heights_[i] +
+        step / (double)(positions_[i + 1] - positions_[i - 1]) *
+        ((left + step) * (heights_[i + 1] - heights_[i]) / right +
+         (right - step) * (heights_[i] - heights_[i - 1]) / left);
+  }
+
+  T linear_height(int i, int step) const {
+    return heights_[i] +
+        step * (heights_[i + step] - heights_[i]) /
+        (positions_[i + step] - positions_[i]);
+  }
+
+  size_t size_;
+  /* Heights and actual positions of the markers. */
+  T heights_[num_markers];
+  int positions_[num_markers];
+  /* Positions the markers are supposed to be at. */
+  double desired_positions_[num_markers];
+};
+
+} /* namespace Farm */
+
+#endif  /* UTIL_RUNNING_MEDIAN_H_ */
@@ -0,0 +1,243 @@
+// Copyright (c) 2015 farm-proto authors.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef UTIL_TIMING_WHEEL_H_
+#define UTIL_TIMING_WHEEL_H_
+
+#include <cassert>
+#include <cstddef>
+#include <stdint.h>
+
+#include "util/util_vector.h"
+
+namespace Farm {
+
+/* Hierarchical timing wheel of timers with integer tick resolution.
+ *
+ * Every level has 64 slots, slot of the level N covers 64^N ticks. Timers
+ * which are too far in the future are stored in the lower resolution
+ * levels and are moved (cascaded) to the finer levels as the time goes.
+ * Scheduling, rescheduling and cancelling of a timer are O(1), advancing
+ * the wheel is O(ticks passed + timers expired).
+ *
+ * Timers are stored in linked lists of nodes allocated from a vector,
+ * node index is used as a handle of the timer.
+ */
+template<typename T>
+class timing_wheel {
+ public:
+  typedef int handle_type;
+  typedef uint64_t tick_type;
+
+  explicit timing_wheel(tick_type current_tick = 0)
+      : current_tick_(current_tick),
+        size_(0) {
+    slots_.resize(num_levels * slots_per_level, -1);
+  }
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+
+  /* Next tick which is to be processed by advance(). */
+  tick_type current_tick() const { return current_tick_; }
+
+  /* Check whether handle points to a timer which is still scheduled. */
+  bool contains(handle_type handle) const {
+    return handle >= 0 &&
+           handle < nodes_.size() &&
+           nodes_[handle].slot != -1;
+  }
+
+  const T& get(handle_type handle) const {
+    assert(contains(handle));
+    return nodes_[handle].value;
+  }
+
+  tick_type expire_tick(handle_type handle) const {
+    assert(contains(handle));
+    return nodes_[handle].expire_tick;
+  }
+
+  /* Schedule new timer, returns handle of the timer.
+   *
+   * Timers which are already overdue expire on the next advance().
+   */
+  handle_type schedule(const T& value, tick_type expire_tick) {
+    handle_type handle;
+    if(free_handles_.empty()) {
+      handle = nodes_.size();
+      nodes_.push_back(node());
+    } else {
+      handle = free_handles_.back();
+      free_handles_.pop_back();
+    }
+    node& new_node = nodes_[handle];
+    new_node.value = value;
+    new_node.expire_tick = expire_tick;
+    link(handle);
+    ++size_;
+    return handle;
+  }
+
+  /* Move timer to the new expiration tick, handle stays valid. */
+  void reschedule(handle_type handle, tick_type expire_tick) {
+    assert(contains(handle));
+    unlink(handle);
+    nodes_[handle].expire_tick = expire_tick;
+    link(handle);
+  }
+
+  /* Cancel the timer, handle becomes invalid. */
+  void cancel(handle_type handle) {
+    assert(contains(handle));
+    unlink(handle);
+    free_handles_.push_back(handle);
+    --size_;
+  }
+
+  /* Process all ticks up to the given one, including it.
+   *
+   * Values of the expired timers are appended to the given vector,
+   * their handles become invalid.
+   */
+  void advance(tick_type tick, vector<T> *expired) {
+    while(current_tick_ <= tick) {
+      if(size_ == 0) {
+        /* Nothing to cascade or expire, jump straight to the end. */
+        current_tick_ = tick + 1;
+        break;
+      }
+      int index = current_tick_ & slot_mask;
+      /* Cascade timers from the coarser levels when the finer level
+       * wraps around.
+       */
+      for(int level = 1; index == 0 && level < num_levels; ++level) {
+        index = (current_tick_ >> (level * slot_bits)) & slot_mask;
+        cascade(level * slots_per_level + index);
+      }
+      int slot = current_tick_ & slot_mask;
+      while(slots_[slot] != -1) {
+        handle_type handle = slots_[slot];
+        expired->push_back(nodes_[handle].value);
+        cancel(handle);
+      }
+      ++current_tick_;
+    }
+  }
+
+  void clear() {
+    nodes_.clear();
+    free_handles_.clear();
+    slots_.assign(num_levels * slots_per_level, -1);
+    size_ = 0;
+  }
+
+  /* Remove all timers and move the wheel to the given tick. */
+  void reset(tick_type current_tick) {
+    clear();
+    current_tick_ = current_tick;
+  }
+
+ protected:
+  enum {
+    slot_bits = 6,
+    slots_per_level = 1 << slot_bits,
+    slot_mask = slots_per_level - 1,
+    num_levels = 4,
+  };
+
+  struct node {
+    T value;
+    tick_type expire_tick;
+    /* Neighbours in the slot's list, -1 at the list ends. */
+    handle_type prev, next;
+    /* Slot the timer is linked to, -1 for unused nodes. */
+    int slot;
+  };
+
+  /* Find slot for the timer based on how far in the future it expires. */
+  int slot_for(tick_type expire_tick) const {
+    if(expire_tick < current_tick_) {
+      expire_tick = current_tick_;
+    }
+    tick_type delta = expire_tick - current_tick_;
+    for(int level = 0; level < num_levels; ++level) {
+      if(delta < ((tick_type)1 << ((level + 1) * slot_bits))) {
+        int index = (expire_tick >> (level * slot_bits)) & slot_mask;
+        return level * slots_per_level + index;
+      }
+    }
+    /* Too far in the future, park in the last slot reachable by the top
+     * level, timer will be re-linked when that slot cascades.
+     */
+    int level = num_levels - 1;
+    tick_type max_tick =
+        current_tick_ + ((tick_type)1 << (num_levels * slot_bits)) - 1;
+    int index = (max_tick >> (level * slot_bits)) & slot_mask;
+    return level * slots_per_level + index;
+  }
+
+  void link(handle_type handle) {
+    node& current = nodes_[handle];
+    current.slot = slot_for(current.expire_tick);
+    current.prev = -1;
+    current.next = slots_[current.slot];
+    if(current.next != -1) {
+      nodes_[current.next].prev = handle;
+    }
+    slots_[current.slot] = handle;
+  }
+
+  void unlink(handle_type handle) {
+    node& current = nodes_[handle];
+    if(current.prev != -1) {
+      nodes_[current.prev].next = current.next;
+    } else {
+      slots_[current.slot] = current.next;
+    }
+    if(current.next != -1) {
+      nodes_[current.next].prev = current.prev;
+    }
+    current.slot = -1;
+  }
+
+  /* Re-link all timers of the slot, moving them to finer levels. */
+  void cascade(int slot) {
+    handle_type handle = slots_[slot];
+    slots_[slot] = -1;
+    while(handle != -1) {
+      handle_type next = nodes_[handle].next;
+      link(handle);
+      handle = next;
+    }
+  }
+
+  tick_type current_tick_;
+  size_t size_;
+  vector<node> nodes_;
+  /* Heads of the slots' lists, -1 for empty slots. */
+  vector<handle_type> slots_;
+  /* Handles which could be re-used for new timers. */
+  vector<handle_type> free_handles_;
+};
+
+} /* namespace Farm */
+
+#endif  /* UTIL_TIMING_WHEEL_H_ */